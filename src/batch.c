@@ -0,0 +1,186 @@
+/* Copyright (c) 2010 Peter Cawley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include "batch.h"
+#include "threadpool.h"
+#include <stdlib.h>
+
+/**
+ * Get the current wall-clock time in seconds, from an arbitrary origin.
+ */
+static double now(void)
+{
+    return (double)verify_clock() * 1e-9;
+}
+
+verify_batch_t* verify_batch_create(lua_Alloc alloc, void* ud)
+{
+    verify_batch_t* batch = (verify_batch_t*)alloc(ud, NULL, 0,
+        sizeof(verify_batch_t));
+    if(batch == NULL)
+        return NULL;
+    batch->alloc = alloc;
+    batch->allocud = ud;
+    batch->ds = decode_bytecode_init(alloc, ud);
+    batch->vs = verify_state_create(alloc, ud, 0, 0);
+    if(batch->ds == NULL || batch->vs == NULL)
+    {
+        verify_batch_free(batch);
+        return NULL;
+    }
+    batch->ds->view = true;
+    batch->ds->verify = verify_decoded_prototype;
+    batch->ds->verifyud = batch->vs;
+    return batch;
+}
+
+int verify_batch_chunk(verify_batch_t* batch, const unsigned char* data,
+                       size_t len)
+{
+    int status = decode_bytecode_pump(batch->ds, data, len);
+    if(decode_bytecode_reset(batch->ds))
+        return DECODE_YIELD;
+    /* A chunk which ends early leaves the decoder waiting for more. */
+    return status == DECODE_YIELD ? DECODE_FAIL : status;
+}
+
+void verify_batch_free(verify_batch_t* batch)
+{
+    if(batch == NULL)
+        return;
+    if(batch->ds != NULL)
+        free_prototype(decode_bytecode_finish(batch->ds));
+    verify_state_free(batch->vs);
+    batch->alloc(batch->allocud, batch, sizeof(verify_batch_t), 0);
+}
+
+bool verify_many(const unsigned char* const* chunks, const size_t* lens,
+                 size_t numchunks, int* results, lua_Alloc alloc, void* ud)
+{
+    size_t i;
+    verify_batch_t* batch = verify_batch_create(alloc, ud);
+    if(batch == NULL)
+        return false;
+    for(i = 0; i < numchunks; ++i)
+        results[i] = verify_batch_chunk(batch, chunks[i], lens[i]);
+    verify_batch_free(batch);
+    return true;
+}
+
+struct chunk_order
+{
+    size_t len;
+    size_t index;
+};
+
+static int compare_chunk_order(const void* a, const void* b)
+{
+    const struct chunk_order* x = (const struct chunk_order*)a;
+    const struct chunk_order* y = (const struct chunk_order*)b;
+    if(x->len != y->len)
+        return x->len < y->len ? 1 : -1;
+    return x->index < y->index ? -1 : (x->index > y->index);
+}
+
+struct threaded_jobs
+{
+    const unsigned char* const* chunks;
+    const size_t* lens;
+    const struct chunk_order* order;
+    verify_batch_t** batches;
+    verify_result_t* results;
+};
+
+static void verify_threaded_job(void* ctx, size_t job, unsigned int worker)
+{
+    struct threaded_jobs* jobs = (struct threaded_jobs*)ctx;
+    size_t index = jobs->order[job].index;
+    verify_result_t* result = jobs->results + index;
+    double start = now();
+    result->status = verify_batch_chunk(jobs->batches[worker],
+        jobs->chunks[index], jobs->lens[index]);
+    result->seconds = now() - start;
+    result->worker = worker;
+}
+
+bool verify_many_threaded(const unsigned char* const* chunks,
+                          const size_t* lens, size_t numchunks,
+                          unsigned int numthreads, verify_result_t* results,
+                          lua_Alloc alloc, void* ud)
+{
+    struct threaded_jobs jobs;
+    struct chunk_order* order;
+    thread_pool_t* pool;
+    unsigned int i;
+    size_t j;
+    bool ok = false;
+
+    if(numchunks > (size_t)-1 / sizeof(struct chunk_order))
+        return false;
+    if(numthreads > numchunks)
+        numthreads = numchunks == 0 ? 1 : (unsigned int)numchunks;
+    pool = thread_pool_create(numthreads, alloc, ud);
+    if(pool == NULL)
+        return false;
+    numthreads = thread_pool_size(pool);
+    order = (struct chunk_order*)alloc(ud, NULL, 0,
+        numchunks * sizeof(struct chunk_order));
+    jobs.batches = (verify_batch_t**)alloc(ud, NULL, 0,
+        numthreads * sizeof(verify_batch_t*));
+    if(jobs.batches == NULL)
+        goto cleanup;
+    /* Before anything else can fail, so that cleanup sees no garbage. */
+    for(i = 0; i < numthreads; ++i)
+        jobs.batches[i] = NULL;
+    if(order == NULL && numchunks != 0)
+        goto cleanup;
+    for(i = 0; i < numthreads; ++i)
+    {
+        jobs.batches[i] = verify_batch_create(alloc, ud);
+        if(jobs.batches[i] == NULL)
+            goto cleanup;
+    }
+    for(j = 0; j < numchunks; ++j)
+    {
+        order[j].len = lens[j];
+        order[j].index = j;
+    }
+    if(numthreads > 1)
+        qsort(order, numchunks, sizeof(struct chunk_order), compare_chunk_order);
+
+    jobs.chunks = chunks;
+    jobs.lens = lens;
+    jobs.order = order;
+    jobs.results = results;
+    thread_pool_run(pool, numchunks, verify_threaded_job, &jobs);
+    ok = true;
+
+cleanup:
+    if(jobs.batches != NULL)
+    {
+        for(i = 0; i < numthreads; ++i)
+            verify_batch_free(jobs.batches[i]);
+        alloc(ud, jobs.batches, numthreads * sizeof(verify_batch_t*), 0);
+    }
+    if(order != NULL)
+        alloc(ud, order, numchunks * sizeof(struct chunk_order), 0);
+    thread_pool_destroy(pool);
+    return ok;
+}
@@ -0,0 +1,160 @@
+/* Copyright (c) 2010 Peter Cawley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#ifndef _LBCV_BATCH_H_
+#define _LBCV_BATCH_H_
+#include "defs.h"
+#include "decoder.h"
+#include "verifier.h"
+#include <lua.h>
+
+/**
+ * @file
+ * Verification of many chunks of bytecode in turn, reusing a single decode
+ * state and a single verifier scratch area for all of them, so that the cost
+ * of setting these up is paid once per batch rather than once per chunk.
+ * Scratch space only grows when a chunk needs more than any before it.
+ */
+
+/**
+ * The state which is carried from one chunk of a batch to the next.
+ */
+struct verify_batch
+{
+    /**
+     * A decode state which verifies each prototype as it is decoded, and is
+     * reset with decode_bytecode_reset() after each chunk.
+     */
+    decode_state_t* ds;
+    /**
+     * The verifier scratch space, which is also decode_state::verifyud of
+     * verify_batch::ds. The caller may set verify_state::cache.
+     */
+    verify_state_t* vs;
+    /**
+     * The allocator which the batch itself was allocated with.
+     */
+    lua_Alloc alloc;
+    void* allocud;
+};
+typedef struct verify_batch verify_batch_t;
+
+/**
+ * Create the state for verifying a batch of chunks.
+ *
+ * @param alloc The allocator function to use.
+ * @param ud An opaque pointer which will be passed to @p alloc.
+ *
+ * @return @c NULL on memory allocation failure, otherwise a batch which must
+ *         be freed with verify_batch_free().
+ */
+verify_batch_t* verify_batch_create(lua_Alloc alloc, void* ud);
+
+/**
+ * Decode and verify one complete chunk of bytecode.
+ *
+ * @param batch A batch created by verify_batch_create().
+ * @param data The bytecode, which need only remain valid until this returns.
+ * @param len The number of bytes at @p data.
+ *
+ * @return @c DECODE_YIELD if the chunk is safe, @c DECODE_FAIL if it is not
+ *         valid bytecode, @c DECODE_UNSAFE if it is valid bytecode which is
+ *         not safe, or @c DECODE_ERROR_MEM. The batch can be used for further
+ *         chunks whatever the result.
+ */
+int verify_batch_chunk(verify_batch_t* batch, const unsigned char* data,
+                       size_t len);
+
+/**
+ * Free a batch created by verify_batch_create().
+ *
+ * @param batch The batch to free. May be @c NULL.
+ */
+void verify_batch_free(verify_batch_t* batch);
+
+/**
+ * Decode and verify an array of chunks of bytecode, using a single batch.
+ *
+ * @param chunks The bytecode of each chunk.
+ * @param lens The length of each chunk.
+ * @param numchunks The number of chunks.
+ * @param results An array into which the result of verify_batch_chunk() for
+ *                each chunk is stored.
+ * @param alloc The allocator function to use.
+ * @param ud An opaque pointer which will be passed to @p alloc.
+ *
+ * @return @c false if the batch could not be created, in which case
+ *         @p results is not filled in, otherwise @c true.
+ */
+bool verify_many(const unsigned char* const* chunks, const size_t* lens,
+                 size_t numchunks, int* results, lua_Alloc alloc, void* ud);
+
+/**
+ * The outcome of verifying one chunk of a batch with verify_many_threaded().
+ */
+struct verify_result
+{
+    /**
+     * The result of verify_batch_chunk() for the chunk.
+     */
+    int status;
+    /**
+     * The wall-clock time, in seconds, spent decoding and verifying the chunk.
+     */
+    double seconds;
+    /**
+     * The index of the thread which verified the chunk, in the range
+     * [0, number of threads).
+     */
+    unsigned int worker;
+};
+typedef struct verify_result verify_result_t;
+
+/**
+ * Decode and verify an array of independent chunks of bytecode, spreading the
+ * chunks across a pool of threads. Each thread has a batch of its own, so
+ * threads share nothing but the read-only opcode tables, and idle threads
+ * claim the next chunks not yet started. The largest chunks are started
+ * first, so that a lone large chunk does not run on after all others are
+ * done.
+ *
+ * Unlike most functions taking an allocator, @p alloc is called concurrently
+ * from all of the threads, and so must be thread-safe.
+ *
+ * @param chunks The bytecode of each chunk.
+ * @param lens The length of each chunk.
+ * @param numchunks The number of chunks.
+ * @param numthreads The number of threads to use, including the calling
+ *                   thread. Values less than 1 are treated as 1, and fewer
+ *                   threads are used if not all can be started.
+ * @param results An array into which the outcome for each chunk is stored.
+ * @param alloc The allocator function to use.
+ * @param ud An opaque pointer which will be passed to @p alloc.
+ *
+ * @return @c false on memory allocation failure other than while verifying a
+ *         chunk, in which case @p results is not filled in, otherwise
+ *         @c true.
+ */
+bool verify_many_threaded(const unsigned char* const* chunks,
+                          const size_t* lens, size_t numchunks,
+                          unsigned int numthreads, verify_result_t* results,
+                          lua_Alloc alloc, void* ud);
+
+#endif /* _LBCV_BATCH_H_ */
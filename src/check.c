@@ -0,0 +1,391 @@
+/* Copyright (c) 2010 Peter Cawley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+/*
+** lbcv-check: verify every file of bytecode in a set of files and directory
+** trees, across a pool of threads, and print one line of results per file.
+**
+** Usage: lbcv-check [-j threads] [-q] path...
+**
+** Each result line has tab-separated fields:
+**   result  size  decode_us  verify_us  peak_bytes  path
+** where result is one of ok, invalid, unsafe, error, nomem, unreadable, or
+** text (for files which do not hold bytecode, and are not checked). With -q,
+** only lines for files which are not ok or text are printed. A summary goes
+** to stderr, and the exit status is 0 only if every file was ok or text.
+*/
+
+#include "decoder.h"
+#include "filebuf.h"
+#include "threadpool.h"
+#include "verifier.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__unix__) || defined(__unix) || \
+    (defined(__APPLE__) && defined(__MACH__))
+#define LBCV_USE_DIRENT
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#endif
+
+enum check_result
+{
+    CHECK_OK,
+    CHECK_INVALID,
+    CHECK_UNSAFE,
+    CHECK_ERROR,
+    CHECK_NOMEM,
+    CHECK_UNREADABLE,
+    CHECK_TEXT
+};
+
+static const char* const result_names[] = {
+    "ok", "invalid", "unsafe", "error", "nomem", "unreadable", "text"
+};
+
+struct check_file
+{
+    char* path;
+    enum check_result result;
+    size_t size;
+    double decode_seconds;
+    double verify_seconds;
+    size_t peak_bytes;
+};
+
+/*
+** Memory accounting for one worker thread. Each thread has its own, so the
+** counts need no locking.
+*/
+struct check_worker
+{
+    size_t live;
+    size_t peak;
+};
+
+struct check_jobs
+{
+    struct check_file* files;
+    struct check_worker* workers;
+};
+
+static void* check_alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    struct check_worker* w = (struct check_worker*)ud;
+    void* result;
+    if(nsize == 0)
+    {
+        if(ptr != NULL)
+            w->live -= osize;
+        free(ptr);
+        return NULL;
+    }
+    result = realloc(ptr, nsize);
+    if(result != NULL)
+    {
+        w->live += nsize - (ptr != NULL ? osize : 0);
+        if(w->live > w->peak)
+            w->peak = w->live;
+    }
+    return result;
+}
+
+static double now(void)
+{
+#ifdef LBCV_USE_DIRENT
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + (double)tv.tv_usec * 1e-6;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static enum check_result decode_result(int status)
+{
+    switch(status)
+    {
+    case DECODE_YIELD:
+    case DECODE_FAIL:
+        return CHECK_INVALID;
+    case DECODE_UNSAFE:
+        return CHECK_UNSAFE;
+    case DECODE_ERROR_MEM:
+        return CHECK_NOMEM;
+    default:
+        return CHECK_ERROR;
+    }
+}
+
+static void check_job(void* ctx, size_t job, unsigned int worker)
+{
+    struct check_jobs* jobs = (struct check_jobs*)ctx;
+    struct check_file* file = jobs->files + job;
+    struct check_worker* w = jobs->workers + worker;
+    size_t baseline = w->live;
+    const unsigned char* data;
+    const char* text;
+    decoded_prototype_t* proto;
+    decode_state_t* ds;
+    file_buffer_t fb;
+    size_t len;
+    double start;
+    int status;
+
+    w->peak = w->live;
+    if(read_file(&fb, file->path, check_alloc, w) != 0)
+    {
+        file->result = CHECK_UNREADABLE;
+        return;
+    }
+    text = (const char*)fb.data;
+    len = fb.size;
+    file->size = len;
+    skip_file_prefix(&text, &len);
+    data = (const unsigned char*)text;
+    if(len == 0 || data[0] != LUA_SIGNATURE[0])
+    {
+        file->result = CHECK_TEXT;
+        free_file_buffer(&fb);
+        return;
+    }
+
+    start = now();
+    ds = decode_bytecode_init(check_alloc, w);
+    if(ds == NULL)
+    {
+        file->result = CHECK_NOMEM;
+        free_file_buffer(&fb);
+        return;
+    }
+    ds->view = true;
+    status = decode_bytecode_pump(ds, data, len);
+    proto = decode_bytecode_finish(ds);
+    file->decode_seconds = now() - start;
+    if(proto == NULL)
+        file->result = decode_result(status);
+    else
+    {
+        start = now();
+        status = verify_budgeted(proto, check_alloc, w, NULL, NULL);
+        file->result = status == DECODE_YIELD ? CHECK_OK
+            : decode_result(status);
+        file->verify_seconds = now() - start;
+        free_prototype(proto);
+    }
+    free_file_buffer(&fb);
+    file->peak_bytes = w->peak - baseline;
+}
+
+struct file_list
+{
+    struct check_file* files;
+    size_t count;
+    size_t capacity;
+};
+
+static bool add_file(struct file_list* list, const char* path)
+{
+    struct check_file* file;
+    if(list->count == list->capacity)
+    {
+        size_t capacity = list->capacity ? list->capacity * 2 : 256;
+        struct check_file* files = (struct check_file*)realloc(list->files,
+            capacity * sizeof(struct check_file));
+        if(files == NULL)
+            return false;
+        list->files = files;
+        list->capacity = capacity;
+    }
+    file = list->files + list->count;
+    file->path = (char*)malloc(strlen(path) + 1);
+    if(file->path == NULL)
+        return false;
+    strcpy(file->path, path);
+    file->result = CHECK_UNREADABLE;
+    file->size = 0;
+    file->decode_seconds = 0;
+    file->verify_seconds = 0;
+    file->peak_bytes = 0;
+    ++list->count;
+    return true;
+}
+
+/*
+** Add a path to the list of files, descending into it if it is a directory.
+** Symbolic links to directories are skipped, so that cycles cannot occur.
+** Returns false on memory allocation failure.
+*/
+static bool add_path(struct file_list* list, const char* path)
+{
+#ifdef LBCV_USE_DIRENT
+    struct stat st;
+    struct dirent* entry;
+    DIR* dir;
+    size_t pathlen;
+
+    if(lstat(path, &st) == 0 && S_ISLNK(st.st_mode)
+    && stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+        return true;
+    if(lstat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+        return add_file(list, path);
+    dir = opendir(path);
+    if(dir == NULL)
+        return add_file(list, path);
+    pathlen = strlen(path);
+    while((entry = readdir(dir)) != NULL)
+    {
+        char* child;
+        bool ok;
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        child = (char*)malloc(pathlen + strlen(entry->d_name) + 2);
+        if(child == NULL)
+        {
+            closedir(dir);
+            return false;
+        }
+        strcpy(child, path);
+        if(pathlen == 0 || path[pathlen - 1] != '/')
+            strcat(child, "/");
+        strcat(child, entry->d_name);
+        ok = add_path(list, child);
+        free(child);
+        if(!ok)
+        {
+            closedir(dir);
+            return false;
+        }
+    }
+    closedir(dir);
+    return true;
+#else
+    return add_file(list, path);
+#endif
+}
+
+static int compare_paths(const void* a, const void* b)
+{
+    return strcmp(((const struct check_file*)a)->path,
+        ((const struct check_file*)b)->path);
+}
+
+int main(int argc, char** argv)
+{
+    struct file_list list = {NULL, 0, 0};
+    struct check_jobs jobs;
+    struct check_worker* workers;
+    struct check_worker poolmemory = {0, 0};
+    thread_pool_t* pool;
+    unsigned long numthreads = thread_pool_default_size();
+    unsigned long counts[CHECK_TEXT + 1] = {0};
+    double start, elapsed, totalbytes = 0, decode = 0, verify_time = 0;
+    size_t i, peak = 0;
+    bool quiet = false;
+    int argi;
+
+    for(argi = 1; argi < argc && argv[argi][0] == '-'; ++argi)
+    {
+        if(strcmp(argv[argi], "-j") == 0 && argi + 1 < argc)
+            numthreads = strtoul(argv[++argi], NULL, 10);
+        else if(strncmp(argv[argi], "-j", 2) == 0 && argv[argi][2] != '\0')
+            numthreads = strtoul(argv[argi] + 2, NULL, 10);
+        else if(strcmp(argv[argi], "-q") == 0)
+            quiet = true;
+        else if(strcmp(argv[argi], "--") == 0)
+        {
+            ++argi;
+            break;
+        }
+        else
+            break;
+    }
+    if(argi >= argc || numthreads == 0)
+    {
+        fprintf(stderr, "usage: %s [-j threads] [-q] path...\n", argv[0]);
+        return 2;
+    }
+
+    for(; argi < argc; ++argi)
+    {
+        if(!add_path(&list, argv[argi]))
+        {
+            fprintf(stderr, "%s: insufficient memory\n", argv[0]);
+            return 2;
+        }
+    }
+    /* Report files in a stable order, whatever order directories list
+       them in. */
+    qsort(list.files, list.count, sizeof(struct check_file), compare_paths);
+
+    pool = thread_pool_create((unsigned int)numthreads, check_alloc,
+        &poolmemory);
+    workers = (struct check_worker*)calloc(numthreads,
+        sizeof(struct check_worker));
+    if(pool == NULL || workers == NULL)
+    {
+        fprintf(stderr, "%s: insufficient memory\n", argv[0]);
+        return 2;
+    }
+    jobs.files = list.files;
+    jobs.workers = workers;
+    start = now();
+    thread_pool_run(pool, list.count, check_job, &jobs);
+    elapsed = now() - start;
+    numthreads = thread_pool_size(pool);
+    thread_pool_destroy(pool);
+
+    for(i = 0; i < list.count; ++i)
+    {
+        struct check_file* file = list.files + i;
+        ++counts[file->result];
+        totalbytes += (double)file->size;
+        decode += file->decode_seconds;
+        verify_time += file->verify_seconds;
+        if(file->peak_bytes > peak)
+            peak = file->peak_bytes;
+        if(!quiet || (file->result != CHECK_OK && file->result != CHECK_TEXT))
+        {
+            printf("%s\t%lu\t%.0f\t%.0f\t%lu\t%s\n", result_names[file->result],
+                (unsigned long)file->size, file->decode_seconds * 1e6,
+                file->verify_seconds * 1e6, (unsigned long)file->peak_bytes,
+                file->path);
+        }
+        free(file->path);
+    }
+    fprintf(stderr, "%lu files (%lu ok, %lu invalid, %lu unsafe, %lu error, "
+        "%lu nomem, %lu unreadable, %lu text), %.1f MB in %.3f s with %lu "
+        "threads: %.0f files/s, %.1f MB/s; decode %.3f s, verify %.3f s, "
+        "peak %lu bytes\n", (unsigned long)list.count, counts[CHECK_OK],
+        counts[CHECK_INVALID], counts[CHECK_UNSAFE], counts[CHECK_ERROR],
+        counts[CHECK_NOMEM], counts[CHECK_UNREADABLE], counts[CHECK_TEXT],
+        totalbytes / 1e6, elapsed, numthreads,
+        elapsed > 0 ? (double)list.count / elapsed : 0,
+        elapsed > 0 ? totalbytes / 1e6 / elapsed : 0, decode, verify_time,
+        (unsigned long)peak);
+    free(list.files);
+    free(workers);
+    return counts[CHECK_OK] + counts[CHECK_TEXT] == list.count ? 0 : 1;
+}
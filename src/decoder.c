@@ -21,6 +21,9 @@ SOFTWARE. */
 #include "decoder.h"
 #include "opcodes.h"
 #include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #if 1
 #define LUAI_MAXCCALLS 200
 #else
@@ -53,8 +56,9 @@ static int extract_bits(unsigned char* bytes, int first, int len)
 
     if(first + len <= sizeof(int) * 8)
     {
-        /* Simple case; read an entire int. */
-        result = *(unsigned int*)bytes;
+        /* Simple case; read an entire int. The bytes might be borrowed from
+           an input buffer, so they are not necessarily suitably aligned. */
+        memcpy(&result, bytes, sizeof(result));
     }
     else
     {
@@ -130,6 +134,77 @@ bool decode_instruction(decoded_prototype_t* proto, size_t index, int* op,
     return true;
 }
 
+void decode_instructions(decoded_prototype_t* proto, unsigned char* op,
+                         int* a, int* b, int* c)
+{
+    size_t i, n = proto->numinstructions;
+    unsigned char modes[1 << SIZE_OP];
+
+    /* The instruction mode for each possible value of the opcode field, with
+       iAx + 1 marking opcodes which are not known. */
+    for(i = 0; i < sizeof(modes); ++i)
+        modes[i] = i < NUM_OPCODES ? getOpMode(i) : iAx + 1;
+
+    if(proto->instructionsize != 4 || sizeof(unsigned int) != 4)
+    {
+        /* Uncommon instruction size; go through the general decoder. */
+        for(i = 0; i < n; ++i)
+        {
+            int iop;
+            decode_instruction(proto, i, &iop, a + i, b + i, c + i);
+            op[i] = (unsigned char)iop;
+        }
+        return;
+    }
+
+    /* First pass: pull every field out of every instruction as if it was in
+       iABC mode. This loop has no branches or table lookups, so the compiler
+       is free to vectorise it. */
+    for(i = 0; i < n; ++i)
+    {
+        unsigned int ins;
+        memcpy(&ins, proto->code + i * 4, 4);
+        op[i] = (unsigned char)((ins >> POS_OP) & ((1 << SIZE_OP) - 1));
+        a[i] = (int)((ins >> POS_A) & MAXARG_A);
+        b[i] = (int)((ins >> POS_B) & MAXARG_B);
+        c[i] = (int)((ins >> POS_C) & MAXARG_C);
+    }
+
+    /* Second pass: recombine the fields of instructions in other modes.
+       As Bx is C followed by B, and Ax is A followed by Bx, these can be
+       rebuilt from the iABC fields without going back to the instruction. */
+    for(i = 0; i < n; ++i)
+    {
+        switch(modes[op[i]])
+        {
+        case iABC:
+            break;
+
+        case iABx:
+            b[i] = c[i] | (b[i] << SIZE_C);
+            c[i] = -1;
+            break;
+
+        case iAsBx:
+            b[i] = (c[i] | (b[i] << SIZE_C)) - MAXARG_sBx;
+            c[i] = -1;
+            break;
+
+        case iAx:
+            a[i] = a[i] | (c[i] << SIZE_A) | (b[i] << (SIZE_A + SIZE_C));
+            b[i] = -1;
+            c[i] = -1;
+            break;
+
+        default:
+            a[i] = -1;
+            b[i] = -1;
+            c[i] = -1;
+            break;
+        }
+    }
+}
+
 /**
  * Helper function to read a range of bytes from the reading stream of a decode
  * state.
@@ -170,6 +245,36 @@ static bool read(decode_state_t* ds, unsigned char* dest, size_t sz)
     return true;
 }
 
+/**
+ * Helper function to parse a single unsigned integer out of an array of bytes
+ * in the integer format of a decode state.
+ *
+ * @param ds A decode_state_t whose header has been decoded.
+ * @param bytes The bytes of the integer.
+ * @param dest A pointer to a variable into which the read integer will be
+ *             stored in the event of a successful parse.
+ * @param sz The size, in bytes, of the integer.
+ *
+ * @return @c false if the value of the integer was too large to fit in
+ * a @c size_t. @c true otherwise.
+ */
+static bool parse_int_at(const decode_state_t* ds, const unsigned char* bytes,
+                         size_t* dest, size_t sz)
+{
+    size_t result = 0, n;
+    for(n = 0; n < sz; ++n)
+    {
+        /* Take bytes from most significant to least significant. */
+        unsigned char c = bytes[ds->littleendian ? sz - 1 - n : n];
+        if((result >> (sizeof(size_t) * 8 - 8)) != 0)
+            return false;
+        result = (result << 8) | c;
+    }
+    if(dest)
+        *dest = result;
+    return true;
+}
+
 /**
  * Helper function to parse a single unsigned integer out of the bytes in the
  * buffer of a decode state.
@@ -184,39 +289,29 @@ static bool read(decode_state_t* ds, unsigned char* dest, size_t sz)
  */
 static bool parse_int(decode_state_t* ds, size_t* dest, size_t sz)
 {
-    size_t result = 0;
-    if(!ds->swapendian && sz <= sizeof(size_t))
-    {
-        if(ds->littleendian)
-            memcpy((void*)&result, (void*)ds->buffer, sz);
-        else
-            memcpy(((char*)&result)+sizeof(size_t)-sz, (void*)ds->buffer, sz);
-    }
-    if(ds->littleendian)
-    {
-        size_t shift = 0, n;
-        for(n = 0; n < sz; ++n, shift += 8)
-        {
-            unsigned char c = ds->buffer[n];
-            if(c != 0 && shift >= sizeof(result) * 8)
-                return false;
-            result |= (c << shift);
-        }
-    }
-    else
+    return parse_int_at(ds, ds->buffer, dest, sz);
+}
+
+/**
+ * Variant of parse_int() for integers which are in native endianness and are
+ * exactly the size of either an unsigned @c int or a @c size_t.
+ *
+ * This is only used when the sizes are known at compile time, in which case
+ * it reduces to a single load.
+ */
+static bool parse_native(decode_state_t* ds, size_t* dest, size_t sz)
+{
+    if(dest)
     {
-        size_t n, shifted;
-        for(n = 0; n < sz; ++n)
+        if(sz == sizeof(unsigned int))
         {
-            unsigned char c = ds->buffer[n];
-            shifted = result << 8;
-            if((shifted >> 8) != result)
-                return false;
-            result |= c;
+            unsigned int result;
+            memcpy(&result, ds->buffer, sizeof(result));
+            *dest = result;
         }
+        else
+            memcpy(dest, ds->buffer, sizeof(size_t));
     }
-    if(dest)
-        *dest = result;
     return true;
 }
 
@@ -241,7 +336,9 @@ bool decode_header(decode_state_t* ds)
         return false; /* Only official format bytecode is supported. */
 
     /* Pull out endianness and sizes. */
-    ds->littleendian = 1 == (*(unsigned char*)&endian);
+    if(p[2] > 1)
+        return false;
+    ds->littleendian = p[2] == 1;
     ds->swapendian = p[2] != *(unsigned char*)&endian;
     ds->sizeint = p[3];
     ds->sizesize = p[4];
@@ -280,10 +377,164 @@ bool decode_header(decode_state_t* ds)
     return true;
 }
 
+/**
+ * Header at the start of every block owned by a decode_arena_t.
+ */
+struct decode_arena_block
+{
+    struct decode_arena_block* next;
+    /** The total size of the block, including this header. */
+    size_t size;
+};
+
+/**
+ * Type with the strictest alignment requirement of anything which is placed
+ * in an arena.
+ */
+typedef union
+{
+    void* p;
+    size_t s;
+    double d;
+} arena_align_t;
+
+#define ARENA_ALIGN(x) \
+    (((x) + sizeof(arena_align_t) - 1) & ~(sizeof(arena_align_t) - 1))
+#define ARENA_BLOCK_HEADER ARENA_ALIGN(sizeof(struct decode_arena_block))
+
+/** Default size of the first block of an arena. */
+#define ARENA_MIN_BLOCK 4096
+
+/** Size beyond which arena blocks stop doubling in size. */
+#define ARENA_MAX_BLOCK (1 << 20)
+
+static decode_arena_t* arena_create(lua_Alloc alloc, void* allocud,
+                                    size_t size)
+{
+    struct decode_arena_block* block;
+    decode_arena_t* arena;
+    size_t total;
+
+    if(size < ARENA_MIN_BLOCK)
+        size = ARENA_MIN_BLOCK;
+    size = ARENA_ALIGN(size);
+    total = ARENA_BLOCK_HEADER + ARENA_ALIGN(sizeof(decode_arena_t)) + size;
+    if(total < size)
+        return NULL;
+    block = (struct decode_arena_block*)alloc(allocud, NULL, 0, total);
+    if(block == NULL)
+        return NULL;
+    block->next = NULL;
+    block->size = total;
+
+    arena = (decode_arena_t*)((unsigned char*)block + ARENA_BLOCK_HEADER);
+    arena->alloc = alloc;
+    arena->allocud = allocud;
+    arena->blocks = block;
+    arena->top = (unsigned char*)arena + ARENA_ALIGN(sizeof(decode_arena_t));
+    arena->avail = size;
+    arena->blocksize = size < ARENA_MAX_BLOCK ? size * 2 : size;
+    arena->used = 0;
+    return arena;
+}
+
+static void* arena_alloc(decode_arena_t* arena, size_t sz)
+{
+    struct decode_arena_block* block;
+    void* result;
+
+    if(sz > (size_t)-1 - ARENA_BLOCK_HEADER - sizeof(arena_align_t))
+        return NULL;
+    sz = ARENA_ALIGN(sz);
+    if(sz > arena->avail)
+    {
+        if(sz > arena->blocksize / 4)
+        {
+            /* Large requests get a block of their own, which is linked in
+               behind the current block so that the remainder of the current
+               block is not wasted. */
+            block = (struct decode_arena_block*)arena->alloc(arena->allocud,
+                NULL, 0, ARENA_BLOCK_HEADER + sz);
+            if(block == NULL)
+                return NULL;
+            block->size = ARENA_BLOCK_HEADER + sz;
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+            arena->used += sz;
+            return (unsigned char*)block + ARENA_BLOCK_HEADER;
+        }
+        block = (struct decode_arena_block*)arena->alloc(arena->allocud,
+            NULL, 0, ARENA_BLOCK_HEADER + arena->blocksize);
+        if(block == NULL)
+            return NULL;
+        block->size = ARENA_BLOCK_HEADER + arena->blocksize;
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->top = (unsigned char*)block + ARENA_BLOCK_HEADER;
+        arena->avail = arena->blocksize;
+        if(arena->blocksize < ARENA_MAX_BLOCK)
+            arena->blocksize *= 2;
+    }
+    result = arena->top;
+    arena->top += sz;
+    arena->avail -= sz;
+    arena->used += sz;
+    return result;
+}
+
+static void arena_free(decode_arena_t* arena)
+{
+    /* The arena lives inside one of its own blocks, so copy out everything
+       needed before starting to free them. */
+    lua_Alloc alloc = arena->alloc;
+    void* allocud = arena->allocud;
+    struct decode_arena_block* block = arena->blocks;
+    while(block != NULL)
+    {
+        struct decode_arena_block* next = block->next;
+        alloc(allocud, (void*)block, block->size, 0);
+        block = next;
+    }
+}
+
+/**
+ * Discard everything allocated from an arena, so that it can be used for
+ * another tree. An arena which never grew beyond its first block keeps that
+ * block. Otherwise, the arena is freed, and @p nextsize is raised to its
+ * high-water mark, so that a stream of similar trees soon fits in a single
+ * block.
+ *
+ * @return The arena to continue with, which may be @c NULL.
+ */
+static decode_arena_t* arena_reset(decode_arena_t* arena, size_t* nextsize)
+{
+    if(arena->blocks->next == NULL)
+    {
+        arena->top = (unsigned char*)arena + ARENA_ALIGN(sizeof(decode_arena_t));
+        arena->avail = arena->blocks->size - ARENA_BLOCK_HEADER
+            - ARENA_ALIGN(sizeof(decode_arena_t));
+        arena->used = 0;
+        return arena;
+    }
+    if(*nextsize < arena->used)
+        *nextsize = arena->used < ARENA_MAX_BLOCK ? arena->used : ARENA_MAX_BLOCK;
+    arena_free(arena);
+    return NULL;
+}
+
+#define alloc_arena(ds, typ, n) ((typ*)arena_alloc((ds)->arena, \
+    sizeof(typ) * (n)))
+
 static decoded_prototype_t* alloc_proto(decode_state_t* ds)
 {
-    decoded_prototype_t* proto = (decoded_prototype_t*)ds->alloc(ds->allocud,
-        NULL, 0, sizeof(decoded_prototype_t));
+    decoded_prototype_t* proto;
+    if(ds->arena == NULL)
+    {
+        ds->arena = arena_create(ds->alloc, ds->allocud, ds->arenasize);
+        if(ds->arena == NULL)
+            return NULL;
+    }
+    proto = alloc_arena(ds, decoded_prototype_t, 1);
     if(proto != NULL)
     {
         proto->code = NULL;
@@ -299,38 +550,44 @@ static decoded_prototype_t* alloc_proto(decode_state_t* ds)
         proto->numregs = 0;
         proto->numparams = 0;
         proto->is_vararg = false;
+        proto->code_borrowed = false;
+        proto->arena = NULL;
     }
     return proto;
 }
 
-void free_prototype(decoded_prototype_t* proto, lua_Alloc alloc, void* ud)
+/**
+ * Allocate an instruction array for a prototype being decoded by the pump.
+ *
+ * When prototypes are verified as they are decoded, instruction arrays are
+ * released as soon as they have been verified, so they are obtained directly
+ * from the allocator rather than from the arena.
+ */
+static unsigned char* alloc_code(decode_state_t* ds, size_t sz)
 {
-    if(proto == NULL)
-        return;
+    if(ds->verify != NULL)
+        return (unsigned char*)ds->alloc(ds->allocud, NULL, 0, sz);
+    return alloc_arena(ds, unsigned char, sz);
+}
 
-    if(proto->code != NULL)
-    {
-        alloc(ud, (void*)proto->code, sizeof(int) + proto->numinstructions *
-            proto->instructionsize, 0);
-    }
-    if(proto->constant_types != NULL)
-        alloc(ud, (void*)proto->constant_types, proto->numconstants, 0);
-    if(proto->prototypes)
-    {
-        size_t i;
-        for(i = 0; i < proto->numprototypes; ++i)
-            free_prototype(proto->prototypes[i], alloc, ud);
-        alloc(ud, (void*)proto->prototypes, sizeof(decoded_prototype_t*) *
-            proto->numprototypes, 0);
-    }
-    if(proto->upvalue_instack)
+/**
+ * Release an instruction array obtained from alloc_code() while
+ * decode_state::verify was set.
+ */
+static void free_code(decode_state_t* ds, decoded_prototype_t* proto)
+{
+    if(proto->code != NULL && !proto->code_borrowed)
     {
-        alloc(ud, (void*)proto->upvalue_instack, proto->numupvalues *
-            sizeof(bool), 0);
+        ds->alloc(ds->allocud, proto->code,
+            proto->instructionsize * proto->numinstructions + sizeof(int), 0);
     }
-    if(proto->upvalue_index)
-        alloc(ud, (void*)proto->upvalue_index, proto->numupvalues, 0);
-    alloc(ud, (void*)proto, sizeof(decoded_prototype_t), 0);
+    proto->code = NULL;
+}
+
+void free_prototype(decoded_prototype_t* proto)
+{
+    if(proto != NULL && proto->arena != NULL)
+        arena_free(proto->arena);
 }
 
 static void byteswap(unsigned char* bytes, size_t n)
@@ -345,15 +602,59 @@ static void byteswap(unsigned char* bytes, size_t n)
     }
 }
 
-static bool is_signalling_nan(decode_state_t* ds, unsigned char* number)
+/**
+ * Swap the byte order of every instruction in an instruction array.
+ *
+ * @param code The instruction array.
+ * @param n The number of instructions in the array.
+ * @param sz The number of bytes per instruction.
+ */
+static void byteswap_instructions(unsigned char* code, size_t n, size_t sz)
 {
-    if(ds->integralnum)
-        return false; /* NaNs don't exist in integers */
+    size_t i = 0;
+    if(sz != 4 || sizeof(unsigned int) != 4)
+    {
+        for(; i < n; ++i)
+            byteswap(code + i * sz, sz);
+        return;
+    }
+#if defined(__SSE2__)
+    /* Four instructions at a time: swap the bytes within each 16-bit lane,
+       and then swap the pairs of 16-bit lanes. */
+    for(; i + 4 <= n; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(code + i * 4));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128((__m128i*)(code + i * 4), v);
+    }
+#endif
+    for(; i < n; ++i)
+    {
+        unsigned int ins;
+        memcpy(&ins, code + i * 4, 4);
+        ins = (ins >> 24) | ((ins >> 8) & 0xFF00u) | ((ins << 8) & 0xFF0000u)
+            | (ins << 24);
+        memcpy(code + i * 4, &ins, 4);
+    }
+}
 
-    switch(ds->sizenum)
+/**
+ * Determine whether a floating point number is a NaN of the kind which could
+ * be mistaken for some other type of value.
+ *
+ * @param number The bytes of the number, in the order of the bytecode stream.
+ * @param sizenum The number of bytes in the number.
+ * @param littleendian Whether the bytecode stream is little endian.
+ */
+static bool is_nan_bytes(const unsigned char* number, size_t sizenum,
+                         bool littleendian)
+{
+    switch(sizenum)
     {
     case 4:
-        if(ds->littleendian)
+        if(littleendian)
         {
             return (number[3] & 0x7F) == 0x7F
                 && (number[2] & 0xC0) == 0xC0;
@@ -364,7 +665,7 @@ static bool is_signalling_nan(decode_state_t* ds, unsigned char* number)
                 && (number[1] & 0xC0) == 0xC0;
         }
     case 8:
-        if(ds->littleendian)
+        if(littleendian)
         {
             return (number[7] & 0x7F) == 0x7F
                 && (number[6] & 0xF8) == 0xF8;
@@ -381,6 +682,34 @@ static bool is_signalling_nan(decode_state_t* ds, unsigned char* number)
     }
 }
 
+static bool is_signalling_nan(decode_state_t* ds, unsigned char* number)
+{
+    if(ds->integralnum)
+        return false; /* NaNs don't exist in integers */
+
+    return is_nan_bytes(number, ds->sizenum, ds->littleendian);
+}
+
+/**
+ * The header settings of nearly all bytecode in practice: little endian, with
+ * 4 byte ints, 8 byte size_ts, 4 byte instructions, and 8 byte doubles.
+ * Bytecode with these settings, being decoded on a little endian machine with
+ * the same sizes, is decoded by a specialised copy of the decoder.
+ */
+#define COMMON_SIZEINT 4
+#define COMMON_SIZESIZE 8
+#define COMMON_SIZEINS 4
+#define COMMON_SIZENUM 8
+
+static bool is_common_layout(decode_state_t* ds)
+{
+    return !ds->swapendian && ds->littleendian && !ds->integralnum
+        && ds->sizeint == COMMON_SIZEINT && ds->sizesize == COMMON_SIZESIZE
+        && ds->sizeins == COMMON_SIZEINS && ds->sizenum == COMMON_SIZENUM
+        && sizeof(unsigned int) == COMMON_SIZEINT
+        && sizeof(size_t) == COMMON_SIZESIZE;
+}
+
 /**
  * Special value for decode_state::yieldpos indicating that the bytecode
  * header needs to be supplied and then subsequently decoded.
@@ -393,6 +722,12 @@ static bool is_signalling_nan(decode_state_t* ds, unsigned char* number)
  */
 #define DECODE_YIELDPOS_DONE 1
 
+/**
+ * Special value for decode_state::yieldpos indicating that the header has been
+ * decoded, and the main prototype is to be decoded next.
+ */
+#define DECODE_YIELDPOS_ENTER 2
+
 /**
  * The number of bytes required for a decode_state_t structure due to the
  * variably sized array at the end of the structure.
@@ -413,6 +748,14 @@ decode_state_t* decode_bytecode_init(lua_Alloc alloc, void* allocud)
         ds->chunk = NULL;
         ds->chunklen = 0;
         ds->level = 0;
+        ds->view = false;
+        ds->arena = NULL;
+        ds->arenasize = ARENA_MIN_BLOCK;
+        ds->verify = NULL;
+        ds->verifyud = NULL;
+        ds->hashing = false;
+        chunk_hash_init(&ds->hash, chunk_key_process());
+        ds->commonlayout = false;
         /*  The header needs to be read. */
         ds->readlen = HEADER_SIZE;
         ds->readtarget = ds->buffer;
@@ -421,221 +764,448 @@ decode_state_t* decode_bytecode_init(lua_Alloc alloc, void* allocud)
     return ds;
 }
 
-#define READ(dest, len) \
-    if(!read(ds, dest, len)) \
-        return (ds->yieldpos = __LINE__), DECODE_YIELD; \
-    case __LINE__:
-
-#define READ_INT(dest, len) \
-    if(!read(ds, ds->buffer, len)) \
-        return (ds->yieldpos = __LINE__), DECODE_YIELD; \
-    case __LINE__: \
-    if(!parse_int(ds, dest, len)) return DECODE_FAIL
+/* Decoder specialised for the common header settings. */
+#define DECODE_PUMP decode_pump_common
+#define SIZEINT COMMON_SIZEINT
+#define SIZESIZE COMMON_SIZESIZE
+#define SIZEINS COMMON_SIZEINS
+#define SIZENUM COMMON_SIZENUM
+#define SWAPENDIAN false
+#define PARSE_INT(dest, len) parse_native(ds, dest, len)
+#define IS_SIGNALLING_NAN(number) is_nan_bytes(number, COMMON_SIZENUM, true)
+#include "decoder_pump.h"
+#undef DECODE_PUMP
+#undef SIZEINT
+#undef SIZESIZE
+#undef SIZEINS
+#undef SIZENUM
+#undef SWAPENDIAN
+#undef PARSE_INT
+#undef IS_SIGNALLING_NAN
 
-#define SKIP_STRING_1() \
-    if(!read(ds, ds->buffer, ds->sizesize)) \
-        return (ds->yieldpos = __LINE__), DECODE_YIELD; \
-    case __LINE__: \
-    if(!parse_int(ds, &ds->readlen, ds->sizesize)) return DECODE_FAIL
-
-#define SKIP_STRING_2() \
-    if(!read(ds, NULL, ds->readlen)) \
-        return (ds->yieldpos = __LINE__), DECODE_YIELD; \
-    case __LINE__:
-
-#define i ds->i
+/* Decoder for any other header settings. */
+#define DECODE_PUMP decode_pump_generic
+#define SIZEINT ds->sizeint
+#define SIZESIZE ds->sizesize
+#define SIZEINS ds->sizeins
+#define SIZENUM ds->sizenum
+#define SWAPENDIAN ds->swapendian
+#define PARSE_INT(dest, len) parse_int(ds, dest, len)
+#define IS_SIGNALLING_NAN(number) is_signalling_nan(ds, number)
+#include "decoder_pump.h"
+#undef DECODE_PUMP
+#undef SIZEINT
+#undef SIZESIZE
+#undef SIZEINS
+#undef SIZENUM
+#undef SWAPENDIAN
+#undef PARSE_INT
+#undef IS_SIGNALLING_NAN
 
 int decode_bytecode_pump(decode_state_t* ds, const unsigned char* pData, size_t iLength)
 {
-    decoded_prototype_t* proto;
-    
+    if(ds->hashing)
+        chunk_hash_update(&ds->hash, pData, iLength);
+
     /* Continue the read operation which caused the yield. */
     ds->chunk = pData;
     ds->chunklen = iLength;
     if(!read(ds, ds->readtarget, ds->readlen))
         return DECODE_YIELD;
-        
-    proto = ds->stack[ds->level - 1];
 
-    switch(ds->yieldpos)
+    if(ds->yieldpos == DECODE_YIELDPOS_HEADER)
     {
-    case DECODE_YIELDPOS_HEADER:
         if(!decode_header(ds))
             return DECODE_FAIL;
+        ds->commonlayout = is_common_layout(ds);
+        ds->yieldpos = DECODE_YIELDPOS_ENTER;
+    }
 
-        /* Main prototype decoding function */
-ENTER_CHILD_PROTO:
-        if(ds->level >= LUAI_MAXCCALLS)
-            return DECODE_UNSAFE;
-        proto = alloc_proto(ds);
-        if(proto == NULL)
-            return DECODE_ERROR_MEM;
-        ds->stack[ds->level++] = proto;
+    if(ds->commonlayout)
+        return decode_pump_common(ds);
+    else
+        return decode_pump_generic(ds);
+}
+
+int decode_bytecode_resume(decode_state_t* ds)
+{
+    /* The rest of the input given to the paused pump is still in ds->chunk,
+       and nothing is waiting to be read, so the pump carries straight on. */
+    if(ds->commonlayout)
+        return decode_pump_common(ds);
+    else
+        return decode_pump_generic(ds);
+}
+
+decoded_prototype_t* decode_bytecode_finish(decode_state_t* ds)
+{
+    /* Get the return value, if there is one. */
+    decoded_prototype_t* result = NULL;
+    if(ds->yieldpos == DECODE_YIELDPOS_DONE && ds->level == 0)
+        result = ds->stack[0];
 
-        READ(NULL, ds->sizeint * 2);
-        READ(ds->buffer, 3);
+    /* Instruction arrays which are not in the arena belong to prototypes
+       still on the stack, which were not verified. */
+    if(ds->verify != NULL)
+    {
+        int level;
+        for(level = 0; level < ds->level; ++level)
+            free_code(ds, ds->stack[level]);
+    }
 
-        proto->numparams = ds->buffer[0];
-        proto->is_vararg = ds->buffer[1] != 0;
-        proto->numregs = ds->buffer[2];
+    /* Hand the arena over to the result, or free it (and with it, any partly
+       decoded prototypes still on the stack). */
+    if(result != NULL)
+        result->arena = ds->arena;
+    else if(ds->arena != NULL)
+        arena_free(ds->arena);
 
-        /* Code */
-        proto->instructionsize = ds->sizeins;
-        READ_INT(&proto->numinstructions, ds->sizeint);
-        if(proto->numinstructions == 0)
-            return DECODE_UNSAFE;
-        proto->code = (unsigned char*)ds->alloc(ds->allocud, NULL, 0,
+    /* Free the decode state itself. */
+    ds->alloc(ds->allocud, ds, SIZEOF_decode_state_t, 0);
+
+    return result;
+}
+
+bool decode_bytecode_reset(decode_state_t* ds)
+{
+    int level;
+    bool complete = ds->yieldpos == DECODE_YIELDPOS_DONE && ds->level == 0;
+
+    if(ds->verify != NULL)
+    {
+        for(level = 0; level < ds->level; ++level)
+            free_code(ds, ds->stack[level]);
+    }
+    if(ds->arena != NULL)
+        ds->arena = arena_reset(ds->arena, &ds->arenasize);
+
+    ds->chunk = NULL;
+    ds->chunklen = 0;
+    ds->level = 0;
+    ds->commonlayout = false;
+    ds->readlen = HEADER_SIZE;
+    ds->readtarget = ds->buffer;
+    ds->yieldpos = DECODE_YIELDPOS_HEADER;
+    chunk_hash_init(&ds->hash, chunk_key_process());
+    return complete;
+}
+
+/**
+ * Initial capacity of decode_index::entries.
+ */
+#define DECODE_INDEX_MIN_ENTRIES 16
+
+static bool index_add_entry(decode_state_t* ds, decode_index_t* index,
+                            decoded_prototype_t* proto)
+{
+    decode_index_entry_t* entry;
+    if(index->numentries == index->capacity)
+    {
+        size_t capacity = index->capacity * 2;
+        decode_index_entry_t* entries;
+        if(capacity == 0)
+            capacity = DECODE_INDEX_MIN_ENTRIES;
+        if(capacity > (size_t)-1 / sizeof(decode_index_entry_t))
+            return false;
+        entries = (decode_index_entry_t*)ds->alloc(ds->allocud,
+            index->entries, index->capacity * sizeof(decode_index_entry_t),
+            capacity * sizeof(decode_index_entry_t));
+        if(entries == NULL)
+            return false;
+        index->entries = entries;
+        index->capacity = capacity;
+    }
+    entry = index->entries + index->numentries++;
+    entry->proto = proto;
+    entry->code = 0;
+    entry->constants = 0;
+    entry->upvalues = 0;
+    return true;
+}
+
+/* Helpers for the prescan, which reads from a single contiguous buffer. Each
+   one fails the scan if the buffer is too short. */
+#define SCAN_NEED(n) \
+    if((n) > len - pos) return DECODE_FAIL
+#define SCAN_SKIP(n) \
+    SCAN_NEED(n); pos += (n)
+#define SCAN_INT(dest, sz) \
+    SCAN_NEED(sz); \
+    if(!parse_int_at(ds, data + pos, dest, sz)) return DECODE_FAIL; \
+    pos += (sz)
+#define SCAN_ARRAY(n, sz) \
+    if((n) > (len - pos) / (sz)) return DECODE_FAIL; \
+    pos += (n) * (sz)
+#define SCAN_STRING() \
+    SCAN_INT(&n, ds->sizesize); \
+    SCAN_SKIP(n)
+
+static int scan_prototypes(decode_state_t* ds, decode_index_t* index,
+                           const unsigned char* data, size_t len, size_t pos)
+{
+    decoded_prototype_t* proto;
+    decode_index_entry_t* entry;
+    size_t entrystack[LUAI_MAXCCALLS];
+    size_t i, n;
+
+    /* This follows the same structure as the decoding state machine in
+       decoder_pump.h, with ds->stack and ds->level as the stack of
+       prototypes being scanned, and numupvalues as the loop counter for child
+       prototypes. */
+ENTER_CHILD_PROTO:
+    if(ds->level >= LUAI_MAXCCALLS)
+        return DECODE_UNSAFE;
+    proto = alloc_proto(ds);
+    if(proto == NULL || !index_add_entry(ds, index, proto))
+        return DECODE_ERROR_MEM;
+    entrystack[ds->level] = index->numentries - 1;
+    ds->stack[ds->level++] = proto;
+    entry = index->entries + index->numentries - 1;
+
+    SCAN_NEED(ds->sizeint * 2 + 3);
+    pos += ds->sizeint * 2;
+    proto->numparams = data[pos];
+    proto->is_vararg = data[pos + 1] != 0;
+    proto->numregs = data[pos + 2];
+    pos += 3;
+    if(index->maxnumregs < proto->numregs)
+        index->maxnumregs = proto->numregs;
+
+    /* Code */
+    proto->instructionsize = ds->sizeins;
+    SCAN_INT(&proto->numinstructions, ds->sizeint);
+    if(proto->numinstructions == 0)
+        return DECODE_UNSAFE;
+    if(proto->numinstructions > ((size_t)-1 - sizeof(int)) / ds->sizeins)
+        return DECODE_FAIL;
+    if(index->maxnuminstructions < proto->numinstructions)
+        index->maxnuminstructions = proto->numinstructions;
+    entry->code = pos;
+    SCAN_ARRAY(proto->numinstructions, ds->sizeins);
+    if(ds->view && !ds->swapendian && len - pos >= sizeof(int))
+    {
+        /* As in the pump, the array is used in-place when at least an int of
+           the chunk follows it. */
+        proto->code = (unsigned char*)data + entry->code;
+        proto->code_borrowed = true;
+    }
+    else
+    {
+        proto->code = alloc_arena(ds, unsigned char,
             ds->sizeins * proto->numinstructions + sizeof(int));
         if(proto->code == NULL)
             return DECODE_ERROR_MEM;
-        READ(proto->code, ds->sizeins * proto->numinstructions);
-        if(ds->swapendian)
-        {
-            for(i = 0; i < proto->numinstructions; ++i)
-                byteswap(proto->code + i * ds->sizeins, ds->sizeins);
-        }
+    }
 
-        /* Constants (excluding prototypes) */
-        READ_INT(&proto->numconstants, ds->sizeint);
-        proto->constant_types = (unsigned char*)ds->alloc(ds->allocud,
-            NULL, 0, proto->numconstants);
-        if(proto->numconstants != 0 && proto->constant_types == NULL)
-            return DECODE_ERROR_MEM;
-        for(i = 0; i < proto->numconstants; ++i)
+    /* Constants (excluding prototypes). Only the lengths are followed here;
+       the values are checked by decode_indexed_prototype(). */
+    SCAN_INT(&proto->numconstants, ds->sizeint);
+    entry->constants = pos;
+    proto->constant_types = alloc_arena(ds, unsigned char,
+        proto->numconstants);
+    if(proto->numconstants != 0 && proto->constant_types == NULL)
+        return DECODE_ERROR_MEM;
+    for(i = 0; i < proto->numconstants; ++i)
+    {
+        SCAN_NEED(1);
+        switch(data[pos++])
         {
-            unsigned char t;
-            READ(proto->constant_types + i, 1);
-            t = proto->constant_types[i];
-            /* NB: Cannot use switch statement here, as possibly yielding reads
-               cannot be in a nested swtich. */
-            if(t == LUA_TSTRING)
-            {
-                SKIP_STRING_1();
-                SKIP_STRING_2();
-            }
-            else if(t == LUA_TNUMBER)
-            {
-                READ(ds->buffer, ds->sizenum);
-                if(is_signalling_nan(ds, ds->buffer))
-                    return DECODE_UNSAFE;
-            }
-            else if(t == LUA_TBOOLEAN)
-            {
-                READ(ds->buffer, 1);
-                if(ds->buffer[0] > 1)
-                    return DECODE_UNSAFE;
-            }
-            else if(t != LUA_TNIL)
-            {
-                return DECODE_FAIL;
-            }
+        case LUA_TSTRING:
+            SCAN_STRING();
+            break;
+        case LUA_TNUMBER:
+            SCAN_SKIP(ds->sizenum);
+            break;
+        case LUA_TBOOLEAN:
+            SCAN_SKIP(1);
+            break;
+        case LUA_TNIL:
+            break;
+        default:
+            return DECODE_FAIL;
         }
+    }
 
-        /* Prototypes */
-        READ_INT(&proto->numprototypes, ds->sizeint);
-        proto->prototypes = (decoded_prototype_t**)ds->alloc(ds->allocud,
-            NULL, 0, sizeof(decoded_prototype_t*) * proto->numprototypes);
-        if(proto->numprototypes != 0 && proto->prototypes == NULL)
-            return DECODE_ERROR_MEM;
-        for(i = 0; i < proto->numprototypes; ++i)
-            proto->prototypes[i] = NULL;
-        for(i = 0; i < proto->numprototypes; ++i)
-        {
-            /* Recursively decode the child prototype.
-              The loop counter needs to be saved somewhere, as it will be
-              overwritten during the recursion. For this, the numupvalues field
-              is used, as its value is not important at this stage of the
-              decoding process. The result of the recursion is then pulled out
-              of the stack and stored in the appropriate place. */
-            proto->numupvalues = i;
-            goto ENTER_CHILD_PROTO;
+    /* Prototypes */
+    SCAN_INT(&proto->numprototypes, ds->sizeint);
+    if(proto->numprototypes > (size_t)-1 / sizeof(decoded_prototype_t*))
+        return DECODE_FAIL;
+    proto->prototypes = alloc_arena(ds, decoded_prototype_t*,
+        proto->numprototypes);
+    if(proto->numprototypes != 0 && proto->prototypes == NULL)
+        return DECODE_ERROR_MEM;
+    for(i = 0; i < proto->numprototypes; ++i)
+        proto->prototypes[i] = NULL;
+    for(i = 0; i < proto->numprototypes; ++i)
+    {
+        proto->numupvalues = i;
+        goto ENTER_CHILD_PROTO;
 RESUME_PARENT_PROTO:
-            i = proto->numupvalues;
-            proto->prototypes[i] = ds->stack[ds->level];
-        }
+        i = proto->numupvalues;
+        proto->prototypes[i] = ds->stack[ds->level];
+    }
+    entry = index->entries + entrystack[ds->level - 1];
 
-        /* Upvalues */
-        READ_INT(&proto->numupvalues, ds->sizeint);
-        proto->upvalue_instack = (bool*)ds->alloc(ds->allocud, NULL, 0,
-            sizeof(bool) * proto->numupvalues);
-        proto->upvalue_index = (unsigned char*)ds->alloc(ds->allocud, NULL, 0,
-            proto->numupvalues);
-        if((proto->upvalue_instack == NULL || proto->upvalue_index == NULL)
-        && proto->numupvalues != 0)
-            return DECODE_ERROR_MEM;
-        for(i = 0; i < proto->numupvalues; ++i)
-        {
-            READ(ds->buffer, 2);
-            proto->upvalue_instack[i] = ds->buffer[0] != 0;
-            proto->upvalue_index[i] = ds->buffer[1];
-        }
+    /* Upvalues */
+    SCAN_INT(&proto->numupvalues, ds->sizeint);
+    if(proto->numupvalues > (size_t)-1 / sizeof(bool))
+        return DECODE_FAIL;
+    entry->upvalues = pos;
+    SCAN_ARRAY(proto->numupvalues, 2);
+    proto->upvalue_instack = alloc_arena(ds, bool, proto->numupvalues);
+    proto->upvalue_index = alloc_arena(ds, unsigned char,
+        proto->numupvalues);
+    if((proto->upvalue_instack == NULL || proto->upvalue_index == NULL)
+    && proto->numupvalues != 0)
+        return DECODE_ERROR_MEM;
 
-        /* Debug information */
-        SKIP_STRING_1();
-        SKIP_STRING_2();
-        READ_INT(&i, ds->sizeint);
-        READ(NULL, ds->sizeint * i);
-        READ_INT(&i, ds->sizeint);
-        for(; i > 0; --i)
-        {
-            SKIP_STRING_1();
-            SKIP_STRING_2();
-            READ(NULL, ds->sizeint * 2);
-        }
-        READ_INT(&i, ds->sizeint);
-        for(; i > 0; --i)
-        {
-            SKIP_STRING_1();
-            SKIP_STRING_2();
-        }
+    /* Debug information */
+    SCAN_STRING();
+    SCAN_INT(&n, ds->sizeint);
+    SCAN_ARRAY(n, ds->sizeint);
+    SCAN_INT(&i, ds->sizeint);
+    for(; i > 0; --i)
+    {
+        SCAN_STRING();
+        SCAN_SKIP(ds->sizeint * 2);
+    }
+    SCAN_INT(&i, ds->sizeint);
+    for(; i > 0; --i)
+    {
+        SCAN_STRING();
+    }
 
-        if(--ds->level == 0)
-        {
-            if(ds->chunklen != 0) /* Data in epilogue? */
-                return DECODE_FAIL;
-            ds->yieldpos = DECODE_YIELDPOS_DONE;
-            return DECODE_YIELD;
-        }
-        proto = ds->stack[ds->level - 1];
-        goto RESUME_PARENT_PROTO;
-        /* End of main prototype decoding function. */
-
-    case DECODE_YIELDPOS_DONE:
-        if(ds->chunklen == 0)
-            return DECODE_YIELD;
-        /* If this is being resumed, it means that there is spurious data
-           beyond the end of the bytecode. In this case, the decoding should
-           fail and not return a prototype, so the level field is set to 1 to
-           ensure that the resulting prototype gets freed when the stack is
-           freed. */
-        ds->level = 1;
-        return DECODE_FAIL;
+    if(--ds->level == 0)
+    {
+        if(pos != len) /* Data in epilogue? */
+            return DECODE_FAIL;
+        return DECODE_YIELD;
+    }
+    proto = ds->stack[ds->level - 1];
+    goto RESUME_PARENT_PROTO;
+}
 
-    default:
-        /* This should never happen, unless the yield/resume code is broken. */
+#undef SCAN_NEED
+#undef SCAN_SKIP
+#undef SCAN_INT
+#undef SCAN_ARRAY
+#undef SCAN_STRING
+
+int decode_bytecode_index(decode_state_t* ds, const unsigned char* data,
+                          size_t len, decode_index_t** index)
+{
+    decode_index_t* idx;
+    int status;
+
+    *index = NULL;
+    if(ds->yieldpos != DECODE_YIELDPOS_HEADER || ds->readlen != HEADER_SIZE)
         return DECODE_ERROR;
+    if(ds->verify != NULL)
+        return DECODE_ERROR;
+    if(len < HEADER_SIZE)
+        return DECODE_FAIL;
+    memcpy(ds->buffer, data, HEADER_SIZE);
+    if(!decode_header(ds))
+        return DECODE_FAIL;
+    ds->commonlayout = is_common_layout(ds);
+    ds->yieldpos = DECODE_YIELDPOS_ENTER;
+
+    idx = (decode_index_t*)ds->alloc(ds->allocud, NULL, 0,
+        sizeof(decode_index_t));
+    if(idx == NULL)
+        return DECODE_ERROR_MEM;
+    idx->alloc = ds->alloc;
+    idx->allocud = ds->allocud;
+    idx->data = data;
+    idx->entries = NULL;
+    idx->numentries = 0;
+    idx->capacity = 0;
+    idx->maxnumregs = 0;
+    idx->maxnuminstructions = 0;
+    *index = idx;
+
+    status = scan_prototypes(ds, idx, data, len, HEADER_SIZE);
+    if(status == DECODE_YIELD)
+    {
+        /* Leave the decode state as if the pump had decoded everything, so
+           that decode_bytecode_finish() returns the tree. The arrays of each
+           prototype are not yet filled in though. */
+        ds->chunk = data + len;
+        ds->chunklen = 0;
+        ds->yieldpos = DECODE_YIELDPOS_DONE;
+    }
+    else
+    {
+        /* Ensure that decode_bytecode_finish() does not return a partially
+           scanned tree. */
+        ds->level = 1;
     }
+    return status;
 }
 
-#undef i
-#undef READ
-#undef READ_INT
-#undef SKIP_STRING_1
-#undef SKIP_STRING_2
-
-decoded_prototype_t* decode_bytecode_finish(decode_state_t* ds)
+int decode_indexed_prototype(const decode_state_t* ds,
+                             const decode_index_t* index, size_t n)
 {
-    /* Get the return value, if there is one. */
-    decoded_prototype_t* result = NULL;
-    if(ds->yieldpos == DECODE_YIELDPOS_DONE && ds->level == 0)
-        result = ds->stack[0];
+    const decode_index_entry_t* entry = index->entries + n;
+    decoded_prototype_t* proto = entry->proto;
+    const unsigned char* p;
+    size_t i;
+
+    /* Code */
+    if(!proto->code_borrowed)
+    {
+        memcpy(proto->code, index->data + entry->code,
+            ds->sizeins * proto->numinstructions);
+        if(ds->swapendian)
+        {
+            byteswap_instructions(proto->code, proto->numinstructions,
+                ds->sizeins);
+        }
+    }
 
-    /* Free the stack. */
-    while(ds->level != 0)
-        free_prototype(ds->stack[--ds->level], ds->alloc, ds->allocud);
+    /* Constants. The lengths were checked by the prescan. */
+    p = index->data + entry->constants;
+    for(i = 0; i < proto->numconstants; ++i)
+    {
+        unsigned char t = *p++;
+        size_t len = 0;
+        proto->constant_types[i] = t;
+        switch(t)
+        {
+        case LUA_TSTRING:
+            parse_int_at(ds, p, &len, ds->sizesize);
+            p += ds->sizesize + len;
+            break;
+        case LUA_TNUMBER:
+            if(!ds->integralnum && is_nan_bytes(p, ds->sizenum,
+                ds->littleendian))
+                return DECODE_UNSAFE;
+            p += ds->sizenum;
+            break;
+        case LUA_TBOOLEAN:
+            if(*p > 1)
+                return DECODE_UNSAFE;
+            ++p;
+            break;
+        }
+    }
 
-    /* Free the decode state itself. */
-    ds->alloc(ds->allocud, ds, SIZEOF_decode_state_t, 0);
+    /* Upvalues */
+    p = index->data + entry->upvalues;
+    for(i = 0; i < proto->numupvalues; ++i, p += 2)
+    {
+        proto->upvalue_instack[i] = p[0] != 0;
+        proto->upvalue_index[i] = p[1];
+    }
+    return DECODE_YIELD;
+}
 
-    return result;
+void decode_index_free(decode_index_t* index)
+{
+    if(index != NULL)
+    {
+        index->alloc(index->allocud, index->entries,
+            index->capacity * sizeof(decode_index_entry_t), 0);
+        index->alloc(index->allocud, index, sizeof(decode_index_t), 0);
+    }
 }
@@ -21,6 +21,7 @@ SOFTWARE. */
 #ifndef _LBCV_DECODER_H_
 #define _LBCV_DECODER_H_
 #include "defs.h"
+#include "hash.h"
 #include <lua.h>
 
 /**
@@ -64,6 +65,66 @@ SOFTWARE. */
  */
 #define DECODE_ERROR_MEM 4
 
+/**
+ * Return value from decode_bytecode_pump() indicating that the verifier ran
+ * out of its budget of work (see verify_budget) before it could decide whether
+ * a prototype is safe, and so should not be supplied with further input.
+ */
+#define DECODE_BUDGET 5
+
+/**
+ * Return value from decode_bytecode_pump() or decode_bytecode_resume()
+ * indicating that the verifier has paused part way through a prototype (see
+ * verify_state::slice), and that decoding should be continued by calling
+ * decode_bytecode_resume() rather than by supplying further input.
+ */
+#define DECODE_PAUSE 6
+
+/**
+ * Region allocator from which an entire tree of decoded prototypes is
+ * allocated.
+ *
+ * Memory is handed out by bumping a pointer through a list of blocks obtained
+ * from a lua_Alloc function, and is only ever returned to that function all at
+ * once, when the tree is freed by free_prototype().
+ *
+ * The structure itself lives at the start of the first block.
+ */
+struct decode_arena
+{
+    /**
+     * The allocator function used to obtain and release blocks.
+     */
+    lua_Alloc alloc;
+    /**
+     * An opaque pointer passed to decode_arena::alloc.
+     */
+    void* allocud;
+    /**
+     * Linked list of every block owned by the arena. The first block in the
+     * list is the one currently being allocated from.
+     */
+    struct decode_arena_block* blocks;
+    /**
+     * The next free byte in the current block.
+     */
+    unsigned char* top;
+    /**
+     * The number of free bytes at decode_arena::top.
+     */
+    size_t avail;
+    /**
+     * The size of the next block to be obtained once the current one is full.
+     */
+    size_t blocksize;
+    /**
+     * The number of bytes which have been handed out by the arena. As memory
+     * is never returned to the arena, this is also its high-water mark.
+     */
+    size_t used;
+};
+typedef struct decode_arena decode_arena_t;
+
 /**
  * Container for all the information on a function prototype which the verifier
  * needs to verify that prototype.
@@ -77,6 +138,11 @@ struct decoded_prototype
      * records in total. This array will also have an extra @c int at the end,
      * to allow an instruction to be cast to an int without fear of reading
      * beyond the array.
+     *
+     * If decoded_prototype::code_borrowed is @c true, then this points into
+     * the buffer which was supplied to decode_bytecode_pump() rather than to
+     * memory owned by the prototype. If the prototype was verified while
+     * being decoded (see decode_state::verify), then this is @c NULL.
      */
     unsigned char* code;
     /**
@@ -142,9 +208,44 @@ struct decoded_prototype
      * argument list.
      */
     bool is_vararg;
+    /**
+     * Indication of whether or not decoded_prototype::code is borrowed from
+     * the caller's input buffer (see decode_state::view), in which case
+     * free_prototype() will not free it.
+     */
+    bool code_borrowed;
+    /**
+     * The arena from which this prototype, all of its arrays, and all of its
+     * (possibly indirect) child prototypes were allocated.
+     * This is only set on the root prototype returned by
+     * decode_bytecode_finish(), which owns the arena; it is @c NULL for child
+     * prototypes.
+     */
+    decode_arena_t* arena;
+    /**
+     * A keyed digest of everything about the prototype and its (possibly
+     * indirect) child prototypes which affects whether or not they are safe.
+     * This is only meaningful after fingerprint_prototype() has been called on
+     * the prototype.
+     */
+    chunk_digest_t fingerprint;
 };
 typedef struct decoded_prototype decoded_prototype_t;
 
+/**
+ * Function which is called by decode_bytecode_pump() with each prototype as
+ * soon as it (and hence all of its child prototypes) has been completely
+ * decoded. See decode_state::verify.
+ *
+ * @param ud The value of decode_state::verifyud.
+ * @param proto The prototype which has just been decoded.
+ *
+ * @return @c DECODE_YIELD if the prototype is acceptable, otherwise one of
+ *         the other return values of decode_bytecode_pump(), which will then
+ *         be returned by decode_bytecode_pump().
+ */
+typedef int (*decode_verify_fn)(void* ud, decoded_prototype_t* proto);
+
 /**
  * Container for all the state required during the decoding process.
  *
@@ -191,6 +292,70 @@ struct decode_state
      * point.
      */
     bool integralnum;
+    /**
+     * Indication of whether or not the header settings are the common ones
+     * for which a specialised decoder is used. Determined once the header
+     * has been decoded.
+     */
+    bool commonlayout;
+    /**
+     * Indication of whether or not decoded instruction arrays may point
+     * directly into the input buffer, rather than being copied out of it.
+     * This is @c false after decode_bytecode_init(), and may be set to @c true
+     * by the caller prior to the first call to decode_bytecode_pump() if every
+     * buffer given to decode_bytecode_pump() will remain valid and unmodified
+     * until the resulting prototype is freed. Instruction arrays are only
+     * borrowed when they lie entirely within a single input buffer and do not
+     * need byte swapping; other arrays are still copied.
+     */
+    bool view;
+    /**
+     * The arena from which decoded prototypes are allocated, or @c NULL if no
+     * prototype has been allocated yet.
+     */
+    decode_arena_t* arena;
+    /**
+     * The size of the first block of decode_state::arena.
+     * This may be changed by the caller prior to the first call to
+     * decode_bytecode_pump(). When decode_bytecode_reset() discards an arena
+     * which outgrew its first block, this is raised to that arena's
+     * high-water mark (up to the largest block size), so that similar
+     * bytecode decoded afterwards fits in a single block.
+     */
+    size_t arenasize;
+    /**
+     * A function to verify each prototype as soon as it has been decoded, or
+     * @c NULL to leave verification until the whole tree has been decoded.
+     * This is @c NULL after decode_bytecode_init(), and may be set by the
+     * caller prior to the first call to decode_bytecode_pump().
+     *
+     * When set, invalid bytecode is rejected as soon as the prototype
+     * containing it has been read, and the instruction array of each
+     * prototype is released once it has been verified, leaving only what is
+     * needed for verifying the parent prototype. The tree returned by
+     * decode_bytecode_finish() therefore has decoded_prototype::code set to
+     * @c NULL throughout, and must not be passed to verify(). This is not
+     * used by decode_bytecode_index().
+     */
+    decode_verify_fn verify;
+    /**
+     * An opaque pointer passed to decode_state::verify.
+     */
+    void* verifyud;
+    /**
+     * Indication of whether or not every buffer given to
+     * decode_bytecode_pump() is fed into decode_state::hash. This is @c false
+     * after decode_bytecode_init(), and may be set to @c true by the caller
+     * prior to the first call to decode_bytecode_pump().
+     */
+    bool hashing;
+    /**
+     * The running hash of all the bytecode given to decode_bytecode_pump(),
+     * when decode_state::hashing is @c true. Used to identify a chunk which
+     * was streamed in pieces, so that the outcome of verifying it can be
+     * recorded in a cache.
+     */
+    chunk_hash_t hash;
     /**
      * The number of bytes used to store an @c int in the bytecode stream.
      */
@@ -282,10 +447,25 @@ decode_state_t* decode_bytecode_init(lua_Alloc alloc, void* allocud);
  *         call to decode_bytecode_pump). If @c DECODE_FAIL is returned, then
  *         the stream of bytes did not contain valid Lua 5.2 bytecode. If an
  *         error status is returned, then the decoding process failed, but not
- *         due to the bytecode being invalid.
+ *         due to the bytecode being invalid. If decode_state::verify can
+ *         pause, then @c DECODE_PAUSE may also be returned.
  */
 int decode_bytecode_pump(decode_state_t* ds, const unsigned char* pData, size_t iLength);
 
+/**
+ * Continue decoding after decode_bytecode_pump() or decode_bytecode_resume()
+ * returned @c DECODE_PAUSE, by calling decode_state::verify again with the
+ * prototype which it paused on, and then decoding the rest of the bytes which
+ * were given to decode_bytecode_pump(). Those bytes must remain valid until
+ * something other than @c DECODE_PAUSE is returned.
+ *
+ * @param ds A decode_state_t whose last pump or resume returned
+ *           @c DECODE_PAUSE.
+ *
+ * @return As for decode_bytecode_pump().
+ */
+int decode_bytecode_resume(decode_state_t* ds);
+
 /**
  * Finish the bytecode decoding process, and free the associated state.
  *
@@ -301,6 +481,25 @@ int decode_bytecode_pump(decode_state_t* ds, const unsigned char* pData, size_t
  */
 decoded_prototype_t* decode_bytecode_finish(decode_state_t* ds);
 
+/**
+ * Finish decoding one chunk of bytecode, and prepare the decode state for
+ * decoding another, as if it had just been returned by decode_bytecode_init()
+ * but with the same settings (such as decode_state::view and
+ * decode_state::verify).
+ *
+ * Rather than being handed to the caller, the decoded prototypes are
+ * discarded, and their memory is kept for decoding the next chunk. This is
+ * intended for decode states which verify prototypes as they are decoded,
+ * where only the outcome is of interest.
+ *
+ * @param ds A decode_state_t created by decode_bytecode_init().
+ *
+ * @return @c true if the bytecode supplied to the decode state was a complete
+ *         chunk (and, if decode_state::verify is set, every prototype of it
+ *         was accepted), otherwise @c false.
+ */
+bool decode_bytecode_reset(decode_state_t* ds);
+
 /**
  * Decode a single Lua 5.2 virtual machine instruction.
  *
@@ -324,15 +523,164 @@ decoded_prototype_t* decode_bytecode_finish(decode_state_t* ds);
 bool decode_instruction(decoded_prototype_t* proto, size_t index, int* op,
                         int* a, int* b, int* c);
 
+/**
+ * Decode every virtual machine instruction of a prototype into separate
+ * arrays of fields.
+ *
+ * The result for each instruction is identical to that of calling
+ * decode_instruction() on it, except that the opcode field is stored as an
+ * unsigned char. In particular, instructions whose opcode is not known have
+ * their opcode field stored, and all other fields set to -1. Each of the
+ * arrays must have room for decoded_prototype::numinstructions elements.
+ *
+ * @param proto The prototype whose instructions are to be decoded.
+ * @param op An array into which the opcode fields will be stored.
+ * @param a An array into which the "A" or "Ax" fields will be stored.
+ * @param b An array into which the "B" or "Bx" or "sBx" fields will be
+ *          stored, or -1 for instructions without such a field.
+ * @param c An array into which the "C" fields will be stored, or -1 for
+ *          instructions without such a field.
+ */
+void decode_instructions(decoded_prototype_t* proto, unsigned char* op,
+                         int* a, int* b, int* c);
+
 /**
  * Free the memory associated with a previously decoded prototype.
  *
- * @param proto The prototype to be freed.
- * @param alloc The allocator function to be used to free the memory; this
- *              should be compatible with the allocator used by the Lua state
- *              passed to decode_bytecode().
- * @param ud An opaque pointer which will be passed to @p alloc.
+ * As the whole tree of prototypes lives in a single decode_arena_t, this
+ * releases the tree in one go, using the allocator which was passed to
+ * decode_bytecode_init().
+ *
+ * @param proto The prototype to be freed, as returned by
+ *              decode_bytecode_finish(). May be @c NULL.
+ */
+void free_prototype(decoded_prototype_t* proto);
+
+/**
+ * The location of one prototype within a contiguous buffer of bytecode, as
+ * recorded by decode_bytecode_index().
+ */
+struct decode_index_entry
+{
+    /**
+     * The prototype, whose scalar fields have been filled in, and whose arrays
+     * have been allocated but not yet filled in.
+     */
+    decoded_prototype_t* proto;
+    /**
+     * The offset of the prototype's instruction array within the buffer.
+     */
+    size_t code;
+    /**
+     * The offset of the prototype's first constant within the buffer.
+     */
+    size_t constants;
+    /**
+     * The offset of the prototype's first upvalue descriptor within the
+     * buffer.
+     */
+    size_t upvalues;
+};
+typedef struct decode_index_entry decode_index_entry_t;
+
+/**
+ * Index of every prototype within a contiguous buffer of bytecode.
+ *
+ * Finding where each prototype starts requires following every length field
+ * in the bytecode, which is inherently sequential. Once that is done though,
+ * the remainder of decoding each prototype (and then verifying it) is
+ * independent of all other prototypes, and so can be done in parallel.
+ */
+struct decode_index
+{
+    /**
+     * The allocator function used for the index.
+     */
+    lua_Alloc alloc;
+    /**
+     * An opaque pointer passed to decode_index::alloc.
+     */
+    void* allocud;
+    /**
+     * The buffer of bytecode which was indexed.
+     */
+    const unsigned char* data;
+    /**
+     * One entry for every prototype in the bytecode, in the order in which
+     * they appear in the bytecode (i.e. a pre-order walk of the tree, so the
+     * first entry is the main prototype).
+     */
+    decode_index_entry_t* entries;
+    /**
+     * The number of valid entries in decode_index::entries.
+     */
+    size_t numentries;
+    /**
+     * The allocated length of decode_index::entries.
+     */
+    size_t capacity;
+    /**
+     * The largest decoded_prototype::numregs of any prototype.
+     */
+    unsigned int maxnumregs;
+    /**
+     * The largest decoded_prototype::numinstructions of any prototype.
+     */
+    size_t maxnuminstructions;
+};
+typedef struct decode_index decode_index_t;
+
+/**
+ * Prescan a contiguous buffer containing an entire chunk of Lua 5.2 bytecode,
+ * building the tree of prototypes and an index of where each of them lies.
+ *
+ * This is an alternative to decode_bytecode_pump() for when all of the
+ * bytecode is available at once. Only the structure of the bytecode is
+ * decoded; decode_indexed_prototype() must then be called for every entry of
+ * the index before the tree is usable. Those calls can be made in any order,
+ * and from any thread.
+ *
+ * @param ds A decode_state_t freshly returned by decode_bytecode_init(). If
+ *           decode_state::view is set, then @p data must remain valid until
+ *           the resulting prototype is freed.
+ * @param data The bytecode, which must remain valid and unmodified until the
+ *             index is freed.
+ * @param len The number of bytes at @p data.
+ * @param index A pointer to a variable into which the index will be stored.
+ *              It may be set even on failure, and if set, must be freed by
+ *              the caller with decode_index_free().
+ *
+ * @return One of the values which decode_bytecode_pump() can return. If
+ *         @c DECODE_YIELD is returned, then decode_bytecode_finish() will
+ *         return the tree once every entry of the index has been decoded by
+ *         decode_indexed_prototype(). Otherwise, it will return @c NULL.
+ */
+int decode_bytecode_index(decode_state_t* ds, const unsigned char* data,
+                          size_t len, decode_index_t** index);
+
+/**
+ * Finish decoding one prototype which was found by decode_bytecode_index().
+ *
+ * This does not allocate memory or modify anything shared with other entries,
+ * so can be called concurrently for distinct entries of the same index.
+ *
+ * @param ds The decode_state_t which was passed to decode_bytecode_index().
+ * @param index The index returned by decode_bytecode_index().
+ * @param n The index of the entry to decode.
+ *
+ * @return @c DECODE_YIELD if the prototype was decoded, otherwise
+ *         @c DECODE_UNSAFE. In the latter case, the tree must not be
+ *         verified, and should be freed.
+ */
+int decode_indexed_prototype(const decode_state_t* ds,
+                             const decode_index_t* index, size_t n);
+
+/**
+ * Free an index returned by decode_bytecode_index(). This does not free the
+ * prototypes which it refers to.
+ *
+ * @param index The index to free. May be @c NULL.
  */
-void free_prototype(decoded_prototype_t* proto, lua_Alloc alloc, void* ud);
+void decode_index_free(decode_index_t* index);
 
 #endif /* _LBCV_DECODER_H_ */
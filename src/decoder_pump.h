@@ -0,0 +1,271 @@
+/* Copyright (c) 2010 Peter Cawley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+/**
+ * @file
+ * The body of the prototype decoding state machine. This file is included
+ * twice by decoder.c: once for bytecode using the most common combination of
+ * header settings, with the following macros defined as constants, and once
+ * for all other bytecode, with them defined as reads of the decode_state_t:
+ *
+ *   DECODE_PUMP - the name of the function to define.
+ *   SIZEINT, SIZESIZE, SIZEINS, SIZENUM - as per decode_state_t.
+ *   SWAPENDIAN - as per decode_state_t.
+ *   PARSE_INT(dest, len) - as per parse_int().
+ *   IS_SIGNALLING_NAN(number) - as per is_signalling_nan().
+ *
+ * As yield points are identified by line number, and both functions come from
+ * the same lines of this file, a decode state can be resumed by either of the
+ * functions, but decode_bytecode_pump() always resumes it with the one which
+ * was chosen after the header was decoded.
+ */
+
+#define READ(dest, len) \
+    if(!read(ds, dest, len)) \
+        return (ds->yieldpos = __LINE__), DECODE_YIELD; \
+    case __LINE__:
+
+#define READ_INT(dest, len) \
+    if(!read(ds, ds->buffer, len)) \
+        return (ds->yieldpos = __LINE__), DECODE_YIELD; \
+    case __LINE__: \
+    if(!PARSE_INT(dest, len)) return DECODE_FAIL
+
+#define SKIP_STRING_1() \
+    if(!read(ds, ds->buffer, SIZESIZE)) \
+        return (ds->yieldpos = __LINE__), DECODE_YIELD; \
+    case __LINE__: \
+    if(!PARSE_INT(&ds->readlen, SIZESIZE)) return DECODE_FAIL
+
+#define SKIP_STRING_2() \
+    if(!read(ds, NULL, ds->readlen)) \
+        return (ds->yieldpos = __LINE__), DECODE_YIELD; \
+    case __LINE__:
+
+#define VERIFY(proto) \
+    case __LINE__: \
+    status = ds->verify(ds->verifyud, proto); \
+    if(status == DECODE_PAUSE) \
+        return (ds->yieldpos = __LINE__), DECODE_PAUSE; \
+    if(status != DECODE_YIELD) \
+        return status
+
+#define i ds->i
+
+static int DECODE_PUMP(decode_state_t* ds)
+{
+    decoded_prototype_t* proto = NULL;
+    int status;
+    if(ds->level != 0)
+        proto = ds->stack[ds->level - 1];
+
+    switch(ds->yieldpos)
+    {
+    case DECODE_YIELDPOS_ENTER:
+        /* Main prototype decoding function */
+ENTER_CHILD_PROTO:
+        if(ds->level >= LUAI_MAXCCALLS)
+            return DECODE_UNSAFE;
+        proto = alloc_proto(ds);
+        if(proto == NULL)
+            return DECODE_ERROR_MEM;
+        ds->stack[ds->level++] = proto;
+
+        READ(NULL, SIZEINT * 2);
+        READ(ds->buffer, 3);
+
+        proto->numparams = ds->buffer[0];
+        proto->is_vararg = ds->buffer[1] != 0;
+        proto->numregs = ds->buffer[2];
+
+        /* Code */
+        proto->instructionsize = SIZEINS;
+        READ_INT(&proto->numinstructions, SIZEINT);
+        if(proto->numinstructions == 0)
+            return DECODE_UNSAFE;
+        if(proto->numinstructions > ((size_t)-1 - sizeof(int)) / SIZEINS)
+            return DECODE_FAIL;
+        if(ds->view && !SWAPENDIAN && ds->chunklen > sizeof(int)
+        && (ds->chunklen - sizeof(int)) / SIZEINS >= proto->numinstructions)
+        {
+            /* The instruction array is present in its entirety, followed by
+               at least an int of the remainder of the chunk, so it can be
+               used in-place. */
+            proto->code = (unsigned char*)ds->chunk;
+            proto->code_borrowed = true;
+            ds->chunk += SIZEINS * proto->numinstructions;
+            ds->chunklen -= SIZEINS * proto->numinstructions;
+        }
+        else
+        {
+            proto->code = alloc_code(ds,
+                SIZEINS * proto->numinstructions + sizeof(int));
+            if(proto->code == NULL)
+                return DECODE_ERROR_MEM;
+            READ(proto->code, SIZEINS * proto->numinstructions);
+            if(SWAPENDIAN)
+            {
+                byteswap_instructions(proto->code, proto->numinstructions,
+                    SIZEINS);
+            }
+        }
+
+        /* Constants (excluding prototypes) */
+        READ_INT(&proto->numconstants, SIZEINT);
+        proto->constant_types = alloc_arena(ds, unsigned char,
+            proto->numconstants);
+        if(proto->numconstants != 0 && proto->constant_types == NULL)
+            return DECODE_ERROR_MEM;
+        for(i = 0; i < proto->numconstants; ++i)
+        {
+            unsigned char t;
+            READ(proto->constant_types + i, 1);
+            t = proto->constant_types[i];
+            /* NB: Cannot use switch statement here, as possibly yielding reads
+               cannot be in a nested swtich. */
+            if(t == LUA_TSTRING)
+            {
+                SKIP_STRING_1();
+                SKIP_STRING_2();
+            }
+            else if(t == LUA_TNUMBER)
+            {
+                READ(ds->buffer, SIZENUM);
+                if(IS_SIGNALLING_NAN(ds->buffer))
+                    return DECODE_UNSAFE;
+            }
+            else if(t == LUA_TBOOLEAN)
+            {
+                READ(ds->buffer, 1);
+                if(ds->buffer[0] > 1)
+                    return DECODE_UNSAFE;
+            }
+            else if(t != LUA_TNIL)
+            {
+                return DECODE_FAIL;
+            }
+        }
+
+        /* Prototypes */
+        READ_INT(&proto->numprototypes, SIZEINT);
+        if(proto->numprototypes > (size_t)-1 / sizeof(decoded_prototype_t*))
+            return DECODE_FAIL;
+        proto->prototypes = alloc_arena(ds, decoded_prototype_t*,
+            proto->numprototypes);
+        if(proto->numprototypes != 0 && proto->prototypes == NULL)
+            return DECODE_ERROR_MEM;
+        for(i = 0; i < proto->numprototypes; ++i)
+            proto->prototypes[i] = NULL;
+        for(i = 0; i < proto->numprototypes; ++i)
+        {
+            /* Recursively decode the child prototype.
+              The loop counter needs to be saved somewhere, as it will be
+              overwritten during the recursion. For this, the numupvalues field
+              is used, as its value is not important at this stage of the
+              decoding process. The result of the recursion is then pulled out
+              of the stack and stored in the appropriate place. */
+            proto->numupvalues = i;
+            goto ENTER_CHILD_PROTO;
+RESUME_PARENT_PROTO:
+            i = proto->numupvalues;
+            proto->prototypes[i] = ds->stack[ds->level];
+        }
+
+        /* Upvalues */
+        READ_INT(&proto->numupvalues, SIZEINT);
+        if(proto->numupvalues > (size_t)-1 / sizeof(bool))
+            return DECODE_FAIL;
+        proto->upvalue_instack = alloc_arena(ds, bool, proto->numupvalues);
+        proto->upvalue_index = alloc_arena(ds, unsigned char,
+            proto->numupvalues);
+        if((proto->upvalue_instack == NULL || proto->upvalue_index == NULL)
+        && proto->numupvalues != 0)
+            return DECODE_ERROR_MEM;
+        for(i = 0; i < proto->numupvalues; ++i)
+        {
+            READ(ds->buffer, 2);
+            proto->upvalue_instack[i] = ds->buffer[0] != 0;
+            proto->upvalue_index[i] = ds->buffer[1];
+        }
+
+        /* Debug information */
+        SKIP_STRING_1();
+        SKIP_STRING_2();
+        READ_INT(&i, SIZEINT);
+        READ(NULL, SIZEINT * i);
+        READ_INT(&i, SIZEINT);
+        for(; i > 0; --i)
+        {
+            SKIP_STRING_1();
+            SKIP_STRING_2();
+            READ(NULL, SIZEINT * 2);
+        }
+        READ_INT(&i, SIZEINT);
+        for(; i > 0; --i)
+        {
+            SKIP_STRING_1();
+            SKIP_STRING_2();
+        }
+
+        if(ds->verify != NULL)
+        {
+            /* Every child prototype has already been verified, so this one
+               can be verified now. If it is rejected, then it is left on the
+               stack, so that decode_bytecode_finish() releases its code. If
+               verification pauses, then it is resumed from here, with the
+               prototype still on top of the stack. */
+            VERIFY(proto);
+            free_code(ds, proto);
+        }
+
+        if(--ds->level == 0)
+        {
+            if(ds->chunklen != 0) /* Data in epilogue? */
+                return DECODE_FAIL;
+            ds->yieldpos = DECODE_YIELDPOS_DONE;
+            return DECODE_YIELD;
+        }
+        proto = ds->stack[ds->level - 1];
+        goto RESUME_PARENT_PROTO;
+        /* End of main prototype decoding function. */
+
+    case DECODE_YIELDPOS_DONE:
+        if(ds->chunklen == 0)
+            return DECODE_YIELD;
+        /* If this is being resumed, it means that there is spurious data
+           beyond the end of the bytecode. In this case, the decoding should
+           fail and not return a prototype, so the level field is set to 1 to
+           ensure that decode_bytecode_finish() frees the arena rather than
+           returning the prototype. */
+        ds->level = 1;
+        return DECODE_FAIL;
+
+    default:
+        /* This should never happen, unless the yield/resume code is broken. */
+        return DECODE_ERROR;
+    }
+}
+
+#undef i
+#undef VERIFY
+#undef READ
+#undef READ_INT
+#undef SKIP_STRING_1
+#undef SKIP_STRING_2
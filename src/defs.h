@@ -38,4 +38,12 @@ SOFTWARE. */
 #endif
 #endif
 
+/* Whether POSIX threads are available, for the thread pool and for locking
+   shared structures. */
+
+#if defined(__unix__) || defined(__unix) || \
+    (defined(__APPLE__) && defined(__MACH__))
+#define LBCV_USE_PTHREADS
+#endif
+
 #endif /* _LBCV_DEFS_H_ */
@@ -0,0 +1,727 @@
+/* Copyright (c) 2010 Peter Cawley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include "fcache.h"
+#include "mac.h"
+#include "verifier.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__unix) || \
+    (defined(__APPLE__) && defined(__MACH__))
+#define LBCV_USE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
+#endif
+
+#ifdef LBCV_USE_PTHREADS
+#include <pthread.h>
+#define cache_lock(fc) pthread_mutex_lock(&(fc)->lock)
+#define cache_unlock(fc) pthread_mutex_unlock(&(fc)->lock)
+#else
+#define cache_lock(fc) ((void)0)
+#define cache_unlock(fc) ((void)0)
+#endif
+
+/* File header: magic, format, rules version, record size, key check, then
+   padding. */
+#define FCACHE_MAGIC "LBCVVC\r\n"
+#define FCACHE_FORMAT 2
+#define HEADER_SIZE 64
+
+/* Record: digest (two words), chunk length, a reserved zero word, all little
+   endian, and then the HMAC-SHA256 tag of those 32 bytes. */
+#define RECORD_SIZE 64
+#define RECORD_TAGGED 32
+
+/* Labels for deriving keys from the key given to verify_file_cache_open(). */
+#define DIGEST_KEY_LABEL "lbcv cache digest"
+#define KEY_CHECK_LABEL "lbcv cache key check"
+#define KEY_CHECK_SIZE 8
+
+struct verify_file_cache
+{
+#ifdef LBCV_USE_PTHREADS
+    pthread_mutex_t lock;
+#endif
+    /**
+     * The name of the file, or @c NULL if no file is open.
+     */
+    char* path;
+    /**
+     * The descriptor of the file, opened for appending, or -1 if the file
+     * is open but could not be attached to (for example, because it was
+     * removed), in which case attaching is retried on the next miss.
+     */
+    int fd;
+#ifdef LBCV_USE_MMAP
+    /**
+     * The identity of the file behind verify_file_cache::fd, for noticing
+     * when another process has replaced the file.
+     */
+    dev_t dev;
+    ino_t ino;
+#endif
+    /**
+     * A read-only shared mapping of the header and the first
+     * verify_file_cache::numrecords records of the file.
+     */
+    const unsigned char* map;
+    size_t mapsize;
+    size_t numrecords;
+    /**
+     * Whether the file ended with part of a record when last refreshed, in
+     * which case anything appended would be misaligned.
+     */
+    bool torn;
+    /**
+     * Open addressed hash table of the distinct valid records, each slot
+     * holding a record index plus one, or zero if the slot is empty. The
+     * number of slots is a power of two, and at least twice the number of
+     * entries.
+     */
+    size_t* slots;
+    size_t numslots;
+    size_t capacity;
+    verify_file_cache_stats_t stats;
+    /**
+     * HMAC-SHA256 state which has absorbed the key, and so only needs a
+     * record adding to it to compute the record's tag.
+     */
+    hmac_sha256_t mac;
+    /**
+     * The key under which chunks are hashed to find their records.
+     */
+    chunk_key_t digestkey;
+    /**
+     * A value derived from the key, recorded in the header so that a file
+     * made with a different key is replaced rather than having every one of
+     * its records rejected.
+     */
+    unsigned char keycheck[KEY_CHECK_SIZE];
+};
+
+static verify_file_cache_t shared_file_cache = {
+#ifdef LBCV_USE_PTHREADS
+    PTHREAD_MUTEX_INITIALIZER,
+#endif
+    NULL, -1,
+#ifdef LBCV_USE_MMAP
+    0, 0,
+#endif
+    NULL, 0, 0, false, NULL, 0, 0, {0, 0, 0, 0, 0, 0}
+};
+
+verify_file_cache_t* verify_file_cache_shared(void)
+{
+    return &shared_file_cache;
+}
+
+bool verify_file_cache_enabled(verify_file_cache_t* fc)
+{
+    bool result;
+    cache_lock(fc);
+    result = fc->path != NULL;
+    cache_unlock(fc);
+    return result;
+}
+
+bool verify_file_cache_key(verify_file_cache_t* fc, chunk_key_t* key)
+{
+    bool result;
+    cache_lock(fc);
+    result = fc->path != NULL;
+    if(result)
+        *key = fc->digestkey;
+    cache_unlock(fc);
+    return result;
+}
+
+void verify_file_cache_getstats(verify_file_cache_t* fc,
+                                verify_file_cache_stats_t* stats)
+{
+    cache_lock(fc);
+    *stats = fc->stats;
+    stats->capacity = fc->path != NULL ? fc->capacity : 0;
+    cache_unlock(fc);
+}
+
+#ifdef LBCV_USE_MMAP
+
+static void put_u32(unsigned char* p, uint32_t v)
+{
+    int i;
+    for(i = 0; i < 4; ++i)
+        p[i] = (unsigned char)(v >> (i * 8));
+}
+
+static void put_u64(unsigned char* p, uint64_t v)
+{
+    int i;
+    for(i = 0; i < 8; ++i)
+        p[i] = (unsigned char)(v >> (i * 8));
+}
+
+static uint64_t get_u64(const unsigned char* p)
+{
+    uint64_t v = 0;
+    int i;
+    for(i = 7; i >= 0; --i)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static void make_header(verify_file_cache_t* fc, unsigned char* header)
+{
+    memset(header, 0, HEADER_SIZE);
+    memcpy(header, FCACHE_MAGIC, 8);
+    put_u32(header + 8, FCACHE_FORMAT);
+    put_u32(header + 12, VERIFIER_RULES_VERSION);
+    put_u32(header + 16, RECORD_SIZE);
+    memcpy(header + 20, fc->keycheck, KEY_CHECK_SIZE);
+}
+
+/* The tag means that only holders of the key can add records which will be
+   believed, and also lets records which were torn or never written (and so
+   read as zeros) be told apart from real records. */
+static void record_tag(verify_file_cache_t* fc, const unsigned char* record,
+                       unsigned char tag[SHA256_DIGEST_SIZE])
+{
+    hmac_sha256_t mac = fc->mac;
+    hmac_sha256_update(&mac, record, RECORD_TAGGED);
+    hmac_sha256_final(&mac, tag);
+}
+
+static bool is_record_valid(verify_file_cache_t* fc,
+                            const unsigned char* record)
+{
+    unsigned char tag[SHA256_DIGEST_SIZE];
+    record_tag(fc, record, tag);
+    return mac_equal(tag, record + RECORD_TAGGED, SHA256_DIGEST_SIZE);
+}
+
+static void make_record(verify_file_cache_t* fc, unsigned char* record,
+                        const chunk_digest_t* digest, size_t len)
+{
+    put_u64(record, digest->h1);
+    put_u64(record + 8, digest->h2);
+    put_u64(record + 16, (uint64_t)len);
+    put_u64(record + 24, 0);
+    record_tag(fc, record, record + RECORD_TAGGED);
+}
+
+static const unsigned char* get_record(verify_file_cache_t* fc, size_t i)
+{
+    return fc->map + HEADER_SIZE + i * RECORD_SIZE;
+}
+
+static int write_all(int fd, const unsigned char* data, size_t len)
+{
+    while(len != 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return errno;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/*
+** Write a complete file alongside `path', and then move it into place. If
+** `replace' is false, an existing file is left alone (and this still
+** succeeds), so that two processes creating the file at once agree on it.
+*/
+static int write_new_file(verify_file_cache_t* fc,
+                          const unsigned char* records, size_t numrecords,
+                          bool replace)
+{
+    const char* path = fc->path;
+    unsigned char header[HEADER_SIZE];
+    size_t pathlen = strlen(path);
+    char* tmp = (char*)malloc(pathlen + 8);
+    int fd, err;
+
+    if(tmp == NULL)
+        return ENOMEM;
+    memcpy(tmp, path, pathlen);
+    memcpy(tmp + pathlen, ".XXXXXX", 8);
+    fd = mkstemp(tmp);
+    if(fd < 0)
+    {
+        err = errno;
+        free(tmp);
+        return err;
+    }
+    make_header(fc, header);
+    /* Only the owner may add records, so that the file cannot be filled
+      with junk by anyone else, even though they cannot forge tags. */
+    fchmod(fd, 0600);
+    err = write_all(fd, header, HEADER_SIZE);
+    if(err == 0)
+        err = write_all(fd, records, numrecords * RECORD_SIZE);
+    if(close(fd) != 0 && err == 0)
+        err = errno;
+    if(err == 0)
+    {
+        if(replace)
+        {
+            if(rename(tmp, path) != 0)
+                err = errno;
+        }
+        else if(link(tmp, path) != 0 && errno != EEXIST)
+            err = errno;
+    }
+    if(err != 0 || !replace)
+        unlink(tmp);
+    free(tmp);
+    return err;
+}
+
+static bool is_header_valid(verify_file_cache_t* fc, int fd)
+{
+    unsigned char expected[HEADER_SIZE];
+    unsigned char actual[HEADER_SIZE];
+    make_header(fc, expected);
+    if(pread(fd, actual, HEADER_SIZE, 0) != HEADER_SIZE)
+        return false;
+    return memcmp(expected, actual, HEADER_SIZE) == 0;
+}
+
+/* Forget the file (but not its name), leaving an empty index. */
+static void detach(verify_file_cache_t* fc)
+{
+    if(fc->map != NULL)
+        munmap((void*)fc->map, fc->mapsize);
+    if(fc->fd >= 0)
+        close(fc->fd);
+    free(fc->slots);
+    fc->map = NULL;
+    fc->mapsize = 0;
+    fc->numrecords = 0;
+    fc->torn = false;
+    fc->fd = -1;
+    fc->slots = NULL;
+    fc->numslots = 0;
+    fc->stats.entries = 0;
+}
+
+/* Open verify_file_cache::path, creating it, or replacing it if it was
+   written by a different verifier or with a different key. The file must be
+   a regular file (not a symbolic link) owned by this user, and writable by
+   nobody else. */
+static int attach(verify_file_cache_t* fc)
+{
+    struct stat st;
+    int attempt, fd, err = EAGAIN;
+
+    for(attempt = 0; attempt < 4; ++attempt)
+    {
+        fd = open(fc->path, O_RDWR | O_APPEND | O_NOFOLLOW);
+        if(fd < 0)
+        {
+            if(errno != ENOENT)
+                return errno;
+            err = write_new_file(fc, NULL, 0, false);
+            if(err != 0)
+                return err;
+            continue;
+        }
+        if(fstat(fd, &st) != 0)
+        {
+            err = errno;
+            close(fd);
+            return err;
+        }
+        if(!S_ISREG(st.st_mode))
+        {
+            close(fd);
+            return S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+        }
+        if(st.st_uid != geteuid()
+        || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+        {
+            close(fd);
+            return EACCES;
+        }
+        if(!is_header_valid(fc, fd))
+        {
+            close(fd);
+            err = write_new_file(fc, NULL, 0, true);
+            if(err != 0)
+                return err;
+            continue;
+        }
+        fc->fd = fd;
+        fc->dev = st.st_dev;
+        fc->ino = st.st_ino;
+        return 0;
+    }
+    return err;
+}
+
+static size_t slot_of(verify_file_cache_t* fc, const unsigned char* record)
+{
+    return (size_t)get_u64(record) & (fc->numslots - 1);
+}
+
+/* Find the slot which holds a record with the same contents, or the empty
+   slot where it would go. */
+static size_t *find_slot(verify_file_cache_t* fc, const unsigned char* record)
+{
+    size_t i = slot_of(fc, record);
+    for(;;)
+    {
+        size_t* slot = fc->slots + i;
+        if(*slot == 0 || memcmp(get_record(fc, *slot - 1), record, 24) == 0)
+            return slot;
+        i = (i + 1) & (fc->numslots - 1);
+    }
+}
+
+static bool grow_slots(verify_file_cache_t* fc)
+{
+    size_t* old = fc->slots;
+    size_t oldnum = fc->numslots;
+    size_t num = oldnum ? oldnum * 2 : 64;
+    size_t i;
+
+    if(num > (size_t)-1 / sizeof(size_t))
+        return false;
+    fc->slots = (size_t*)calloc(num, sizeof(size_t));
+    if(fc->slots == NULL)
+    {
+        fc->slots = old;
+        return false;
+    }
+    fc->numslots = num;
+    for(i = 0; i < oldnum; ++i)
+    {
+        if(old[i] != 0)
+            *find_slot(fc, get_record(fc, old[i] - 1)) = old[i];
+    }
+    free(old);
+    return true;
+}
+
+/* Map and index any records appended since the last refresh, reattaching
+   first if the file has been replaced. */
+static bool refresh(verify_file_cache_t* fc)
+{
+    struct stat st;
+    const unsigned char* map;
+    size_t count, mapsize, i;
+
+    if(fc->fd >= 0 && (lstat(fc->path, &st) != 0
+    || st.st_dev != fc->dev || st.st_ino != fc->ino))
+        detach(fc);
+    if(fc->fd < 0 && attach(fc) != 0)
+        return false;
+    if(fstat(fc->fd, &st) != 0 || st.st_size < HEADER_SIZE)
+        return false;
+    if((off_t)(size_t)st.st_size != st.st_size)
+        return false;
+    count = ((size_t)st.st_size - HEADER_SIZE) / RECORD_SIZE;
+    fc->torn = ((size_t)st.st_size - HEADER_SIZE) % RECORD_SIZE != 0;
+    if(count > fc->capacity * 2)
+        count = fc->capacity * 2;
+    if(count <= fc->numrecords)
+        return true;
+
+    mapsize = HEADER_SIZE + count * RECORD_SIZE;
+    map = (const unsigned char*)mmap(NULL, mapsize, PROT_READ, MAP_SHARED,
+        fc->fd, 0);
+    if(map == (const unsigned char*)MAP_FAILED)
+        return false;
+    if(fc->map != NULL)
+        munmap((void*)fc->map, fc->mapsize);
+    fc->map = map;
+    fc->mapsize = mapsize;
+
+    for(i = fc->numrecords; i < count; ++i)
+    {
+        const unsigned char* record = get_record(fc, i);
+        size_t* slot;
+        if(!is_record_valid(fc, record))
+            continue;
+        if((fc->stats.entries + 1) * 2 > fc->numslots && !grow_slots(fc))
+            break;
+        slot = find_slot(fc, record);
+        if(*slot == 0)
+        {
+            *slot = i + 1;
+            ++fc->stats.entries;
+        }
+    }
+    fc->numrecords = i;
+    return true;
+}
+
+static bool find(verify_file_cache_t* fc, const chunk_digest_t* digest,
+                 size_t len)
+{
+    unsigned char record[RECORD_SIZE];
+    if(fc->numslots == 0)
+        return false;
+    make_record(fc, record, digest, len);
+    return *find_slot(fc, record) != 0;
+}
+
+static int compare_size(const void* a, const void* b)
+{
+    size_t x = *(const size_t*)a, y = *(const size_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int compact(verify_file_cache_t* fc)
+{
+    size_t* order;
+    unsigned char* records;
+    size_t num = 0, keep, i;
+    int err;
+
+    refresh(fc);
+    order = (size_t*)malloc((fc->stats.entries + 1) * sizeof(size_t));
+    if(order == NULL)
+        return ENOMEM;
+    for(i = 0; i < fc->numslots; ++i)
+    {
+        if(fc->slots[i] != 0)
+            order[num++] = fc->slots[i] - 1;
+    }
+    /* Keep the most recently appended records. */
+    qsort(order, num, sizeof(size_t), compare_size);
+    keep = fc->capacity / 2;
+    if(keep > num)
+        keep = num;
+    records = (unsigned char*)malloc(keep * RECORD_SIZE + 1);
+    if(records == NULL)
+    {
+        free(order);
+        return ENOMEM;
+    }
+    for(i = 0; i < keep; ++i)
+    {
+        memcpy(records + i * RECORD_SIZE,
+            get_record(fc, order[num - keep + i]), RECORD_SIZE);
+    }
+    err = write_new_file(fc, records, keep, true);
+    free(records);
+    free(order);
+    if(err != 0)
+        return err;
+    ++fc->stats.compactions;
+    detach(fc);
+    refresh(fc);
+    return 0;
+}
+
+/* Derive the keys of a file from the key given to verify_file_cache_open(). */
+static void set_keys(verify_file_cache_t* fc, const unsigned char* key,
+                     size_t keylen)
+{
+    unsigned char derived[SHA256_DIGEST_SIZE];
+    hmac_sha256_t mac;
+
+    hmac_sha256_init(&fc->mac, key, keylen);
+    mac = fc->mac;
+    hmac_sha256_update(&mac, (const unsigned char*)DIGEST_KEY_LABEL,
+        sizeof(DIGEST_KEY_LABEL) - 1);
+    hmac_sha256_final(&mac, derived);
+    fc->digestkey.k0 = get_u64(derived);
+    fc->digestkey.k1 = get_u64(derived + 8);
+    mac = fc->mac;
+    hmac_sha256_update(&mac, (const unsigned char*)KEY_CHECK_LABEL,
+        sizeof(KEY_CHECK_LABEL) - 1);
+    hmac_sha256_final(&mac, derived);
+    memcpy(fc->keycheck, derived, KEY_CHECK_SIZE);
+}
+
+/* Forget the keys, so that they do not linger in memory. */
+static void clear_keys(verify_file_cache_t* fc)
+{
+    memset(&fc->mac, 0, sizeof(fc->mac));
+    memset(&fc->digestkey, 0, sizeof(fc->digestkey));
+    memset(fc->keycheck, 0, sizeof(fc->keycheck));
+}
+
+int verify_file_cache_open(verify_file_cache_t* fc, const char* path,
+                           size_t capacity, const unsigned char* key,
+                           size_t keylen)
+{
+    size_t pathlen = strlen(path);
+    int err;
+
+    if(capacity < 2 || capacity > ((size_t)-1 - HEADER_SIZE) / RECORD_SIZE / 2)
+        return EINVAL;
+    cache_lock(fc);
+    detach(fc);
+    free(fc->path);
+    memset(&fc->stats, 0, sizeof(fc->stats));
+    fc->capacity = capacity;
+    fc->path = (char*)malloc(pathlen + 1);
+    if(fc->path == NULL)
+    {
+        cache_unlock(fc);
+        return ENOMEM;
+    }
+    memcpy(fc->path, path, pathlen + 1);
+    set_keys(fc, key, keylen);
+    err = attach(fc);
+    if(err == 0 && !refresh(fc))
+        err = errno ? errno : EIO;
+    if(err != 0)
+    {
+        detach(fc);
+        free(fc->path);
+        fc->path = NULL;
+        clear_keys(fc);
+    }
+    cache_unlock(fc);
+    return err;
+}
+
+void verify_file_cache_close(verify_file_cache_t* fc)
+{
+    cache_lock(fc);
+    detach(fc);
+    free(fc->path);
+    fc->path = NULL;
+    clear_keys(fc);
+    cache_unlock(fc);
+}
+
+bool verify_file_cache_lookup(verify_file_cache_t* fc,
+                              const chunk_digest_t* digest, size_t len)
+{
+    bool found = false;
+    cache_lock(fc);
+    if(fc->path != NULL)
+    {
+        /* Only look for records from other processes on a miss. */
+        found = find(fc, digest, len) || (refresh(fc)
+            && find(fc, digest, len));
+        if(found)
+            ++fc->stats.hits;
+        else
+            ++fc->stats.misses;
+    }
+    cache_unlock(fc);
+    return found;
+}
+
+void verify_file_cache_insert(verify_file_cache_t* fc,
+                              const chunk_digest_t* digest, size_t len)
+{
+    unsigned char record[RECORD_SIZE];
+    ssize_t n;
+
+    cache_lock(fc);
+    if(fc->path == NULL || !refresh(fc) || find(fc, digest, len))
+        goto done;
+    if((fc->numrecords >= fc->capacity || fc->torn)
+    && (compact(fc) != 0 || fc->fd < 0))
+        goto done;
+    make_record(fc, record, digest, len);
+    /* A single write to a file opened for appending, so that records from
+      concurrent writers are never interleaved. */
+    do
+        n = write(fc->fd, record, RECORD_SIZE);
+    while(n < 0 && errno == EINTR);
+    if(n == RECORD_SIZE)
+    {
+        ++fc->stats.appends;
+        refresh(fc);
+    }
+    else if(n > 0)
+    {
+        /* A partial record would misalign every later record, so rewrite
+          the file without it. */
+        compact(fc);
+    }
+done:
+    cache_unlock(fc);
+}
+
+int verify_file_cache_compact(verify_file_cache_t* fc)
+{
+    int err = 0;
+    cache_lock(fc);
+    if(fc->path != NULL)
+        err = compact(fc);
+    cache_unlock(fc);
+    return err;
+}
+
+#else /* !LBCV_USE_MMAP */
+
+int verify_file_cache_open(verify_file_cache_t* fc, const char* path,
+                           size_t capacity, const unsigned char* key,
+                           size_t keylen)
+{
+    (void)fc;
+    (void)path;
+    (void)capacity;
+    (void)key;
+    (void)keylen;
+    return ENOSYS;
+}
+
+void verify_file_cache_close(verify_file_cache_t* fc)
+{
+    (void)fc;
+}
+
+bool verify_file_cache_lookup(verify_file_cache_t* fc,
+                              const chunk_digest_t* digest, size_t len)
+{
+    (void)fc;
+    (void)digest;
+    (void)len;
+    return false;
+}
+
+void verify_file_cache_insert(verify_file_cache_t* fc,
+                              const chunk_digest_t* digest, size_t len)
+{
+    (void)fc;
+    (void)digest;
+    (void)len;
+}
+
+int verify_file_cache_compact(verify_file_cache_t* fc)
+{
+    (void)fc;
+    return ENOSYS;
+}
+
+#endif
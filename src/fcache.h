@@ -0,0 +1,176 @@
+/* Copyright (c) 2010 Peter Cawley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#ifndef _LBCV_FCACHE_H_
+#define _LBCV_FCACHE_H_
+#include "defs.h"
+#include "hash.h"
+
+/**
+ * @file
+ * A cache of bytecode chunks known to be safe, kept in a file so that it
+ * survives restarts and is shared by every process which opens the same file.
+ *
+ * The file is a fixed header followed by fixed-size records, each of which
+ * holds the chunk_digest_t and length of one safe chunk, and an HMAC-SHA256
+ * tag of them. Both the digest and the tag are made with keys derived from a
+ * secret key which every process sharing the file is given, so a record can
+ * only be forged by someone who holds the key, and a chunk can only be made
+ * to match an existing record by someone who holds the key. Records are only
+ * ever appended, each by a single write to a file opened in append mode, so
+ * concurrent writers do not corrupt each other's records. Each process maps
+ * the file read-only and shared, and indexes the records it has seen in
+ * memory. Records appended by other processes are picked up when a lookup
+ * misses.
+ *
+ * The header records the format of the file, VERIFIER_RULES_VERSION, and a
+ * value derived from the key. A file written by a different version of the
+ * verifier, or with a different key, is discarded and replaced rather than
+ * trusted. The file is created readable and writable only by its owner, and
+ * is refused if it is a symbolic link, if it is owned by anyone else, or if
+ * anyone else may write to it. Files are replaced (by compaction, or because
+ * of a version mismatch) by writing a new file and renaming it over the old
+ * one. Other processes notice the new file the next time a lookup misses.
+ *
+ * Only the outcome of successful verifications is recorded, so an entry in
+ * the file can only ever cause verification to be skipped for bytecode which
+ * the same verifier has already accepted.
+ *
+ * On platforms without memory mapped files, the cache can never be opened.
+ */
+
+/**
+ * Counters describing the use of a cache file since it was opened by this
+ * process.
+ */
+struct verify_file_cache_stats
+{
+    /**
+     * The number of lookups which found a record.
+     */
+    size_t hits;
+    /**
+     * The number of lookups which did not find a record.
+     */
+    size_t misses;
+    /**
+     * The number of records appended by this process.
+     */
+    size_t appends;
+    /**
+     * The number of times the file was compacted by this process.
+     */
+    size_t compactions;
+    /**
+     * The number of distinct valid records currently in the file, as last seen
+     * by this process.
+     */
+    size_t entries;
+    /**
+     * The maximum number of records which the file may hold before it is
+     * compacted. Zero means that no file is open.
+     */
+    size_t capacity;
+};
+typedef struct verify_file_cache_stats verify_file_cache_stats_t;
+
+typedef struct verify_file_cache verify_file_cache_t;
+
+/**
+ * Get the cache file state shared by everything in the process. No file is
+ * open initially.
+ */
+verify_file_cache_t* verify_file_cache_shared(void);
+
+/**
+ * Open a cache file, creating it if it does not exist, and index all of the
+ * records in it. Any previously open file is closed first. As the index is
+ * built here, opening the file before forking worker processes allows the
+ * workers to share the index.
+ *
+ * @param fc The cache file state.
+ * @param path The name of the file.
+ * @param capacity The number of records beyond which the file is compacted.
+ *                 Compaction keeps the most recently appended half.
+ * @param key The secret key shared by every process which uses the file.
+ * @param keylen The number of bytes at @p key.
+ *
+ * @return 0 on success, or an @c errno value describing the failure, which
+ *         is @c EACCES if the file is owned by another user or writable by
+ *         other users.
+ */
+int verify_file_cache_open(verify_file_cache_t* fc, const char* path,
+                           size_t capacity, const unsigned char* key,
+                           size_t keylen);
+
+/**
+ * Close the cache file, if one is open. The file itself is left in place.
+ */
+void verify_file_cache_close(verify_file_cache_t* fc);
+
+/**
+ * Query whether a cache file is open.
+ */
+bool verify_file_cache_enabled(verify_file_cache_t* fc);
+
+/**
+ * Get the key under which chunks must be hashed to be looked up in, or
+ * inserted into, a cache file.
+ *
+ * @return @c false if no file is open, in which case @p key is unchanged.
+ */
+bool verify_file_cache_key(verify_file_cache_t* fc, chunk_key_t* key);
+
+/**
+ * Query whether the file records a chunk as being safe.
+ *
+ * @param fc The cache file state.
+ * @param digest The digest of the chunk, under verify_file_cache_key().
+ * @param len The length of the chunk.
+ */
+bool verify_file_cache_lookup(verify_file_cache_t* fc,
+                              const chunk_digest_t* digest, size_t len);
+
+/**
+ * Record in the file that a chunk is safe, compacting the file first if it
+ * is full. Failures to write are ignored, as the file is only a cache.
+ *
+ * @param fc The cache file state.
+ * @param digest The digest of the chunk, under verify_file_cache_key().
+ * @param len The length of the chunk.
+ */
+void verify_file_cache_insert(verify_file_cache_t* fc,
+                              const chunk_digest_t* digest, size_t len);
+
+/**
+ * Rewrite the file with duplicate, damaged, and the oldest records removed,
+ * such that at most half of the capacity is used.
+ *
+ * @return 0 on success, or an @c errno value describing the failure.
+ */
+int verify_file_cache_compact(verify_file_cache_t* fc);
+
+/**
+ * Get the counters of a cache file.
+ */
+void verify_file_cache_getstats(verify_file_cache_t* fc,
+                                verify_file_cache_stats_t* stats);
+
+#endif /* _LBCV_FCACHE_H_ */
@@ -0,0 +1,190 @@
+/* Copyright (c) 2010 Peter Cawley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include "filebuf.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__unix) || \
+    (defined(__APPLE__) && defined(__MACH__))
+#define LBCV_USE_POSIX_IO
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef LBCV_USE_POSIX_IO
+
+int read_file(file_buffer_t* fb, const char* path, lua_Alloc alloc,
+              void* allocud)
+{
+    struct stat st;
+    unsigned char* buffer;
+    size_t size, got = 0;
+    int fd, err;
+
+    fb->data = NULL;
+    fb->size = 0;
+    fb->alloc = alloc;
+    fb->allocud = allocud;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return errno;
+    if(fstat(fd, &st) != 0)
+    {
+        err = errno;
+        close(fd);
+        return err;
+    }
+    if(!S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+    }
+    if((off_t)(size_t)st.st_size != st.st_size)
+    {
+        close(fd);
+        return EFBIG;
+    }
+    size = (size_t)st.st_size;
+    if(size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+    buffer = (unsigned char*)alloc(allocud, NULL, 0, size);
+    if(buffer == NULL)
+    {
+        close(fd);
+        return ENOMEM;
+    }
+    /* If the file is truncated while it is being read, then whatever was
+      read before the new end is kept. */
+    while(got < size)
+    {
+        ssize_t n = read(fd, buffer + got, size - got);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            err = errno;
+            close(fd);
+            alloc(allocud, buffer, size, 0);
+            return err;
+        }
+        if(n == 0)
+            break;
+        got += (size_t)n;
+    }
+    close(fd);
+    if(got == 0)
+    {
+        alloc(allocud, buffer, size, 0);
+        return 0;
+    }
+    if(got != size)
+    {
+        unsigned char* shrunk = (unsigned char*)alloc(allocud, buffer, size,
+            got);
+        if(shrunk == NULL)
+        {
+            alloc(allocud, buffer, size, 0);
+            return ENOMEM;
+        }
+        buffer = shrunk;
+    }
+    fb->data = buffer;
+    fb->size = got;
+    return 0;
+}
+
+#else
+
+int read_file(file_buffer_t* fb, const char* path, lua_Alloc alloc,
+              void* allocud)
+{
+    FILE* f;
+    long size;
+    unsigned char* buffer;
+
+    fb->data = NULL;
+    fb->size = 0;
+    fb->alloc = alloc;
+    fb->allocud = allocud;
+
+    f = fopen(path, "rb");
+    if(f == NULL)
+        return errno;
+    if(fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0
+    || fseek(f, 0, SEEK_SET) != 0)
+    {
+        int err = errno;
+        fclose(f);
+        return err ? err : EIO;
+    }
+    if(size == 0)
+    {
+        fclose(f);
+        return 0;
+    }
+    buffer = (unsigned char*)alloc(allocud, NULL, 0, (size_t)size);
+    if(buffer == NULL)
+    {
+        fclose(f);
+        return ENOMEM;
+    }
+    if(fread(buffer, 1, (size_t)size, f) != (size_t)size)
+    {
+        int err = ferror(f) ? EIO : EINVAL;
+        fclose(f);
+        alloc(allocud, buffer, (size_t)size, 0);
+        return err;
+    }
+    fclose(f);
+    fb->data = buffer;
+    fb->size = (size_t)size;
+    return 0;
+}
+
+#endif
+
+bool skip_file_prefix(const char** s, size_t* len)
+{
+    if(*len >= 3 && memcmp(*s, "\xEF\xBB\xBF", 3) == 0)
+        *s += 3, *len -= 3;
+    if(*len != 0 && **s == '#')
+    {
+        const char* eol = (const char*)memchr(*s, '\n', *len);
+        *len = eol ? *len - (size_t)(eol + 1 - *s) : 0;
+        *s = eol ? eol + 1 : *s + 1;
+        return true;
+    }
+    return false;
+}
+
+void free_file_buffer(file_buffer_t* fb)
+{
+    if(fb->size != 0)
+        fb->alloc(fb->allocud, (void*)fb->data, fb->size, 0);
+    fb->data = NULL;
+    fb->size = 0;
+}
@@ -0,0 +1,97 @@
+/* Copyright (c) 2010 Peter Cawley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#ifndef _LBCV_FILEBUF_H_
+#define _LBCV_FILEBUF_H_
+#include "defs.h"
+#include <lua.h>
+
+/**
+ * @file
+ * Read-only access to the entire contents of a file, read into one contiguous
+ * block of memory, which allows bytecode in the file to be decoded in a single
+ * call to decode_bytecode_pump() with decode_state::view set.
+ *
+ * The file is copied into a private buffer rather than mapped into memory.
+ * Pages of a private mapping which have not been written to still reflect
+ * later changes to the file, so the bytes given to @c lua_load could differ
+ * from the bytes which were verified, and a mapping of a file which is then
+ * truncated raises @c SIGBUS when read.
+ */
+
+/**
+ * A file whose contents have been made available by read_file().
+ */
+struct file_buffer
+{
+    /**
+     * The contents of the file. Only valid if file_buffer::size is non-zero.
+     */
+    const unsigned char* data;
+    /**
+     * The number of bytes at file_buffer::data.
+     */
+    size_t size;
+    /**
+     * The allocator used for the buffer.
+     */
+    lua_Alloc alloc;
+    /**
+     * An opaque pointer passed to file_buffer::alloc.
+     */
+    void* allocud;
+};
+typedef struct file_buffer file_buffer_t;
+
+/**
+ * Read the entire contents of a file into a buffer of its own.
+ *
+ * @param fb The structure to fill in. On failure, it is left in a state where
+ *           it can still be passed to free_file_buffer().
+ * @param path The name of the file.
+ * @param alloc The allocator function to use for the buffer.
+ * @param allocud An opaque pointer which will be passed to @p alloc.
+ *
+ * @return 0 on success, or an @c errno value describing the failure.
+ */
+int read_file(file_buffer_t* fb, const char* path, lua_Alloc alloc,
+              void* allocud);
+
+/**
+ * Release the contents of a file previously made available by read_file().
+ * Calling this more than once for the same structure is harmless.
+ *
+ * @param fb The structure which was passed to read_file().
+ */
+void free_file_buffer(file_buffer_t* fb);
+
+/**
+ * Skip an optional UTF-8 byte order mark, and then an optional first line
+ * beginning with '#', as @c luaL_loadfile does.
+ *
+ * @param s The contents of a file, advanced past whatever is skipped. If
+ *          nothing remains, then it may point just beyond the end.
+ * @param len The number of bytes at @p s, reduced by the number skipped.
+ *
+ * @return @c true if a first line was skipped.
+ */
+bool skip_file_prefix(const char** s, size_t* len);
+
+#endif /* _LBCV_FILEBUF_H_ */
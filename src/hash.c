@@ -0,0 +1,237 @@
+/* Copyright (c) 2010 Peter Cawley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include "hash.h"
+#include <string.h>
+#include <time.h>
+
+#if defined(__unix__) || defined(__unix) || \
+    (defined(__APPLE__) && defined(__MACH__))
+#define LBCV_USE_URANDOM
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef LBCV_USE_PTHREADS
+#include <pthread.h>
+#endif
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+#define SIPROUND(v0, v1, v2, v3) \
+    (v0 += v1, v1 = ROTL64(v1, 13), v1 ^= v0, v0 = ROTL64(v0, 32), \
+     v2 += v3, v3 = ROTL64(v3, 16), v3 ^= v2, \
+     v0 += v3, v3 = ROTL64(v3, 21), v3 ^= v0, \
+     v2 += v1, v1 = ROTL64(v1, 17), v1 ^= v2, v2 = ROTL64(v2, 32))
+
+/**
+ * Read a little endian 64-bit integer from possibly unaligned memory.
+ */
+static uint64_t load64(const unsigned char* p)
+{
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16)
+        | ((uint64_t)p[3] << 24) | ((uint64_t)p[4] << 32)
+        | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48)
+        | ((uint64_t)p[7] << 56);
+}
+
+/**
+ * Mix a whole number of 8 byte words into the state.
+ */
+static void hash_words(chunk_hash_t* hash, const unsigned char* data,
+                       size_t nwords)
+{
+    uint64_t v0 = hash->v0;
+    uint64_t v1 = hash->v1;
+    uint64_t v2 = hash->v2;
+    uint64_t v3 = hash->v3;
+    for(; nwords != 0; --nwords, data += 8)
+    {
+        uint64_t m = load64(data);
+        v3 ^= m;
+        SIPROUND(v0, v1, v2, v3);
+        SIPROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    hash->v0 = v0;
+    hash->v1 = v1;
+    hash->v2 = v2;
+    hash->v3 = v3;
+}
+
+static chunk_key_t process_key;
+
+/*
+** Fill `buf' from the operating system's random number generator, returning
+** false if there is none or it fails.
+*/
+static bool random_bytes(unsigned char* buf, size_t len)
+{
+#ifdef LBCV_USE_URANDOM
+    int fd = open("/dev/urandom", O_RDONLY);
+    if(fd < 0)
+        return false;
+    while(len != 0)
+    {
+        ssize_t n = read(fd, buf, len);
+        if(n <= 0)
+        {
+            if(n < 0 && errno == EINTR)
+                continue;
+            close(fd);
+            return false;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    close(fd);
+    return true;
+#else
+    (void)buf;
+    (void)len;
+    return false;
+#endif
+}
+
+static void make_process_key(void)
+{
+    unsigned char buf[16];
+    if(random_bytes(buf, sizeof(buf)))
+    {
+        process_key.k0 = load64(buf);
+        process_key.k1 = load64(buf + 8);
+    }
+    else
+    {
+        /* Hash whatever varies from one run to the next. */
+        chunk_key_t seed = {UINT64_C(0x6C6263762D6B6579), 0};
+        chunk_hash_t hash;
+        chunk_digest_t digest;
+        time_t t = time(NULL);
+        clock_t c = clock();
+        const void* addresses[2];
+        addresses[0] = &process_key;
+        addresses[1] = &hash;
+        chunk_hash_init(&hash, &seed);
+        chunk_hash_update(&hash, (const unsigned char*)&t, sizeof(t));
+        chunk_hash_update(&hash, (const unsigned char*)&c, sizeof(c));
+        chunk_hash_update(&hash, (const unsigned char*)addresses,
+            sizeof(addresses));
+        chunk_hash_final(&hash, &digest);
+        process_key.k0 = digest.h1;
+        process_key.k1 = digest.h2;
+    }
+}
+
+#ifdef LBCV_USE_PTHREADS
+static pthread_once_t process_key_once = PTHREAD_ONCE_INIT;
+#else
+static bool process_key_made = false;
+#endif
+
+const chunk_key_t* chunk_key_process(void)
+{
+#ifdef LBCV_USE_PTHREADS
+    pthread_once(&process_key_once, make_process_key);
+#else
+    if(!process_key_made)
+    {
+        make_process_key();
+        process_key_made = true;
+    }
+#endif
+    return &process_key;
+}
+
+void chunk_hash_init(chunk_hash_t* hash, const chunk_key_t* key)
+{
+    hash->v0 = key->k0 ^ UINT64_C(0x736f6d6570736575);
+    /* The 128-bit variant differs here and in chunk_hash_final(). */
+    hash->v1 = key->k1 ^ UINT64_C(0x646f72616e646f6d) ^ 0xee;
+    hash->v2 = key->k0 ^ UINT64_C(0x6c7967656e657261);
+    hash->v3 = key->k1 ^ UINT64_C(0x7465646279746573);
+    hash->len = 0;
+}
+
+void chunk_hash_update(chunk_hash_t* hash, const unsigned char* data,
+                       size_t len)
+{
+    size_t used = hash->len % 8;
+    hash->len += len;
+
+    /* Complete a partial word left over from the previous piece. */
+    if(used != 0)
+    {
+        size_t n = 8 - used;
+        if(n > len)
+            n = len;
+        memcpy(hash->tail + used, data, n);
+        data += n;
+        len -= n;
+        if(used + n < 8)
+            return;
+        hash_words(hash, hash->tail, 1);
+    }
+
+    hash_words(hash, data, len / 8);
+    data += len & ~(size_t)7;
+    memcpy(hash->tail, data, len % 8);
+}
+
+void chunk_hash_final(const chunk_hash_t* hash, chunk_digest_t* digest)
+{
+    uint64_t v0 = hash->v0;
+    uint64_t v1 = hash->v1;
+    uint64_t v2 = hash->v2;
+    uint64_t v3 = hash->v3;
+    uint64_t b = (uint64_t)hash->len << 56;
+    size_t i;
+
+    for(i = 0; i < hash->len % 8; ++i)
+        b |= (uint64_t)hash->tail[i] << (i * 8);
+    v3 ^= b;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    v0 ^= b;
+
+    v2 ^= 0xee;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    digest->h1 = v0 ^ v1 ^ v2 ^ v3;
+
+    v1 ^= 0xdd;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    digest->h2 = v0 ^ v1 ^ v2 ^ v3;
+}
+
+void chunk_hash_buffer(const chunk_key_t* key, const unsigned char* data,
+                       size_t len, chunk_digest_t* digest)
+{
+    chunk_hash_t hash;
+    chunk_hash_init(&hash, key);
+    chunk_hash_update(&hash, data, len);
+    chunk_hash_final(&hash, digest);
+}
@@ -0,0 +1,125 @@
+/* Copyright (c) 2010 Peter Cawley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#ifndef _LBCV_HASH_H_
+#define _LBCV_HASH_H_
+#include "defs.h"
+#include <stdint.h>
+
+/**
+ * @file
+ * A keyed, 128-bit hash of a stream of bytes, used to identify chunks of
+ * bytecode which have been seen before. The hash is SipHash-2-4 with 128 bits
+ * of output, as designed by Jean-Philippe Aumasson and Daniel J. Bernstein,
+ * structured so that the bytes can be supplied in arbitrarily sized pieces.
+ *
+ * A cache entry is trusted as proof that bytecode is safe, so the digest must
+ * not be predictable by whoever supplies the bytecode: with a fast unkeyed
+ * hash, unsafe bytecode could be crafted to have the same digest as safe
+ * bytecode which is already cached. SipHash is a pseudorandom function of its
+ * key, so without the key, such collisions cannot be found.
+ */
+
+/**
+ * A secret key for chunk_hash_init().
+ */
+struct chunk_key
+{
+    uint64_t k0;
+    uint64_t k1;
+};
+typedef struct chunk_key chunk_key_t;
+
+/**
+ * The 128-bit result of hashing a stream of bytes.
+ */
+struct chunk_digest
+{
+    uint64_t h1;
+    uint64_t h2;
+};
+typedef struct chunk_digest chunk_digest_t;
+
+/**
+ * State for hashing a stream of bytes.
+ */
+struct chunk_hash
+{
+    uint64_t v0;
+    uint64_t v1;
+    uint64_t v2;
+    uint64_t v3;
+    /**
+     * The total number of bytes supplied so far.
+     */
+    size_t len;
+    /**
+     * Bytes which have been supplied but which do not yet form a complete
+     * 8 byte word. The number of them is chunk_hash::len modulo 8.
+     */
+    unsigned char tail[8];
+};
+typedef struct chunk_hash chunk_hash_t;
+
+/**
+ * Get a key which is chosen at random the first time that it is needed, and
+ * which is then the same for the rest of the life of the process. Digests
+ * made with it are only meaningful within the process.
+ *
+ * The key comes from the operating system's random number generator where
+ * there is one. Otherwise, it is only as unpredictable as the time at which
+ * it was made and the addresses at which the process was loaded.
+ */
+const chunk_key_t* chunk_key_process(void);
+
+/**
+ * Prepare to hash a new stream of bytes.
+ *
+ * @param hash The state to prepare.
+ * @param key The secret key, which is copied, so need not outlive the state.
+ */
+void chunk_hash_init(chunk_hash_t* hash, const chunk_key_t* key);
+
+/**
+ * Supply the next piece of the stream of bytes being hashed.
+ *
+ * @param hash A state prepared by chunk_hash_init().
+ * @param data The bytes.
+ * @param len The number of bytes at @p data.
+ */
+void chunk_hash_update(chunk_hash_t* hash, const unsigned char* data,
+                       size_t len);
+
+/**
+ * Compute the hash of every byte supplied so far. This does not modify the
+ * state, so more bytes can be supplied afterwards.
+ *
+ * @param hash A state prepared by chunk_hash_init().
+ * @param digest A pointer to a variable into which the result will be stored.
+ */
+void chunk_hash_final(const chunk_hash_t* hash, chunk_digest_t* digest);
+
+/**
+ * Hash a contiguous block of bytes in a single call.
+ */
+void chunk_hash_buffer(const chunk_key_t* key, const unsigned char* data,
+                       size_t len, chunk_digest_t* digest);
+
+#endif /* _LBCV_HASH_H_ */
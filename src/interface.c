@@ -24,24 +24,159 @@ Copyright (C) 1994-2010 Lua.org, PUC-Rio.  All rights reserved.
 */
 
 #define LUA_LIB
+#include "batch.h"
 #include "decoder.h"
+#include "fcache.h"
+#include "filebuf.h"
+#include "parallel.h"
+#include "proof.h"
+#include "threadpool.h"
+#include "vcache.h"
 #include "verifier.h"
 #include <lauxlib.h>
 #include <string.h>
 
+/*
+** Get the shared cache of prototypes known to be safe, or NULL if it is
+** disabled.
+*/
+static verify_cache_t* prototype_cache(void)
+{
+    verify_cache_t* cache = verify_cache_shared_prototypes();
+    return verify_cache_enabled(cache) ? cache : NULL;
+}
+
+/*
+** Begin decoding bytecode, with each prototype being verified as soon as it
+** has been decoded, and charged to `budget' unless it is NULL. Returns NULL
+** on memory allocation failure.
+*/
+static decode_state_t* decode_verify_init(lua_Alloc alloc, void* allocud,
+                                          verify_budget_t* budget)
+{
+    decode_state_t* ds = decode_bytecode_init(alloc, allocud);
+    if(ds != NULL)
+    {
+        ds->verifyud = verify_state_create(alloc, allocud, 0, 0);
+        if(ds->verifyud == NULL)
+        {
+            decode_bytecode_finish(ds);
+            return NULL;
+        }
+        ((verify_state_t*)ds->verifyud)->cache = prototype_cache();
+        ((verify_state_t*)ds->verifyud)->budget = budget;
+        ds->verify = verify_decoded_prototype;
+    }
+    return ds;
+}
+
+/*
+** Whether chunks need hashing, because either the in-memory chunk cache or a
+** cache file is enabled.
+*/
+static bool chunk_caching(void)
+{
+    return verify_cache_enabled(verify_cache_shared())
+        || verify_file_cache_enabled(verify_file_cache_shared());
+}
+
+/*
+** Get the key under which chunks are hashed for the caches. Every process
+** sharing a cache file has to find the same records, so the key of the file
+** is used while one is open. Digests made under the other key then simply
+** never match.
+*/
+static void chunk_cache_key(chunk_key_t* key)
+{
+    if(!verify_file_cache_key(verify_file_cache_shared(), key))
+        *key = *chunk_key_process();
+}
+
+/*
+** Have a decode state hash everything it is given, if any cache is enabled.
+*/
+static void start_hashing(decode_state_t* ds)
+{
+    chunk_key_t key;
+    ds->hashing = chunk_caching();
+    if(ds->hashing)
+    {
+        chunk_cache_key(&key);
+        chunk_hash_init(&ds->hash, &key);
+    }
+}
+
+/*
+** Record the outcome of verifying a chunk in the shared verification cache,
+** and, if it is safe, in the cache file. Failures are only recorded when they
+** are a property of the bytecode itself, rather than of (for example) the
+** memory available at the time.
+*/
+static void cache_outcome(const chunk_digest_t* digest, size_t len, bool safe,
+                          int status)
+{
+    if(safe)
+    {
+        status = DECODE_YIELD;
+        verify_file_cache_insert(verify_file_cache_shared(), digest, len);
+    }
+    else if(status != DECODE_FAIL && status != DECODE_UNSAFE)
+        return;
+    verify_cache_insert(verify_cache_shared(), digest, len, safe, status);
+}
+
+/*
+** Finish decoding bytecode started by decode_verify_init(). Returns NULL if
+** the bytecode was not decoded, or was not verified. Otherwise, returns the
+** (already verified) tree, which must be freed with free_prototype(). If the
+** decode state was hashing its input, then the outcome is recorded in the
+** verification cache, with `status' being the last result of
+** decode_bytecode_pump().
+*/
+static decoded_prototype_t* decode_verify_finish(decode_state_t* ds,
+                                                 int status)
+{
+    decoded_prototype_t* proto;
+    chunk_digest_t digest;
+    size_t len = ds->hash.len;
+    bool hashing = ds->hashing;
+    if(hashing)
+        chunk_hash_final(&ds->hash, &digest);
+    verify_state_free((verify_state_t*)ds->verifyud);
+    proto = decode_bytecode_finish(ds);
+    if(hashing)
+        cache_outcome(&digest, len, proto != NULL, status);
+    return proto;
+}
+
+/*
+** The state of a call to lbcv.verify which may yield, either because it has a
+** reader function or because verification pauses between slices. This is
+** kept in a userdata so that it survives the yields.
+*/
+typedef struct verify_call
+{
+    decode_state_t* ds;
+    verify_budget_t budget;
+    /* For a string chunk, its length without any proof trailer, and its
+      digest if the outcome is to be cached. */
+    size_t len;
+    chunk_digest_t digest;
+    bool string;
+    bool hashed;
+    /* Whether pauses yield, which the caller must ask for with the "yield"
+      option, and which is never done on the main thread. */
+    bool yieldable;
+} verify_call_t;
+
 static int l_cleanup_decode_state(lua_State* L)
 {
     decoded_prototype_t* proto;
-    decode_state_t* ds = *(decode_state_t**)lua_touserdata(L, 1);
+    decode_state_t* ds = ((verify_call_t*)lua_touserdata(L, 1))->ds;
     if(ds)
     {
-        proto = decode_bytecode_finish(ds);
-        if(proto)
-        {
-            void* allocud;
-            lua_Alloc alloc = lua_getallocf(L, &allocud);
-            free_prototype(proto, alloc, allocud);
-        }
+        proto = decode_verify_finish(ds, DECODE_ERROR);
+        free_prototype(proto);
     }
     return 0;
 }
@@ -52,7 +187,9 @@ static int decode_fail(lua_State* L, int status)
     switch(status)
     {
     case DECODE_UNSAFE:
-        lua_pushliteral(L, "verification failed during decode");
+        /* Prototypes are verified as they are decoded, so this is also how
+          the verifier rejects bytecode. */
+        lua_pushliteral(L, "verification failed");
         break;
 
     case DECODE_ERROR:
@@ -63,6 +200,10 @@ static int decode_fail(lua_State* L, int status)
         lua_pushliteral(L, "insufficient memory");
         break;
 
+    case DECODE_BUDGET:
+        lua_pushliteral(L, "budget exceeded");
+        break;
+
     default:
         lua_pushliteral(L, "unable to load bytecode");
         break;
@@ -70,11 +211,61 @@ static int decode_fail(lua_State* L, int status)
     return 2;
 }
 
-static int verify_fail(lua_State* L)
+/*
+** Read one limit from the options table at `idx', which must be absent or a
+** non-negative number, clamping it to `max'.
+*/
+static uint64_t opt_limit(lua_State* L, int idx, const char* name,
+                          uint64_t max)
 {
-    lua_pushnil(L);
-    lua_pushliteral(L, "verification failed");
-    return 2;
+    lua_Number n = 0;
+    int isnum;
+    lua_getfield(L, idx, name);
+    if(!lua_isnil(L, -1))
+    {
+        n = lua_tonumberx(L, -1, &isnum);
+        if(!isnum || !(n >= 0))
+            luaL_error(L, "option '%s' must be a non-negative number", name);
+    }
+    lua_pop(L, 1);
+    return n >= (lua_Number)max ? max : (uint64_t)n;
+}
+
+/*
+** Read the limits of a budget from the options table at `idx' into `budget',
+** and clear its record of work done. Returns NULL if no table was given.
+*/
+static verify_budget_t* opt_budget(lua_State* L, int idx,
+                                   verify_budget_t* budget)
+{
+    if(lua_isnoneornil(L, idx))
+        return NULL;
+    luaL_checktype(L, idx, LUA_TTABLE);
+    budget->max_traced = (size_t)opt_limit(L, idx, "maxtraced",
+        (size_t)-1);
+    budget->max_merges = (size_t)opt_limit(L, idx, "maxmerges",
+        (size_t)-1);
+    budget->max_nanoseconds = opt_limit(L, idx, "maxnanoseconds",
+        UINT64_MAX);
+    budget->traced = 0;
+    budget->merges = 0;
+    budget->nanoseconds = 0;
+    return budget;
+}
+
+/*
+** Record the work done under a budget in the options table at `idx', so that
+** the caller can see how much of the budget was used.
+*/
+static void set_budget_used(lua_State* L, int idx,
+                            const verify_budget_t* budget)
+{
+    lua_pushnumber(L, (lua_Number)budget->traced);
+    lua_setfield(L, idx, "traced");
+    lua_pushnumber(L, (lua_Number)budget->merges);
+    lua_setfield(L, idx, "merges");
+    lua_pushnumber(L, (lua_Number)budget->nanoseconds);
+    lua_setfield(L, idx, "nanoseconds");
 }
 
 static int not_string_err(lua_State* L)
@@ -83,89 +274,314 @@ static int not_string_err(lua_State* L)
     return lua_error(L);
 }
 
-static int l_verify(lua_State* L)
+#define THREAD_POOL_KEY "lbcv.threads"
+#define THREAD_POOL_MT "lbcv.threadpool"
+
+/*
+** Bytecode chunks smaller than this are decoded and verified by a single
+** thread, even when a thread pool is available, as starting the threads would
+** cost more than it saves.
+*/
+#define PARALLEL_MIN_CHUNK (64 * 1024)
+
+static thread_pool_t* get_thread_pool(lua_State* L)
+{
+    thread_pool_t* pool = NULL;
+    lua_getfield(L, LUA_REGISTRYINDEX, THREAD_POOL_KEY);
+    if(lua_type(L, -1) == LUA_TUSERDATA)
+        pool = *(thread_pool_t**)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return pool;
+}
+
+/*
+** Compute the digest of a chunk, and look up the outcome of verifying it in
+** the caches. Returns true, and sets `*status', if the outcome is known.
+** Hashing is far cheaper than decoding and verifying, so a chunk which has
+** been seen before is answered without doing either.
+*/
+static bool lookup_outcome(const char* str, size_t len, chunk_digest_t* digest,
+                           int* status)
+{
+    verify_cache_t* cache = verify_cache_shared();
+    chunk_key_t key;
+    chunk_cache_key(&key);
+    chunk_hash_buffer(&key, (const unsigned char*)str, len, digest);
+    if(verify_cache_lookup(cache, digest, len, status))
+        return true;
+    if(verify_file_cache_lookup(verify_file_cache_shared(), digest, len))
+    {
+        verify_cache_insert(cache, digest, len, true, DECODE_YIELD);
+        *status = DECODE_YIELD;
+        return true;
+    }
+    return false;
+}
+
+/*
+** Decode and verify an entire chunk of bytecode which is held in memory that
+** remains valid until this returns. Returns 0 if the bytecode is safe, or
+** pushes nil plus an error message and returns 2 otherwise. If `batch' is not
+** NULL, then chunks which are verified by a single thread use its decode
+** state and verifier scratch space rather than allocating their own. If
+** `budget' is not NULL, then verification is charged to it.
+*/
+static int verify_buffer(lua_State* L, const char* str, size_t len,
+                         verify_batch_t* batch, verify_budget_t* budget)
 {
-    decoded_prototype_t* proto = NULL;
     void* allocud;
     lua_Alloc alloc = lua_getallocf(L, &allocud);
-    decode_state_t* ds = NULL;
-    decode_state_t** pds = &ds;
-    int status = DECODE_YIELD;
-    size_t len;
-    const char* str;
+    thread_pool_t* pool = get_thread_pool(L);
+    chunk_digest_t digest;
+    bool cached = chunk_caching();
+    decode_state_t* ds;
+    decoded_prototype_t* proto;
+    int status;
+
+    if(cached && lookup_outcome(str, len, &digest, &status))
+        return status == DECODE_YIELD ? 0 : decode_fail(L, status);
 
-    if(lua_type(L, 1) != LUA_TSTRING)
+    /* A budget is only charged by a single thread, so that it limits the
+      time for which the caller is held up. */
+    if(pool != NULL && budget == NULL && len >= PARALLEL_MIN_CHUNK)
     {
-        if(lua_getctx(L, NULL) == LUA_OK)
+        ds = decode_bytecode_init(alloc, allocud);
+        if(ds == NULL)
+            return decode_fail(L, DECODE_ERROR_MEM);
+        ds->view = true;
+        status = decode_bytecode_parallel(ds, (const unsigned char*)str, len,
+            pool);
+        proto = decode_bytecode_finish(ds);
+        if(proto == NULL)
         {
-            /* If the reader function throws an error, then the decode state
-              should still get cleaned. This is achieved by creating a userdata
-              whose garbage collection metamethod cleans up the decode state.
-              This also allows the decode state to be maintained if the reader
-              function yields. */
-            lua_settop(L, 1);
-            pds = (decode_state_t**)lua_newuserdata(L, sizeof(decode_state_t*));
-            lua_createtable(L, 0, 1);
-            lua_pushcfunction(L, l_cleanup_decode_state);
-            lua_setfield(L, 3, "__gc");
-            lua_setmetatable(L, 2);
+            if(cached)
+                cache_outcome(&digest, len, false, status);
+            return decode_fail(L, status);
         }
-        else
+        status = verify_parallel(proto, pool, alloc, allocud,
+            prototype_cache());
+        free_prototype(proto);
+        if(cached)
+            cache_outcome(&digest, len, status == DECODE_YIELD, status);
+        return status == DECODE_YIELD ? 0 : decode_fail(L, status);
+    }
+
+    if(batch != NULL)
+    {
+        batch->vs->cache = prototype_cache();
+        batch->vs->budget = budget;
+        status = verify_batch_chunk(batch, (const unsigned char*)str, len);
+        if(cached)
+            cache_outcome(&digest, len, status == DECODE_YIELD, status);
+        return status == DECODE_YIELD ? 0 : decode_fail(L, status);
+    }
+
+    ds = decode_verify_init(alloc, allocud, budget);
+    if(ds == NULL)
+        return decode_fail(L, DECODE_ERROR_MEM);
+    ds->view = true;
+    status = decode_bytecode_pump(ds, (const unsigned char*)str, len);
+    proto = decode_verify_finish(ds, status);
+    if(cached)
+        cache_outcome(&digest, len, proto != NULL, status);
+    if(proto == NULL)
+        return decode_fail(L, status);
+    free_prototype(proto);
+    return 0;
+}
+
+#define PROOF_KEY "lbcv.proofkey"
+
+/*
+** If the chunk ends with a proof trailer, then remove the trailer by reducing
+** `*len', and return whether it is a valid proof under the proof key of the
+** state.
+*/
+static bool check_proof(lua_State* L, const char* str, size_t* len)
+{
+    size_t chunklen = proof_strip((const unsigned char*)str, *len);
+    bool proven = false;
+    if(chunklen != *len)
+    {
+        size_t keylen;
+        const char* key;
+        lua_getfield(L, LUA_REGISTRYINDEX, PROOF_KEY);
+        key = lua_tolstring(L, -1, &keylen);
+        if(key != NULL)
         {
-            pds = (decode_state_t**)lua_touserdata(L, 2);
-            ds = *pds;
-            goto resume_continuation;
+            proven = proof_check((const unsigned char*)key, keylen,
+                (const unsigned char*)str, *len);
         }
+        lua_pop(L, 1);
+        *len = chunklen;
+    }
+    return proven;
+}
+
+/*
+** As verify_buffer(), but if the chunk ends with a proof trailer, then the
+** trailer is first removed by reducing `*len'. If the trailer is a valid
+** proof under the proof key of the state, then the chunk is not verified
+** again. Otherwise, it is verified in full.
+*/
+static int verify_chunk(lua_State* L, const char* str, size_t* len,
+                        verify_batch_t* batch, verify_budget_t* budget)
+{
+    if(check_proof(L, str, len))
+        return 0;
+    return verify_buffer(L, str, *len, batch, budget);
+}
+
+/* The continuation contexts of l_verify(). */
+#define VERIFY_CTX_READ 1
+#define VERIFY_CTX_PAUSE 2
+
+static int l_verify(lua_State* L)
+{
+    decoded_prototype_t* proto = NULL;
+    void* allocud;
+    lua_Alloc alloc = lua_getallocf(L, &allocud);
+    decode_state_t* ds = NULL;
+    verify_call_t* vc;
+    verify_budget_t* budget;
+    int status = DECODE_YIELD;
+    int ctx;
+    size_t len, slice = 0;
+    bool yield = false;
+    const char* str = NULL;
+
+    if(lua_getctx(L, &ctx) != LUA_OK)
+    {
+        vc = (verify_call_t*)lua_touserdata(L, 3);
+        ds = vc->ds;
+        budget = lua_isnil(L, 2) ? NULL : &vc->budget;
+        if(ctx == VERIFY_CTX_READ)
+            goto read_continuation;
+        /* Resumed after a pause, so discard whatever was passed to
+          coroutine.resume, but keep the piece being decoded. */
+        lua_settop(L, 4);
+        status = decode_bytecode_resume(ds);
+        goto pump_continuation;
     }
 
-    ds = decode_bytecode_init(alloc, allocud);
-    *pds = ds;
-    if(lua_type(L, 1) == LUA_TSTRING)
+    lua_settop(L, 2);
+    if(!lua_isnil(L, 2))
     {
+        luaL_checktype(L, 2, LUA_TTABLE);
+        slice = (size_t)opt_limit(L, 2, "slice", (size_t)-1);
+        lua_getfield(L, 2, "yield");
+        yield = lua_toboolean(L, -1) != 0;
+        lua_pop(L, 1);
+    }
+    if(lua_type(L, 1) == LUA_TSTRING && slice == 0)
+    {
+        verify_budget_t spent;
+        budget = opt_budget(L, 2, &spent);
+        /* The string stays at stack index 1 until the decoded prototype has
+          been freed, so instructions can be used directly from it. */
         str = lua_tolstring(L, 1, &len);
-        status = decode_bytecode_pump(ds, (const unsigned char*)str, len);
+        status = verify_chunk(L, str, &len, NULL, budget);
+        if(budget != NULL)
+            set_budget_used(L, 2, budget);
+        if(status)
+            return 2;
+        lua_pushboolean(L, 1);
+        return 1;
     }
-    else
+
+    /* If the reader function throws an error, or the coroutine is abandoned
+      while verification is paused, then the decode state should still get
+      cleaned. This is achieved by creating a userdata whose garbage
+      collection metamethod cleans up the decode state. This also allows the
+      decode state (and the budget) to be maintained across yields. */
+    vc = (verify_call_t*)lua_newuserdata(L, sizeof(verify_call_t));
+    vc->ds = NULL;
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, l_cleanup_decode_state);
+    lua_setfield(L, 4, "__gc");
+    lua_setmetatable(L, 3);
+    budget = opt_budget(L, 2, &vc->budget);
+    vc->string = lua_type(L, 1) == LUA_TSTRING;
+    vc->hashed = false;
+    /* Yielding is opt-in, because a coroutine which called this from inside
+      a C function without a continuation (such as a table.sort comparator)
+      cannot yield, and there is no way to tell that from here. */
+    vc->yieldable = false;
+    if(yield)
     {
-        luaL_checktype(L, 1, LUA_TFUNCTION);
-        while(status == DECODE_YIELD)
+        vc->yieldable = !lua_pushthread(L);
+        lua_pop(L, 1);
+    }
+    if(vc->string)
+    {
+        str = lua_tolstring(L, 1, &len);
+        vc->hashed = chunk_caching();
+        if(check_proof(L, str, &len)
+        || (vc->hashed && lookup_outcome(str, len, &vc->digest, &status)))
         {
-            lua_settop(L, 2);
-            lua_pushvalue(L, 1);
-            lua_callk(L, 0, 1, 1, l_verify);
-resume_continuation:
-            str = lua_tolstring(L, 3, &len);
-            if(str == NULL || len == 0)
-            {
-                if(str == NULL && lua_type(L, 3) != LUA_TNIL)
-                    return not_string_err(L);
-                break;
-            }
-            status = decode_bytecode_pump(ds, (const unsigned char*)str, len);
+            if(budget != NULL)
+                set_budget_used(L, 2, budget);
+            if(status != DECODE_YIELD)
+                return decode_fail(L, status);
+            lua_pushboolean(L, 1);
+            return 1;
         }
+        vc->len = len;
     }
-    proto = decode_bytecode_finish(ds);
-    *pds = NULL;
-    if(proto == NULL)
+    else
+        luaL_checktype(L, 1, LUA_TFUNCTION);
+
+    ds = decode_verify_init(alloc, allocud, budget);
+    if(ds == NULL)
+        return decode_fail(L, DECODE_ERROR_MEM);
+    ((verify_state_t*)ds->verifyud)->slice = slice;
+    vc->ds = ds;
+    if(vc->string)
     {
-        return decode_fail(L, status);
+        /* As above, instructions can be used directly from the string. */
+        ds->view = true;
+        status = decode_bytecode_pump(ds, (const unsigned char*)str, len);
+        goto pump_continuation;
     }
-    else
+    start_hashing(ds);
+    for(;;)
     {
-        bool good = verify(proto, alloc, allocud);
-        free_prototype(proto, alloc, allocud);
-        if(good)
+        lua_settop(L, 3);
+        lua_pushvalue(L, 1);
+        lua_callk(L, 0, 1, VERIFY_CTX_READ, l_verify);
+read_continuation:
+        str = lua_tolstring(L, 4, &len);
+        if(str == NULL || len == 0)
         {
-            lua_pushboolean(L, 1);
-            return 1;
+            if(str == NULL && lua_type(L, 4) != LUA_TNIL)
+                return not_string_err(L);
+            break;
         }
-        else
+        status = decode_bytecode_pump(ds, (const unsigned char*)str, len);
+pump_continuation:
+        while(status == DECODE_PAUSE)
         {
-            lua_pushnil(L);
-            lua_pushliteral(L, "verification failed");
-            return 2;
+            /* Give the rest of the program a turn between slices. The time
+              spent suspended is not charged to the budget, as each slice
+              measures its own tracing time. */
+            if(vc->yieldable)
+                return lua_yieldk(L, 0, VERIFY_CTX_PAUSE, l_verify);
+            status = decode_bytecode_resume(ds);
         }
+        if(status != DECODE_YIELD || vc->string)
+            break;
     }
+    proto = decode_verify_finish(ds, status);
+    vc->ds = NULL;
+    if(vc->hashed)
+        cache_outcome(&vc->digest, vc->len, proto != NULL, status);
+    if(budget != NULL)
+        set_budget_used(L, 2, budget);
+    if(proto == NULL)
+        return decode_fail(L, status);
+    free_prototype(proto);
+    lua_pushboolean(L, 1);
+    return 1;
 }
 
 static const char *checkrights(lua_State *L, const char *mode, const char *s)
@@ -177,7 +593,9 @@ static const char *checkrights(lua_State *L, const char *mode, const char *s)
     return NULL;  /* chunk in allowed format */
 }
 
-#define RESERVEDSLOT 5
+/* The arguments of `load' are the reader, chunk name, mode, environment,
+   and verification options. */
+#define RESERVEDSLOT 6
 
 /*
 ** Reader for generic `load' function: `lua_load' uses the
@@ -190,6 +608,7 @@ typedef struct {  /* reader state */
   const char *mode;  /* allowed modes (binary/text) */
   decode_state_t *ds; /* for binary chunks, the decode state */
   int decode_status; /* for binary chunks, result of decode_bytecode_pump */
+  verify_budget_t *budget; /* budget to charge verification to, or NULL */
 } Readstat;
 
 static const char *generic_reader(lua_State *L, void *ud, size_t *size)
@@ -216,12 +635,20 @@ static const char *generic_reader(lua_State *L, void *ud, size_t *size)
             {
                 void* allocud;
                 lua_Alloc alloc = lua_getallocf(L, &allocud);
-                stat->ds = decode_bytecode_init(alloc, allocud);
+                stat->ds = decode_verify_init(alloc, allocud, stat->budget);
+                if(stat->ds == NULL)
+                {
+                    lua_pop(L, 1);
+                    decode_fail(L, DECODE_ERROR_MEM);
+                    lua_error(L);
+                }
+                start_hashing(stat->ds);
             }
         }
         if(stat->ds)
         {
             int status = decode_bytecode_pump(stat->ds, (const unsigned char*)s, len);
+            stat->decode_status = status;
             if(status != DECODE_YIELD)
             {
                 lua_pop(L, 1);
@@ -241,32 +668,27 @@ static const char *generic_reader(lua_State *L, void *ud, size_t *size)
 
 static int check_ds(lua_State *L, Readstat* stat)
 {
-    bool verified;
-    void* allocud;
-    lua_Alloc alloc = lua_getallocf(L, &allocud);
-    decoded_prototype_t* proto = decode_bytecode_finish(stat->ds);
+    decoded_prototype_t* proto = decode_verify_finish(stat->ds,
+        stat->decode_status);
     if(proto == NULL)
         return decode_fail(L, stat->decode_status);
-    verified = verify(proto, alloc, allocud);
-    free_prototype(proto, alloc, allocud);
-    if(!verified)
-        return verify_fail(L);
+    free_prototype(proto);
     return 0;
 }
 
 static int l_load(lua_State *L)
 {
     Readstat stat;
+    verify_budget_t spent;
     size_t len;
     const char *str;
-    void* allocud;
-    lua_Alloc alloc = lua_getallocf(L, &allocud);
     int status;
     int top = lua_gettop(L);
     stat.f = 1;
     stat.mode = luaL_optstring(L, 3, "bt");
     stat.ds = NULL;
     stat.decode_status = DECODE_YIELD;
+    stat.budget = opt_budget(L, 5, &spent);
     str = lua_tolstring(L, stat.f, &len);
 
     if(str == NULL)
@@ -276,6 +698,8 @@ static int l_load(lua_State *L)
         luaL_checktype(L, stat.f, LUA_TFUNCTION);
         lua_settop(L, RESERVEDSLOT);
         status = lua_load(L, generic_reader, (void*)&stat, chunkname);
+        if(stat.budget != NULL)
+            set_budget_used(L, 5, stat.budget);
         if(stat.ds)
         {
             if(check_ds(L, &stat) && status == LUA_OK)
@@ -296,9 +720,10 @@ static int l_load(lua_State *L)
         /* If it is bytecode, verify the bytecode before loading it. */
         if(str[0] == LUA_SIGNATURE[0])
         {
-            stat.ds = decode_bytecode_init(alloc, allocud);
-            stat.decode_status = decode_bytecode_pump(stat.ds, (const unsigned char*)str, len);
-            if(check_ds(L, &stat))
+            status = verify_chunk(L, str, &len, NULL, stat.budget);
+            if(stat.budget != NULL)
+                set_budget_used(L, 5, stat.budget);
+            if(status)
                 return 2;
         }
         /* Do the actual loading. */
@@ -317,9 +742,485 @@ static int l_load(lua_State *L)
     }
 }
 
+/*
+** Reader for `lua_load' over a block of memory, such as the contents of a
+** file. An optional prefix is given to the loader before the block itself.
+*/
+typedef struct {  /* reader state */
+  const char *prefix;  /* bytes to deliver before the block */
+  size_t prefixlen;
+  const char *data;  /* the block */
+  size_t size;
+} Bufferstat;
+
+static const char *buffer_reader(lua_State *L, void *ud, size_t *size)
+{
+    Bufferstat *stat = (Bufferstat *)ud;
+    const char *s;
+    (void)L;
+    if(stat->prefixlen != 0)
+    {
+        *size = stat->prefixlen;
+        stat->prefixlen = 0;
+        return stat->prefix;
+    }
+    s = stat->data;
+    *size = stat->size;
+    stat->data = NULL;
+    stat->size = 0;
+    return *size ? s : NULL;
+}
+
+#define FILE_BUFFER_MT "lbcv.filebuffer"
+
+static int l_cleanup_file_buffer(lua_State* L)
+{
+    free_file_buffer((file_buffer_t*)lua_touserdata(L, 1));
+    return 0;
+}
+
+/*
+** Push a userdata which owns the contents of the file at `path', so that the
+** buffer is released even if an error is thrown before it is explicitly
+** released. Stores 0 or an errno value in `err'.
+*/
+static file_buffer_t *push_file_buffer(lua_State *L, const char *path,
+                                       int *err)
+{
+    file_buffer_t *fb;
+    void* allocud;
+    lua_Alloc alloc = lua_getallocf(L, &allocud);
+    fb = (file_buffer_t*)lua_newuserdata(L, sizeof(file_buffer_t));
+    fb->data = NULL;
+    fb->size = 0;
+    if(luaL_newmetatable(L, FILE_BUFFER_MT))
+    {
+        lua_pushcfunction(L, l_cleanup_file_buffer);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    *err = read_file(fb, path, alloc, allocud);
+    return fb;
+}
+
+/*
+** Verify and load the file at `path'. The file is read into memory once,
+** bytecode is decoded and verified directly from that copy, and then the same
+** copy is given to `lua_load', so that what is loaded is exactly what was
+** verified, even if the file changes in the meantime. On success, the function is pushed and
+** 1 is returned. On failure, nil plus an error message are pushed and 2 is
+** returned.
+*/
+static int load_file(lua_State *L, const char *path, const char *mode)
+{
+    file_buffer_t *fb;
+    Bufferstat buf;
+    const char *chunkname;
+    const char *s;
+    size_t len;
+    int base = lua_gettop(L);
+    int err;
+    int status;
+
+    chunkname = lua_pushfstring(L, "@%s", path);
+    fb = push_file_buffer(L, path, &err);
+    if(err != 0)
+    {
+        lua_pushnil(L);
+        lua_pushfstring(L, "cannot open %s: %s", path, strerror(err));
+        goto done;
+    }
+
+    s = (const char*)fb->data;
+    len = fb->size;
+    if(len == 0)
+        s = "";
+    buf.prefix = NULL;
+    buf.prefixlen = 0;
+    if(skip_file_prefix(&s, &len) && (len == 0 || *s != LUA_SIGNATURE[0]))
+    {
+        /* Keep line numbers correct for text chunks. */
+        buf.prefix = "\n";
+        buf.prefixlen = 1;
+    }
+
+    /* Nothing may be left after the prefix, in which case `s' points just
+      beyond the end of the file. */
+    if(checkrights(L, mode, buf.prefixlen ? buf.prefix : len ? s : ""))
+    {
+        lua_pushnil(L);
+        lua_insert(L, -2);
+        goto done;
+    }
+    /* If it is bytecode, verify the bytecode before loading it. */
+    if(len != 0 && *s == LUA_SIGNATURE[0]
+        && verify_chunk(L, s, &len, NULL, NULL))
+        goto done;
+    /* Do the actual loading. */
+    buf.data = s;
+    buf.size = len;
+    status = lua_load(L, buffer_reader, (void*)&buf, chunkname);
+    if(status != LUA_OK)
+    {
+        lua_pushnil(L);
+        lua_insert(L, -2);
+    }
+
+done:
+    free_file_buffer(fb);
+    /* Remove the chunk name and the userdata, leaving just the results. */
+    lua_remove(L, base + 1);
+    lua_remove(L, base + 1);
+    return lua_gettop(L) - base;
+}
+
+static int l_loadfile(lua_State *L)
+{
+    const char *path = luaL_checkstring(L, 1);
+    const char *mode = luaL_optstring(L, 2, "bt");
+    int top = lua_gettop(L);
+    int nresults = load_file(L, path, mode);
+    if(nresults == 1 && top >= 3)  /* is there an 'env' argument */
+    {
+        lua_pushvalue(L, 3);  /* environment for loaded function */
+        lua_setupvalue(L, -2, 1);  /* set it as 1st upvalue */
+    }
+    return nresults;
+}
+
+static int dofilecont(lua_State *L)
+{
+    return lua_gettop(L) - 1;
+}
+
+static int l_dofile(lua_State *L)
+{
+    const char *path = luaL_checkstring(L, 1);
+    lua_settop(L, 1);
+    if(load_file(L, path, "bt") != 1)
+        return lua_error(L);
+    lua_callk(L, 0, LUA_MULTRET, 0, dofilecont);
+    return dofilecont(L);
+}
+
+static int l_cleanup_thread_pool(lua_State* L)
+{
+    thread_pool_t** ppool = (thread_pool_t**)lua_touserdata(L, 1);
+    thread_pool_destroy(*ppool);
+    *ppool = NULL;
+    return 0;
+}
+
+static int l_setthreads(lua_State* L)
+{
+    int n = luaL_optint(L, 1, (int)thread_pool_default_size());
+    thread_pool_t* pool;
+    thread_pool_t** ppool;
+    void* allocud;
+    lua_Alloc alloc = lua_getallocf(L, &allocud);
+    luaL_argcheck(L, n >= 1, 1, "thread count must be positive");
+
+    /* Stop the threads of any previous pool now, rather than whenever it
+      happens to be collected. */
+    pool = get_thread_pool(L);
+    lua_pushinteger(L, pool ? thread_pool_size(pool) : 1);
+    if(pool != NULL)
+    {
+        lua_getfield(L, LUA_REGISTRYINDEX, THREAD_POOL_KEY);
+        ppool = (thread_pool_t**)lua_touserdata(L, -1);
+        thread_pool_destroy(*ppool);
+        *ppool = NULL;
+        lua_pop(L, 1);
+    }
+    lua_pushnil(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, THREAD_POOL_KEY);
+    if(n == 1)
+        return 1;
+
+    ppool = (thread_pool_t**)lua_newuserdata(L, sizeof(thread_pool_t*));
+    *ppool = NULL;
+    if(luaL_newmetatable(L, THREAD_POOL_MT))
+    {
+        lua_pushcfunction(L, l_cleanup_thread_pool);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    *ppool = thread_pool_create((unsigned int)n, alloc, allocud);
+    if(*ppool == NULL)
+        return luaL_error(L, "insufficient memory");
+    lua_setfield(L, LUA_REGISTRYINDEX, THREAD_POOL_KEY);
+    return 1;
+}
+
+static int l_setcache(lua_State* L)
+{
+    int capacity = luaL_checkint(L, 1);
+    bool cachefailures = lua_toboolean(L, 2) != 0;
+    verify_cache_t* cache = verify_cache_shared();
+    verify_cache_stats_t stats;
+    luaL_argcheck(L, capacity >= 0, 1, "capacity must not be negative");
+
+    verify_cache_getstats(cache, &stats);
+    lua_pushinteger(L, (lua_Integer)stats.capacity);
+    if(!verify_cache_configure(cache, (size_t)capacity, cachefailures))
+        return luaL_error(L, "insufficient memory");
+    return 1;
+}
+
+static int l_setprotocache(lua_State* L)
+{
+    int capacity = luaL_checkint(L, 1);
+    verify_cache_t* cache = verify_cache_shared_prototypes();
+    verify_cache_stats_t stats;
+    luaL_argcheck(L, capacity >= 0, 1, "capacity must not be negative");
+
+    verify_cache_getstats(cache, &stats);
+    lua_pushinteger(L, (lua_Integer)stats.capacity);
+    if(!verify_cache_configure(cache, (size_t)capacity, false))
+        return luaL_error(L, "insufficient memory");
+    return 1;
+}
+
+/*
+** Open a cache file, given its name, the secret key shared by everything
+** which uses it, and optionally its capacity. A nil name closes the file.
+*/
+static int l_setcachefile(lua_State* L)
+{
+    const char* path = luaL_optstring(L, 1, NULL);
+    verify_file_cache_t* fc = verify_file_cache_shared();
+    const char* key;
+    size_t keylen;
+    int capacity;
+    int err;
+
+    if(path == NULL)
+    {
+        verify_file_cache_close(fc);
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    /* A number is not accepted as a key, so that a capacity given in place
+      of the key is not taken to be a weak key. */
+    luaL_checktype(L, 2, LUA_TSTRING);
+    key = lua_tolstring(L, 2, &keylen);
+    luaL_argcheck(L, keylen != 0, 2, "key must not be empty");
+    capacity = luaL_optint(L, 3, 65536);
+    luaL_argcheck(L, capacity >= 2, 3, "capacity must be at least 2");
+    err = verify_file_cache_open(fc, path, (size_t)capacity,
+        (const unsigned char*)key, keylen);
+    if(err != 0)
+    {
+        lua_pushnil(L);
+        lua_pushfstring(L, "cannot open %s: %s", path, strerror(err));
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int l_compactcachefile(lua_State* L)
+{
+    int err = verify_file_cache_compact(verify_file_cache_shared());
+    if(err != 0)
+    {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(err));
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+#define BATCH_MT "lbcv.batch"
+
+static int l_cleanup_batch(lua_State* L)
+{
+    verify_batch_t** pbatch = (verify_batch_t**)lua_touserdata(L, 1);
+    verify_batch_free(*pbatch);
+    *pbatch = NULL;
+    return 0;
+}
+
+/*
+** Push a userdata which owns a verify_batch_t, so that the batch is freed
+** even if an error is thrown while it is in use, and return the batch.
+*/
+static verify_batch_t* push_batch(lua_State* L)
+{
+    void* allocud;
+    lua_Alloc alloc = lua_getallocf(L, &allocud);
+    verify_batch_t** pbatch = (verify_batch_t**)lua_newuserdata(L,
+        sizeof(verify_batch_t*));
+    *pbatch = NULL;
+    if(luaL_newmetatable(L, BATCH_MT))
+    {
+        lua_pushcfunction(L, l_cleanup_batch);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    *pbatch = verify_batch_create(alloc, allocud);
+    if(*pbatch == NULL)
+        luaL_error(L, "insufficient memory");
+    return *pbatch;
+}
+
+/*
+** Verify every string in an array of bytecode chunks, reusing one decode
+** state and one verifier scratch area for all of them. Returns an array
+** holding true for each chunk which is safe, and an error message for each
+** chunk which is not.
+*/
+static int l_verify_many(lua_State* L)
+{
+    int i, n;
+    verify_batch_t* batch;
+    luaL_checktype(L, 1, LUA_TTABLE);
+    n = (int)lua_rawlen(L, 1);
+    lua_settop(L, 1);
+    batch = push_batch(L);
+    lua_createtable(L, n, 0);
+    for(i = 1; i <= n; ++i)
+    {
+        size_t len;
+        const char* str;
+        lua_rawgeti(L, 1, i);
+        if(lua_type(L, 4) != LUA_TSTRING)
+            return luaL_error(L, "chunk %d is not a string", i);
+        str = lua_tolstring(L, 4, &len);
+        if(verify_chunk(L, str, &len, batch, NULL))
+            lua_replace(L, 5); /* Keep the message, drop the nil. */
+        else
+            lua_pushboolean(L, 1);
+        lua_rawseti(L, 3, i);
+        lua_settop(L, 3);
+    }
+    return 1;
+}
+
+/*
+** Verify each of the named files of bytecode, so that the enabled caches
+** (and in particular, the cache file) record them before they are needed.
+** Files which cannot be read, hold text, or fail verification are skipped.
+** Returns the number of files which were verified successfully.
+*/
+static int l_warmcache(lua_State* L)
+{
+    int top = lua_gettop(L);
+    int i, err;
+    lua_Integer numsafe = 0;
+    verify_batch_t* batch = push_batch(L);
+    for(i = 1; i <= top; ++i)
+    {
+        const char* path = luaL_checkstring(L, i);
+        file_buffer_t* fb = push_file_buffer(L, path, &err);
+        if(err == 0)
+        {
+            const char* s = fb->size ? (const char*)fb->data : "";
+            size_t len = fb->size;
+            skip_file_prefix(&s, &len);
+            if(len != 0 && *s == LUA_SIGNATURE[0]
+            && !verify_chunk(L, s, &len, batch, NULL))
+                ++numsafe;
+            free_file_buffer(fb);
+        }
+        lua_settop(L, top + 1);
+    }
+    lua_pushinteger(L, numsafe);
+    return 1;
+}
+
+static int l_setproofkey(lua_State* L)
+{
+    if(!lua_isnoneornil(L, 1))
+        luaL_checkstring(L, 1);
+    lua_settop(L, 1);
+    lua_setfield(L, LUA_REGISTRYINDEX, PROOF_KEY);
+    return 0;
+}
+
+/*
+** Verify a chunk of bytecode in full, and then return it with a proof
+** trailer made with the proof key of the state. Any existing trailer is
+** replaced.
+*/
+static int l_seal(lua_State* L)
+{
+    size_t len, keylen;
+    const char* str = luaL_checklstring(L, 1, &len);
+    const char* key;
+    unsigned char trailer[PROOF_TRAILER_SIZE];
+
+    lua_getfield(L, LUA_REGISTRYINDEX, PROOF_KEY);
+    key = lua_tolstring(L, -1, &keylen);
+    if(key == NULL)
+        return luaL_error(L, "no proof key has been set");
+    len = proof_strip((const unsigned char*)str, len);
+    if(verify_buffer(L, str, len, NULL, NULL))
+        return 2;
+    proof_seal((const unsigned char*)key, keylen, (const unsigned char*)str,
+        len, trailer);
+    lua_pushlstring(L, str, len);
+    lua_pushlstring(L, (const char*)trailer, PROOF_TRAILER_SIZE);
+    lua_concat(L, 2);
+    return 1;
+}
+
+static int l_cachestats(lua_State* L)
+{
+    static const char* const kinds[] = {"chunks", "prototypes", "file", NULL};
+    verify_cache_stats_t stats;
+    int kind = luaL_checkoption(L, 1, "chunks", kinds);
+    if(kind == 2)
+    {
+        verify_file_cache_stats_t fstats;
+        verify_file_cache_getstats(verify_file_cache_shared(), &fstats);
+        lua_createtable(L, 0, 6);
+        lua_pushinteger(L, (lua_Integer)fstats.hits);
+        lua_setfield(L, -2, "hits");
+        lua_pushinteger(L, (lua_Integer)fstats.misses);
+        lua_setfield(L, -2, "misses");
+        lua_pushinteger(L, (lua_Integer)fstats.appends);
+        lua_setfield(L, -2, "appends");
+        lua_pushinteger(L, (lua_Integer)fstats.compactions);
+        lua_setfield(L, -2, "compactions");
+        lua_pushinteger(L, (lua_Integer)fstats.entries);
+        lua_setfield(L, -2, "entries");
+        lua_pushinteger(L, (lua_Integer)fstats.capacity);
+        lua_setfield(L, -2, "capacity");
+        return 1;
+    }
+    verify_cache_getstats(kind == 0 ? verify_cache_shared()
+        : verify_cache_shared_prototypes(), &stats);
+    lua_createtable(L, 0, 5);
+    lua_pushinteger(L, (lua_Integer)stats.hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushinteger(L, (lua_Integer)stats.misses);
+    lua_setfield(L, -2, "misses");
+    lua_pushinteger(L, (lua_Integer)stats.evictions);
+    lua_setfield(L, -2, "evictions");
+    lua_pushinteger(L, (lua_Integer)stats.entries);
+    lua_setfield(L, -2, "entries");
+    lua_pushinteger(L, (lua_Integer)stats.capacity);
+    lua_setfield(L, -2, "capacity");
+    return 1;
+}
+
 const luaL_Reg lib[] = {
     {"verify", l_verify},
+    {"verify_many", l_verify_many},
     {"load", l_load},
+    {"loadfile", l_loadfile},
+    {"dofile", l_dofile},
+    {"setthreads", l_setthreads},
+    {"setcache", l_setcache},
+    {"setprotocache", l_setprotocache},
+    {"setcachefile", l_setcachefile},
+    {"compactcachefile", l_compactcachefile},
+    {"warmcache", l_warmcache},
+    {"setproofkey", l_setproofkey},
+    {"seal", l_seal},
+    {"cachestats", l_cachestats},
     {NULL, NULL}
 };
 
@@ -0,0 +1,216 @@
+/* Copyright (c) 2010 Peter Cawley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include "lbcv.h"
+#include "batch.h"
+#include <stdlib.h>
+
+struct lbcv_verifier
+{
+    verify_batch_t* batch;
+    /**
+     * The status of the current chunk so far, which sticks once it is not
+     * LBCV_OK.
+     */
+    int status;
+    /**
+     * The budget given in the options, or NULL, and the budget which the
+     * verifier charges on its behalf.
+     */
+    lbcv_budget* budget;
+    verify_budget_t spent;
+    /**
+     * Whether nothing has been fed since the state was created or last
+     * finished, so the next piece starts a new chunk.
+     */
+    bool fresh;
+};
+
+static void* default_alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    (void)ud;
+    (void)osize;
+    if(nsize == 0)
+    {
+        free(ptr);
+        return NULL;
+    }
+    return realloc(ptr, nsize);
+}
+
+static lua_Alloc options_alloc(const lbcv_options* options, void** ud)
+{
+    if(options == NULL || options->alloc == NULL)
+    {
+        *ud = NULL;
+        return default_alloc;
+    }
+    *ud = options->allocud;
+    return options->alloc;
+}
+
+/* Start charging a new chunk to a budget with the limits of `budget'. */
+static void budget_begin(verify_budget_t* spent, const lbcv_budget* budget)
+{
+    spent->max_traced = budget->max_traced;
+    spent->max_merges = budget->max_merges;
+    spent->max_nanoseconds = budget->max_nanoseconds;
+    spent->traced = 0;
+    spent->merges = 0;
+    spent->nanoseconds = 0;
+}
+
+/* Report the work charged to `spent' through the caller's budget. */
+static void budget_report(const verify_budget_t* spent, lbcv_budget* budget)
+{
+    budget->traced = spent->traced;
+    budget->merges = spent->merges;
+    budget->nanoseconds = spent->nanoseconds;
+}
+
+/* The LBCV_ codes have the same values as the DECODE_ codes, so statuses
+   are passed through unchanged. */
+typedef char lbcv_status_codes_match[(LBCV_OK == DECODE_YIELD
+    && LBCV_INVALID == DECODE_FAIL && LBCV_UNSAFE == DECODE_UNSAFE
+    && LBCV_ERROR == DECODE_ERROR && LBCV_ERROR_MEM == DECODE_ERROR_MEM
+    && LBCV_BUDGET == DECODE_BUDGET)
+    ? 1 : -1];
+
+int lbcv_verify_buffer(const void* data, size_t len,
+                       const lbcv_options* options)
+{
+    void* ud;
+    lua_Alloc alloc = options_alloc(options, &ud);
+    lbcv_budget* budget = options != NULL ? options->budget : NULL;
+    verify_budget_t spent;
+    verify_batch_t* batch;
+    int status;
+    if(budget != NULL)
+    {
+        budget_begin(&spent, budget);
+        budget_report(&spent, budget);
+    }
+    batch = verify_batch_create(alloc, ud);
+    if(batch == NULL)
+        return LBCV_ERROR_MEM;
+    if(budget != NULL)
+        batch->vs->budget = &spent;
+    status = verify_batch_chunk(batch, (const unsigned char*)data, len);
+    verify_batch_free(batch);
+    if(budget != NULL)
+        budget_report(&spent, budget);
+    return status;
+}
+
+lbcv_verifier* lbcv_verifier_new(const lbcv_options* options)
+{
+    void* ud;
+    lua_Alloc alloc = options_alloc(options, &ud);
+    lbcv_verifier* v = (lbcv_verifier*)alloc(ud, NULL, 0,
+        sizeof(lbcv_verifier));
+    if(v == NULL)
+        return NULL;
+    v->batch = verify_batch_create(alloc, ud);
+    if(v->batch == NULL)
+    {
+        alloc(ud, v, sizeof(lbcv_verifier), 0);
+        return NULL;
+    }
+    /* Instructions must be copied, as each piece is only valid for the
+       duration of a single call, whereas a prototype is verified once all of
+       its children have been decoded. */
+    v->batch->ds->view = false;
+    v->status = LBCV_OK;
+    v->budget = options != NULL ? options->budget : NULL;
+    if(v->budget != NULL)
+        v->batch->vs->budget = &v->spent;
+    v->fresh = true;
+    return v;
+}
+
+/* Start a new chunk, unless one has already been started. */
+static void verifier_begin(lbcv_verifier* v)
+{
+    if(v->fresh)
+    {
+        v->fresh = false;
+        if(v->budget != NULL)
+            budget_begin(&v->spent, v->budget);
+    }
+}
+
+int lbcv_verifier_feed(lbcv_verifier* v, const void* data, size_t len)
+{
+    verifier_begin(v);
+    if(v->status == LBCV_OK && len != 0)
+    {
+        v->status = decode_bytecode_pump(v->batch->ds,
+            (const unsigned char*)data, len);
+    }
+    if(v->budget != NULL)
+        budget_report(&v->spent, v->budget);
+    return v->status;
+}
+
+int lbcv_verifier_finish(lbcv_verifier* v)
+{
+    int status = v->status;
+    verifier_begin(v);
+    if(!decode_bytecode_reset(v->batch->ds) && status == LBCV_OK)
+        status = LBCV_INVALID;
+    if(v->budget != NULL)
+        budget_report(&v->spent, v->budget);
+    v->status = LBCV_OK;
+    v->fresh = true;
+    return status;
+}
+
+void lbcv_verifier_free(lbcv_verifier* v)
+{
+    lua_Alloc alloc;
+    void* ud;
+    if(v == NULL)
+        return;
+    alloc = v->batch->ds->alloc;
+    ud = v->batch->ds->allocud;
+    verify_batch_free(v->batch);
+    alloc(ud, v, sizeof(lbcv_verifier), 0);
+}
+
+const char* lbcv_status_string(int status)
+{
+    switch(status)
+    {
+    case LBCV_OK:
+        return "ok";
+    case LBCV_INVALID:
+        return "unable to load bytecode";
+    case LBCV_UNSAFE:
+        return "verification failed";
+    case LBCV_ERROR:
+        return "unknown decoding error";
+    case LBCV_ERROR_MEM:
+        return "insufficient memory";
+    case LBCV_BUDGET:
+        return "budget exceeded";
+    default:
+        return "unknown status";
+    }
+}
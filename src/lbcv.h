@@ -0,0 +1,197 @@
+/* Copyright (c) 2010 Peter Cawley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#ifndef _LBCV_H_
+#define _LBCV_H_
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file
+ * The public C interface to lbcv, for hosts which want to verify Lua 5.2
+ * bytecode without going through a lua_State. Nothing in this header depends
+ * on Lua, and the functions declared here never call into Lua, so they can be
+ * used on any thread, before (or without) a Lua state being created.
+ *
+ * Every function is thread-safe, in that distinct calls can run concurrently
+ * on distinct threads, provided that each lbcv_verifier is only used by one
+ * thread at a time, and that the allocator is thread-safe if shared between
+ * threads.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** The bytecode is safe to load. */
+#define LBCV_OK 0
+/** The input is not a complete chunk of valid Lua 5.2 bytecode. */
+#define LBCV_INVALID 1
+/** The input is valid Lua 5.2 bytecode, but is not safe to load. */
+#define LBCV_UNSAFE 2
+/** An internal error occurred, so the bytecode could not be checked. */
+#define LBCV_ERROR 3
+/** Memory could not be allocated, so the bytecode could not be checked. */
+#define LBCV_ERROR_MEM 4
+/**
+ * The budget set by lbcv_options::budget ran out before the bytecode could be
+ * checked.
+ */
+#define LBCV_BUDGET 5
+
+/**
+ * An allocator function, with the same contract as lua_Alloc: when @p nsize
+ * is zero, free @p ptr (which may be @c NULL) and return @c NULL, otherwise
+ * resize the @p osize bytes at @p ptr (or allocate when @p ptr is @c NULL) to
+ * @p nsize bytes, returning @c NULL on failure. Any lua_Alloc can be used.
+ */
+typedef void* (*lbcv_alloc_fn)(void* ud, void* ptr, size_t osize,
+                               size_t nsize);
+
+/**
+ * Limits on the work done to verify a chunk, so that a single pathological
+ * chunk cannot stall the caller, along with the work which was done. A limit
+ * of zero means that there is no limit. The work done is counted from the
+ * start of each chunk, and is updated by every call which verifies part of
+ * the chunk, whether or not the budget runs out.
+ */
+typedef struct lbcv_budget
+{
+    /**
+     * The most times that instructions may be traced. Instructions in loops
+     * are usually traced more than once.
+     */
+    size_t max_traced;
+    /**
+     * The most times that register states may be merged where control flow
+     * joins.
+     */
+    size_t max_merges;
+    /**
+     * The most wall-clock time, in nanoseconds, which may be spent tracing.
+     * The clock is read every few hundred instructions, so the limit may be
+     * overshot slightly.
+     */
+    uint64_t max_nanoseconds;
+    /**
+     * Set by lbcv to the work done on the chunk, in the units of the limits.
+     */
+    size_t traced;
+    size_t merges;
+    uint64_t nanoseconds;
+} lbcv_budget;
+
+/**
+ * Settings for verification. A @c NULL pointer to this structure, or a
+ * structure with every field zero, gives the defaults.
+ */
+typedef struct lbcv_options
+{
+    /**
+     * The allocator to use for all memory, or @c NULL to use malloc().
+     */
+    lbcv_alloc_fn alloc;
+    /**
+     * An opaque pointer which will be passed to lbcv_options::alloc.
+     */
+    void* allocud;
+    /**
+     * Limits on the work done to verify each chunk, or @c NULL for no limits.
+     * For lbcv_verifier_new(), the budget must remain valid until the state
+     * is freed, and its limits are read again at the start of each chunk.
+     */
+    lbcv_budget* budget;
+} lbcv_options;
+
+/**
+ * Verify an entire chunk of Lua 5.2 bytecode held in memory.
+ *
+ * @param data The bytecode, starting with the signature.
+ * @param len The number of bytes at @p data.
+ * @param options Settings for verification, or @c NULL for the defaults.
+ *
+ * @return @c LBCV_OK if the bytecode is safe, otherwise another of the
+ *         @c LBCV_ status codes.
+ */
+int lbcv_verify_buffer(const void* data, size_t len,
+                       const lbcv_options* options);
+
+/**
+ * State for verifying bytecode which arrives in pieces, such as from a socket
+ * or file, without first assembling it into a single buffer. Prototypes are
+ * verified as soon as they are decoded, so unsafe bytecode is usually
+ * rejected before all of it has arrived. Once a chunk has been finished, the
+ * same state can be used for the next chunk, reusing its memory.
+ */
+typedef struct lbcv_verifier lbcv_verifier;
+
+/**
+ * Create a state for verifying bytecode incrementally.
+ *
+ * @param options Settings for verification, or @c NULL for the defaults.
+ *
+ * @return @c NULL on memory allocation failure, otherwise a state which must
+ *         be freed with lbcv_verifier_free().
+ */
+lbcv_verifier* lbcv_verifier_new(const lbcv_options* options);
+
+/**
+ * Supply the next piece of a chunk of bytecode. The piece need only remain
+ * valid until this returns.
+ *
+ * @param v A state created by lbcv_verifier_new().
+ * @param data The next piece of the chunk.
+ * @param len The number of bytes at @p data.
+ *
+ * @return @c LBCV_OK if the chunk is acceptable so far, otherwise the status
+ *         with which the chunk is rejected, in which case further pieces of
+ *         the chunk are ignored.
+ */
+int lbcv_verifier_feed(lbcv_verifier* v, const void* data, size_t len);
+
+/**
+ * Finish the current chunk, and prepare the state for another.
+ *
+ * @param v A state created by lbcv_verifier_new().
+ *
+ * @return @c LBCV_OK if every piece fed since the state was created or last
+ *         finished forms a single chunk of safe bytecode, otherwise another
+ *         of the @c LBCV_ status codes.
+ */
+int lbcv_verifier_finish(lbcv_verifier* v);
+
+/**
+ * Free a state created by lbcv_verifier_new().
+ *
+ * @param v The state to free. May be @c NULL.
+ */
+void lbcv_verifier_free(lbcv_verifier* v);
+
+/**
+ * Get a short English description of an @c LBCV_ status code, such as
+ * "verification failed" for @c LBCV_UNSAFE.
+ */
+const char* lbcv_status_string(int status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _LBCV_H_ */
@@ -0,0 +1,171 @@
+/* Copyright (c) 2010 Peter Cawley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include "mac.h"
+#include <string.h>
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(sha256_t* sha, const unsigned char* p)
+{
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for(i = 0; i < 16; ++i, p += 4)
+    {
+        w[i] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+             | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+    }
+    for(; i < 64; ++i)
+    {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18)
+                    ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19)
+                    ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    a = sha->h[0]; b = sha->h[1]; c = sha->h[2]; d = sha->h[3];
+    e = sha->h[4]; f = sha->h[5]; g = sha->h[6]; h = sha->h[7];
+    for(i = 0; i < 64; ++i)
+    {
+        t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25))
+           + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22))
+           + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    sha->h[0] += a; sha->h[1] += b; sha->h[2] += c; sha->h[3] += d;
+    sha->h[4] += e; sha->h[5] += f; sha->h[6] += g; sha->h[7] += h;
+}
+
+void sha256_init(sha256_t* sha)
+{
+    sha->h[0] = 0x6a09e667; sha->h[1] = 0xbb67ae85;
+    sha->h[2] = 0x3c6ef372; sha->h[3] = 0xa54ff53a;
+    sha->h[4] = 0x510e527f; sha->h[5] = 0x9b05688c;
+    sha->h[6] = 0x1f83d9ab; sha->h[7] = 0x5be0cd19;
+    sha->len = 0;
+}
+
+void sha256_update(sha256_t* sha, const unsigned char* data, size_t len)
+{
+    size_t used = (size_t)(sha->len % SHA256_BLOCK_SIZE);
+    sha->len += len;
+    if(used != 0)
+    {
+        size_t n = SHA256_BLOCK_SIZE - used;
+        if(n > len)
+            n = len;
+        memcpy(sha->block + used, data, n);
+        data += n;
+        len -= n;
+        if(used + n < SHA256_BLOCK_SIZE)
+            return;
+        sha256_block(sha, sha->block);
+    }
+    for(; len >= SHA256_BLOCK_SIZE; data += SHA256_BLOCK_SIZE,
+        len -= SHA256_BLOCK_SIZE)
+        sha256_block(sha, data);
+    if(len != 0)
+        memcpy(sha->block, data, len);
+}
+
+void sha256_final(sha256_t* sha, unsigned char digest[SHA256_DIGEST_SIZE])
+{
+    static const unsigned char pad[SHA256_BLOCK_SIZE] = {0x80};
+    unsigned char bits[8];
+    uint64_t len = sha->len;
+    size_t used = (size_t)(len % SHA256_BLOCK_SIZE);
+    int i;
+
+    for(i = 0; i < 8; ++i)
+        bits[i] = (unsigned char)((len * 8) >> (56 - i * 8));
+    sha256_update(sha, pad, used < 56 ? 56 - used : 120 - used);
+    sha256_update(sha, bits, 8);
+    for(i = 0; i < 32; ++i)
+        digest[i] = (unsigned char)(sha->h[i / 4] >> (24 - (i % 4) * 8));
+}
+
+void hmac_sha256_init(hmac_sha256_t* mac, const unsigned char* key,
+                      size_t keylen)
+{
+    unsigned char block[SHA256_BLOCK_SIZE];
+    size_t i;
+
+    memset(block, 0, sizeof(block));
+    if(keylen > SHA256_BLOCK_SIZE)
+    {
+        sha256_init(&mac->inner);
+        sha256_update(&mac->inner, key, keylen);
+        sha256_final(&mac->inner, block);
+    }
+    else if(keylen != 0)
+        memcpy(block, key, keylen);
+
+    for(i = 0; i < SHA256_BLOCK_SIZE; ++i)
+        block[i] ^= 0x36;
+    sha256_init(&mac->inner);
+    sha256_update(&mac->inner, block, SHA256_BLOCK_SIZE);
+    for(i = 0; i < SHA256_BLOCK_SIZE; ++i)
+        block[i] ^= 0x36 ^ 0x5c;
+    sha256_init(&mac->outer);
+    sha256_update(&mac->outer, block, SHA256_BLOCK_SIZE);
+    memset(block, 0, sizeof(block));
+}
+
+void hmac_sha256_update(hmac_sha256_t* mac, const unsigned char* data,
+                        size_t len)
+{
+    sha256_update(&mac->inner, data, len);
+}
+
+void hmac_sha256_final(hmac_sha256_t* mac,
+                       unsigned char tag[SHA256_DIGEST_SIZE])
+{
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    sha256_final(&mac->inner, digest);
+    sha256_update(&mac->outer, digest, SHA256_DIGEST_SIZE);
+    sha256_final(&mac->outer, tag);
+}
+
+bool mac_equal(const unsigned char* a, const unsigned char* b, size_t len)
+{
+    unsigned char diff = 0;
+    size_t i;
+    for(i = 0; i < len; ++i)
+        diff |= a[i] ^ b[i];
+    return diff == 0;
+}
@@ -0,0 +1,97 @@
+/* Copyright (c) 2010 Peter Cawley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#ifndef _LBCV_MAC_H_
+#define _LBCV_MAC_H_
+#include "defs.h"
+#include <stdint.h>
+
+/**
+ * @file
+ * SHA-256, and HMAC-SHA256 as a keyed message authentication code, computed
+ * incrementally.
+ */
+
+/**
+ * The number of bytes in a SHA-256 digest, and hence in an HMAC-SHA256 tag.
+ */
+#define SHA256_DIGEST_SIZE 32
+
+/**
+ * The number of bytes which SHA-256 processes at a time.
+ */
+#define SHA256_BLOCK_SIZE 64
+
+/**
+ * State of a SHA-256 computation.
+ */
+struct sha256
+{
+    uint32_t h[8];
+    /**
+     * The total number of bytes given to sha256_update().
+     */
+    uint64_t len;
+    /**
+     * Bytes which do not yet make up a whole block. The number of them is
+     * sha256::len modulo SHA256_BLOCK_SIZE.
+     */
+    unsigned char block[SHA256_BLOCK_SIZE];
+};
+typedef struct sha256 sha256_t;
+
+void sha256_init(sha256_t* sha);
+void sha256_update(sha256_t* sha, const unsigned char* data, size_t len);
+/**
+ * Finish a SHA-256 computation. The state must not be updated afterwards.
+ */
+void sha256_final(sha256_t* sha, unsigned char digest[SHA256_DIGEST_SIZE]);
+
+/**
+ * State of an HMAC-SHA256 computation.
+ */
+struct hmac_sha256
+{
+    sha256_t inner;
+    sha256_t outer;
+};
+typedef struct hmac_sha256 hmac_sha256_t;
+
+/**
+ * Begin computing an HMAC-SHA256 tag.
+ *
+ * @param mac The state to initialise.
+ * @param key The secret key. Keys longer than SHA256_BLOCK_SIZE bytes are
+ *            hashed first, as the standard requires.
+ * @param keylen The number of bytes at @p key.
+ */
+void hmac_sha256_init(hmac_sha256_t* mac, const unsigned char* key,
+                      size_t keylen);
+void hmac_sha256_update(hmac_sha256_t* mac, const unsigned char* data,
+                        size_t len);
+void hmac_sha256_final(hmac_sha256_t* mac,
+                       unsigned char tag[SHA256_DIGEST_SIZE]);
+
+/**
+ * Compare two tags in time which does not depend on where they differ.
+ */
+bool mac_equal(const unsigned char* a, const unsigned char* b, size_t len);
+
+#endif /* _LBCV_MAC_H_ */
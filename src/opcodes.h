@@ -235,13 +235,83 @@ enum OpArgMask {
   OpArgK   /* argument is a constant or register/constant */
 };
 
+#define opmode(t,a,b,c,m) (((t)<<7) | ((a)<<6) | ((b)<<4) | ((c)<<2) | (m))
+
 LUAI_DDEC const unsigned char lbcv_opmodes[NUM_OPCODES];
 
-#define getOpMode(m)	(cast(enum OpMode, lbcv_opmodes[m] & 3))
-#define getBMode(m)	(cast(enum OpArgMask, (lbcv_opmodes[m] >> 4) & 3))
-#define getCMode(m)	(cast(enum OpArgMask, (lbcv_opmodes[m] >> 2) & 3))
-#define testAMode(m)	(lbcv_opmodes[m] & (1 << 6))
-#define testTMode(m)	(lbcv_opmodes[m] & (1 << 7))
+/*
+** MODIFICATION: The mode accessors are split into ones which take a mode
+** byte, so that they can also be used on a mode which is known at compile
+** time, and ones which look the opcode up in lbcv_opmodes.
+*/
+#define modeOp(mb)	(cast(enum OpMode, (mb) & 3))
+#define modeB(mb)	(cast(enum OpArgMask, ((mb) >> 4) & 3))
+#define modeC(mb)	(cast(enum OpArgMask, ((mb) >> 2) & 3))
+#define modeA(mb)	((mb) & (1 << 6))
+#define modeT(mb)	((mb) & (1 << 7))
+
+#define getOpMode(m)	modeOp(lbcv_opmodes[m])
+#define getBMode(m)	modeB(lbcv_opmodes[m])
+#define getCMode(m)	modeC(lbcv_opmodes[m])
+#define testAMode(m)	modeA(lbcv_opmodes[m])
+#define testTMode(m)	modeT(lbcv_opmodes[m])
+
+/*
+** MODIFICATION: Description of every opcode, in the same order as OpCode,
+** from which lbcv_opmodes and the verifier's per-opcode handlers are built.
+** Each entry is X(name, T, A, B, C, mode, successors), where T, A, B, C and
+** mode are as for opmode(), and successors says which instructions can be
+** executed after it:
+**   NEXT - the next instruction
+**   JUMP - the instruction sBx after the next one
+**   SKIP - the next instruction, or the one after it (tests)
+**   LOOP - the next instruction, or the one sBx after it
+**   COND - the instruction C after the next one (OP_LOADBOOL)
+**   NONE - none (OP_RETURN)
+*/
+#define LBCV_OPCODES(X) \
+/* name          T  A  B       C       mode   successors */ \
+  X(MOVE,        0, 1, OpArgR, OpArgN, iABC,  NEXT) \
+  X(LOADK,       0, 1, OpArgK, OpArgN, iABx,  NEXT) \
+  X(LOADKX,      0, 1, OpArgN, OpArgN, iABx,  NEXT) \
+  X(LOADBOOL,    0, 1, OpArgU, OpArgU, iABC,  COND) \
+  X(LOADNIL,     0, 1, OpArgU, OpArgN, iABC,  NEXT) \
+  X(GETUPVAL,    0, 1, OpArgU, OpArgN, iABC,  NEXT) \
+  X(GETTABUP,    0, 1, OpArgU, OpArgK, iABC,  NEXT) \
+  X(GETTABLE,    0, 1, OpArgR, OpArgK, iABC,  NEXT) \
+  X(SETTABUP,    0, 0, OpArgK, OpArgK, iABC,  NEXT) \
+  X(SETUPVAL,    0, 0, OpArgU, OpArgN, iABC,  NEXT) \
+  X(SETTABLE,    0, 0, OpArgK, OpArgK, iABC,  NEXT) \
+  X(NEWTABLE,    0, 1, OpArgU, OpArgU, iABC,  NEXT) \
+  /* NB: C of OP_SELF changed from OpArgK to OpArgU */ \
+  X(SELF,        0, 1, OpArgR, OpArgU, iABC,  NEXT) \
+  X(ADD,         0, 1, OpArgK, OpArgK, iABC,  NEXT) \
+  X(SUB,         0, 1, OpArgK, OpArgK, iABC,  NEXT) \
+  X(MUL,         0, 1, OpArgK, OpArgK, iABC,  NEXT) \
+  X(DIV,         0, 1, OpArgK, OpArgK, iABC,  NEXT) \
+  X(MOD,         0, 1, OpArgK, OpArgK, iABC,  NEXT) \
+  X(POW,         0, 1, OpArgK, OpArgK, iABC,  NEXT) \
+  X(UNM,         0, 1, OpArgR, OpArgN, iABC,  NEXT) \
+  X(NOT,         0, 1, OpArgR, OpArgN, iABC,  NEXT) \
+  X(LEN,         0, 1, OpArgR, OpArgN, iABC,  NEXT) \
+  X(CONCAT,      0, 1, OpArgR, OpArgR, iABC,  NEXT) \
+  X(JMP,         0, 0, OpArgR, OpArgN, iAsBx, JUMP) \
+  X(EQ,          1, 0, OpArgK, OpArgK, iABC,  SKIP) \
+  X(LT,          1, 0, OpArgK, OpArgK, iABC,  SKIP) \
+  X(LE,          1, 0, OpArgK, OpArgK, iABC,  SKIP) \
+  X(TEST,        1, 1, OpArgR, OpArgU, iABC,  SKIP) \
+  X(TESTSET,     1, 1, OpArgR, OpArgU, iABC,  SKIP) \
+  X(CALL,        0, 1, OpArgU, OpArgU, iABC,  NEXT) \
+  X(TAILCALL,    0, 1, OpArgU, OpArgU, iABC,  NEXT) \
+  X(RETURN,      0, 0, OpArgU, OpArgN, iABC,  NONE) \
+  X(FORLOOP,     0, 1, OpArgR, OpArgN, iAsBx, LOOP) \
+  X(FORPREP,     0, 1, OpArgR, OpArgN, iAsBx, JUMP) \
+  X(TFORCALL,    0, 0, OpArgN, OpArgU, iABC,  NEXT) \
+  X(TFORLOOP,    0, 1, OpArgR, OpArgN, iAsBx, LOOP) \
+  X(SETLIST,     0, 0, OpArgU, OpArgU, iABC,  NEXT) \
+  X(CLOSURE,     0, 1, OpArgU, OpArgN, iABx,  NEXT) \
+  X(VARARG,      0, 1, OpArgU, OpArgN, iABC,  NEXT) \
+  X(EXTRAARG,    0, 0, OpArgU, OpArgU, iAx,   NEXT)
 
 /* MODIFICATION: Trimmed out luaP_opnames, LFIELDS_PER_FLUSH. */
 
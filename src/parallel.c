@@ -0,0 +1,246 @@
+/* Copyright (c) 2010 Peter Cawley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include "parallel.h"
+#include "verifier.h"
+#include <stdlib.h>
+
+/**
+ * Shared state for the jobs of decode_bytecode_parallel(), where job n
+ * decodes entry n of the index.
+ */
+struct decode_jobs
+{
+    const decode_state_t* ds;
+    const decode_index_t* index;
+    thread_pool_t* pool;
+    /**
+     * The status of each job which has run, or DECODE_YIELD for jobs which
+     * have not run.
+     */
+    int* status;
+};
+
+static void decode_job(void* ctx, size_t job, unsigned int worker)
+{
+    struct decode_jobs* jobs = (struct decode_jobs*)ctx;
+    int status = decode_indexed_prototype(jobs->ds, jobs->index, job);
+    (void)worker;
+    jobs->status[job] = status;
+    if(status != DECODE_YIELD)
+        thread_pool_cancel(jobs->pool);
+}
+
+int decode_bytecode_parallel(decode_state_t* ds, const unsigned char* data,
+                             size_t len, thread_pool_t* pool)
+{
+    struct decode_jobs jobs;
+    decode_index_t* index;
+    size_t i, n;
+    int status = decode_bytecode_index(ds, data, len, &index);
+
+    if(status != DECODE_YIELD)
+    {
+        decode_index_free(index);
+        return status;
+    }
+    n = index->numentries;
+    jobs.ds = ds;
+    jobs.index = index;
+    jobs.pool = pool;
+    jobs.status = (int*)ds->alloc(ds->allocud, NULL, 0, n * sizeof(int));
+    if(jobs.status == NULL)
+    {
+        status = DECODE_ERROR_MEM;
+    }
+    else
+    {
+        for(i = 0; i < n; ++i)
+            jobs.status[i] = DECODE_YIELD;
+        thread_pool_run(pool, n, decode_job, &jobs);
+        /* Jobs are claimed in order, so every job before the first failing
+           one has run, and taking the first failure gives the same result
+           regardless of how the jobs were scheduled. */
+        for(i = 0; i < n && status == DECODE_YIELD; ++i)
+            status = jobs.status[i];
+        ds->alloc(ds->allocud, jobs.status, n * sizeof(int), 0);
+    }
+    if(status != DECODE_YIELD)
+    {
+        /* Prevent decode_bytecode_finish() from returning the tree. */
+        ds->level = 1;
+    }
+    decode_index_free(index);
+    return status;
+}
+
+/**
+ * Shared state for the jobs of verify_parallel(), where job n verifies the
+ * code of prototype n.
+ */
+struct verify_jobs
+{
+    decoded_prototype_t** prototypes;
+    /**
+     * One verify_state_t for each thread of the pool.
+     */
+    verify_state_t** states;
+    /**
+     * One flag for each thread of the pool, set if that thread verified a
+     * prototype which turned out to be unsafe.
+     */
+    bool* failed;
+    /**
+     * Set once any prototype has been found to be unsafe, so that jobs which
+     * are already running give up, in addition to no further jobs starting.
+     */
+    cancel_flag_t cancelled;
+    thread_pool_t* pool;
+};
+
+static void verify_job(void* ctx, size_t job, unsigned int worker)
+{
+    struct verify_jobs* jobs = (struct verify_jobs*)ctx;
+    if(!verify_prototype_code(jobs->states[worker], jobs->prototypes[job]))
+    {
+        jobs->failed[worker] = true;
+        cancel_flag_raise(&jobs->cancelled);
+        thread_pool_cancel(jobs->pool);
+    }
+}
+
+/* Orders prototypes from most to fewest instructions, as the time taken to
+   verify a prototype tends to grow with its length. */
+static int compare_prototype_size(const void* a, const void* b)
+{
+    const decoded_prototype_t* x = *(decoded_prototype_t* const*)a;
+    const decoded_prototype_t* y = *(decoded_prototype_t* const*)b;
+    if(x->numinstructions != y->numinstructions)
+        return x->numinstructions < y->numinstructions ? 1 : -1;
+    return 0;
+}
+
+static size_t count_prototypes(decoded_prototype_t* prototype)
+{
+    size_t i, n = 1;
+    for(i = 0; i < prototype->numprototypes; ++i)
+        n += count_prototypes(prototype->prototypes[i]);
+    return n;
+}
+
+/* Lists every prototype of a tree which needs verifying, omitting subtrees
+   which are already in the cache. */
+static decoded_prototype_t** list_prototypes(decoded_prototype_t* prototype,
+                                             decoded_prototype_t** out,
+                                             verify_cache_t* cache)
+{
+    size_t i;
+    if(is_prototype_cached(cache, prototype))
+        return out;
+    *out++ = prototype;
+    for(i = 0; i < prototype->numprototypes; ++i)
+        out = list_prototypes(prototype->prototypes[i], out, cache);
+    return out;
+}
+
+int verify_parallel(decoded_prototype_t* prototype, thread_pool_t* pool,
+                    lua_Alloc alloc, void* ud, verify_cache_t* cache)
+{
+    struct verify_jobs jobs;
+    size_t max_regs_size = 0;
+    size_t max_numinstructions = 0;
+    size_t numprototypes = count_prototypes(prototype);
+    size_t numjobs = 0;
+    size_t n;
+    unsigned int numthreads = thread_pool_size(pool);
+    unsigned int i;
+    int status = DECODE_YIELD;
+
+    if(numprototypes == 1 || numthreads == 1)
+        return verify_budgeted(prototype, alloc, ud, cache, NULL);
+    if(cache != NULL)
+        fingerprint_tree(prototype);
+
+    find_max_size(prototype, &max_regs_size, &max_numinstructions);
+    jobs.pool = pool;
+    cancel_flag_init(&jobs.cancelled);
+    jobs.prototypes = (decoded_prototype_t**)alloc(ud, NULL, 0,
+        numprototypes * sizeof(decoded_prototype_t*));
+    jobs.states = (verify_state_t**)alloc(ud, NULL, 0,
+        numthreads * sizeof(verify_state_t*));
+    jobs.failed = (bool*)alloc(ud, NULL, 0, numthreads * sizeof(bool));
+    if(jobs.prototypes == NULL || jobs.states == NULL || jobs.failed == NULL)
+        status = DECODE_ERROR_MEM;
+    if(jobs.states != NULL)
+    {
+        for(i = 0; i < numthreads; ++i)
+            jobs.states[i] = NULL;
+    }
+
+    if(status == DECODE_YIELD)
+    {
+        numjobs = (size_t)(list_prototypes(prototype, jobs.prototypes, cache)
+            - jobs.prototypes);
+        /* Start the longest prototypes first, so that one large prototype is
+          not left running on a single thread after all the others are done. */
+        qsort(jobs.prototypes, numjobs, sizeof(decoded_prototype_t*),
+            compare_prototype_size);
+        for(i = 0; i < numthreads && status == DECODE_YIELD; ++i)
+        {
+            jobs.failed[i] = false;
+            jobs.states[i] = verify_state_create(alloc, ud, max_regs_size,
+                max_numinstructions);
+            if(jobs.states[i] == NULL)
+                status = DECODE_ERROR_MEM;
+            else
+                jobs.states[i]->cancel = &jobs.cancelled;
+        }
+    }
+
+    if(status == DECODE_YIELD)
+    {
+        thread_pool_run(pool, numjobs, verify_job, &jobs);
+        for(i = 0; i < numthreads; ++i)
+        {
+            if(jobs.failed[i])
+                status = DECODE_UNSAFE;
+        }
+    }
+
+    if(status == DECODE_YIELD)
+    {
+        /* Every subtree rooted at a listed prototype is now known to be
+          safe, as all of its prototypes were either verified or cached. */
+        for(n = 0; n < numjobs; ++n)
+            cache_prototype(cache, jobs.prototypes[n]);
+    }
+
+    /* Cleanup */
+    if(jobs.states != NULL)
+    {
+        for(i = 0; i < numthreads; ++i)
+            verify_state_free(jobs.states[i]);
+    }
+    alloc(ud, jobs.prototypes, numprototypes * sizeof(decoded_prototype_t*), 0);
+    alloc(ud, jobs.states, numthreads * sizeof(verify_state_t*), 0);
+    alloc(ud, jobs.failed, numthreads * sizeof(bool), 0);
+
+    return status;
+}
@@ -0,0 +1,76 @@
+/* Copyright (c) 2010 Peter Cawley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#ifndef _LBCV_PARALLEL_H_
+#define _LBCV_PARALLEL_H_
+#include "defs.h"
+#include "decoder.h"
+#include "threadpool.h"
+#include "vcache.h"
+#include <lua.h>
+
+/**
+ * @file
+ * Decoding and verification of a single chunk of bytecode using several
+ * threads. The decoding is split into a sequential prescan (see
+ * decode_bytecode_index()) followed by the parallel decoding of each
+ * prototype, and then every prototype is verified in parallel.
+ *
+ * The allocator functions passed to these functions are only ever called from
+ * the calling thread.
+ */
+
+/**
+ * Decode an entire chunk of bytecode from a contiguous buffer, using the
+ * threads of a pool.
+ *
+ * @param ds A decode_state_t freshly returned by decode_bytecode_init().
+ * @param data The bytecode. If decode_state::view is set, this must remain
+ *             valid until the resulting prototype is freed.
+ * @param len The number of bytes at @p data.
+ * @param pool The threads to decode with.
+ *
+ * @return As for decode_bytecode_pump(). Afterwards, decode_bytecode_finish()
+ *         should be called to obtain the result and free @p ds.
+ */
+int decode_bytecode_parallel(decode_state_t* ds, const unsigned char* data,
+                             size_t len, thread_pool_t* pool);
+
+/**
+ * Verify a tree of prototypes, verifying distinct prototypes on distinct
+ * threads of a pool, with each thread using a verify_state_t of its own. The
+ * longest prototypes are started first, and as soon as any prototype is
+ * rejected, the others are abandoned.
+ *
+ * @param prototype The root of the tree.
+ * @param pool The threads to verify with.
+ * @param alloc An allocator function for scratch space.
+ * @param ud An opaque pointer which will be passed to @p alloc.
+ * @param cache A cache of prototypes known to be safe, as for
+ *              verify_cached(), or @c NULL. Subtrees found in the cache are
+ *              not verified again.
+ *
+ * @return @c DECODE_YIELD if the tree is safe, @c DECODE_UNSAFE if it is not,
+ *         or @c DECODE_ERROR_MEM, as for verify_budgeted() without a budget.
+ */
+int verify_parallel(decoded_prototype_t* prototype, thread_pool_t* pool,
+                     lua_Alloc alloc, void* ud, verify_cache_t* cache);
+
+#endif /* _LBCV_PARALLEL_H_ */
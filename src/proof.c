@@ -0,0 +1,89 @@
+/* Copyright (c) 2010 Peter Cawley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include "proof.h"
+#include "mac.h"
+#include "verifier.h"
+#include <string.h>
+
+#define PROOF_MAGIC "LBCVPRF1"
+#define PROOF_MAGIC_SIZE 8
+/* The part of the trailer covered by the tag: magic, version, reserved. */
+#define PROOF_HEADER_SIZE 16
+
+static void make_header(unsigned char header[PROOF_HEADER_SIZE])
+{
+    unsigned long version = VERIFIER_RULES_VERSION;
+    int i;
+    memcpy(header, PROOF_MAGIC, PROOF_MAGIC_SIZE);
+    for(i = 0; i < 4; ++i)
+    {
+        header[PROOF_MAGIC_SIZE + i] = (unsigned char)(version >> (i * 8));
+        header[PROOF_MAGIC_SIZE + 4 + i] = 0;
+    }
+}
+
+static void compute_tag(const unsigned char* key, size_t keylen,
+                        const unsigned char* chunk, size_t len,
+                        const unsigned char* header,
+                        unsigned char tag[SHA256_DIGEST_SIZE])
+{
+    hmac_sha256_t mac;
+    hmac_sha256_init(&mac, key, keylen);
+    hmac_sha256_update(&mac, chunk, len);
+    hmac_sha256_update(&mac, header, PROOF_HEADER_SIZE);
+    hmac_sha256_final(&mac, tag);
+}
+
+void proof_seal(const unsigned char* key, size_t keylen,
+                const unsigned char* chunk, size_t len,
+                unsigned char trailer[PROOF_TRAILER_SIZE])
+{
+    make_header(trailer);
+    compute_tag(key, keylen, chunk, len, trailer,
+        trailer + PROOF_HEADER_SIZE);
+}
+
+size_t proof_strip(const unsigned char* data, size_t len)
+{
+    if(len < PROOF_TRAILER_SIZE || memcmp(data + len - PROOF_TRAILER_SIZE,
+        PROOF_MAGIC, PROOF_MAGIC_SIZE) != 0)
+        return len;
+    return len - PROOF_TRAILER_SIZE;
+}
+
+bool proof_check(const unsigned char* key, size_t keylen,
+                 const unsigned char* data, size_t len)
+{
+    unsigned char expected[PROOF_HEADER_SIZE];
+    unsigned char tag[SHA256_DIGEST_SIZE];
+    const unsigned char* trailer;
+
+    if(proof_strip(data, len) == len)
+        return false;
+    len -= PROOF_TRAILER_SIZE;
+    trailer = data + len;
+    /* A trailer from a verifier with other rules proves nothing. */
+    make_header(expected);
+    if(memcmp(expected, trailer, PROOF_HEADER_SIZE) != 0)
+        return false;
+    compute_tag(key, keylen, data, len, trailer, tag);
+    return mac_equal(tag, trailer + PROOF_HEADER_SIZE, SHA256_DIGEST_SIZE);
+}
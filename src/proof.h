@@ -0,0 +1,78 @@
+/* Copyright (c) 2010 Peter Cawley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#ifndef _LBCV_PROOF_H_
+#define _LBCV_PROOF_H_
+#include "defs.h"
+
+/**
+ * @file
+ * A trailer which can be appended to a chunk of bytecode once it has been
+ * verified, proving to anyone who holds the same secret key that the chunk
+ * was accepted by a verifier applying the same rules. Checking the proof
+ * costs a single pass of HMAC-SHA256 over the chunk, rather than a decode and
+ * verification.
+ *
+ * The trailer is PROOF_TRAILER_SIZE bytes: an eight byte magic, then
+ * VERIFIER_RULES_VERSION and a reserved word (both 32 bits, little endian),
+ * and then the HMAC-SHA256 tag of the chunk followed by the first sixteen
+ * bytes of the trailer. The Lua loader never reads beyond the end of the
+ * chunk, so bytecode with a trailer can still be loaded by plain Lua.
+ */
+
+#define PROOF_TRAILER_SIZE 48
+
+/**
+ * Compute the trailer for a chunk.
+ *
+ * @param key The secret key.
+ * @param keylen The number of bytes at @p key.
+ * @param chunk The chunk, without any trailer.
+ * @param len The number of bytes at @p chunk.
+ * @param trailer Where to store the trailer.
+ */
+void proof_seal(const unsigned char* key, size_t keylen,
+                const unsigned char* chunk, size_t len,
+                unsigned char trailer[PROOF_TRAILER_SIZE]);
+
+/**
+ * Find the length of a chunk without its trailer.
+ *
+ * @return @p len less PROOF_TRAILER_SIZE if @p data ends with something which
+ *         looks like a trailer (whether or not the tag is valid), otherwise
+ *         @p len.
+ */
+size_t proof_strip(const unsigned char* data, size_t len);
+
+/**
+ * Check the trailer at the end of a chunk.
+ *
+ * @param key The secret key.
+ * @param keylen The number of bytes at @p key.
+ * @param data The chunk followed by its trailer.
+ * @param len The number of bytes at @p data, including the trailer.
+ *
+ * @return @c true if the trailer was made with @p key for exactly this
+ *         chunk, by a verifier with the current VERIFIER_RULES_VERSION.
+ */
+bool proof_check(const unsigned char* key, size_t keylen,
+                 const unsigned char* data, size_t len);
+
+#endif /* _LBCV_PROOF_H_ */
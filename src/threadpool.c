@@ -0,0 +1,340 @@
+/* Copyright (c) 2010 Peter Cawley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include "threadpool.h"
+
+#ifdef LBCV_USE_PTHREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifdef LBCV_USE_PTHREADS
+
+struct thread_pool_worker
+{
+    thread_pool_t* pool;
+    unsigned int index;
+    pthread_t thread;
+};
+
+struct thread_pool
+{
+    lua_Alloc alloc;
+    void* allocud;
+    /**
+     * The number of threads running jobs, including the calling thread.
+     */
+    unsigned int numthreads;
+    /**
+     * The number of threads which were requested, and hence the length of
+     * thread_pool::workers plus one.
+     */
+    unsigned int maxthreads;
+    pthread_mutex_t lock;
+    /**
+     * Signalled when a new batch is posted, or the pool is shutting down.
+     */
+    pthread_cond_t wake;
+    /**
+     * Signalled when the last helper thread finishes with a batch.
+     */
+    pthread_cond_t done;
+    /**
+     * Incremented every time a batch is posted, so that helper threads can
+     * tell a new batch apart from a spurious wake-up.
+     */
+    unsigned long generation;
+    /**
+     * The number of helper threads which have not yet finished with the
+     * current batch.
+     */
+    unsigned int active;
+    bool shutdown;
+    thread_pool_fn fn;
+    void* ctx;
+    /**
+     * The next job to be claimed, and the number of jobs in the batch.
+     */
+    size_t next;
+    size_t numjobs;
+    struct thread_pool_worker workers[1];
+};
+
+#define SIZEOF_thread_pool_t(n) \
+    (sizeof(thread_pool_t) + sizeof(struct thread_pool_worker) * (n))
+
+static void run_jobs(thread_pool_t* pool, unsigned int worker)
+{
+    for(;;)
+    {
+        size_t first, last;
+        pthread_mutex_lock(&pool->lock);
+        first = pool->next;
+        if(first >= pool->numjobs)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            return;
+        }
+        /* Claim several jobs at once while many remain, so that batches of
+           small jobs do not spend all their time on the lock. */
+        last = first + (pool->numjobs - first) / (pool->numthreads * 4) + 1;
+        if(last > pool->numjobs)
+            last = pool->numjobs;
+        pool->next = last;
+        pthread_mutex_unlock(&pool->lock);
+        for(; first < last; ++first)
+            pool->fn(pool->ctx, first, worker);
+    }
+}
+
+static void* worker_main(void* arg)
+{
+    struct thread_pool_worker* self = (struct thread_pool_worker*)arg;
+    thread_pool_t* pool = self->pool;
+    /* No batch can have been posted before the pool was created, and the
+       generation must not be read here, as a batch may already have been
+       posted by the time this thread starts running. */
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for(;;)
+    {
+        while(!pool->shutdown && pool->generation == seen)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if(pool->shutdown)
+            break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+        run_jobs(pool, self->index);
+        pthread_mutex_lock(&pool->lock);
+        if(--pool->active == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+thread_pool_t* thread_pool_create(unsigned int numthreads, lua_Alloc alloc,
+                                  void* allocud)
+{
+    thread_pool_t* pool;
+    unsigned int i;
+
+    if(numthreads < 1)
+        numthreads = 1;
+    if(numthreads - 1 > ((size_t)-1 - sizeof(thread_pool_t))
+        / sizeof(struct thread_pool_worker))
+        return NULL;
+    pool = (thread_pool_t*)alloc(allocud, NULL, 0,
+        SIZEOF_thread_pool_t(numthreads - 1));
+    if(pool == NULL)
+        return NULL;
+    pool->alloc = alloc;
+    pool->allocud = allocud;
+    pool->numthreads = 1;
+    pool->maxthreads = numthreads;
+    pool->generation = 0;
+    pool->active = 0;
+    pool->shutdown = false;
+    pool->fn = NULL;
+    pool->ctx = NULL;
+    pool->next = 0;
+    pool->numjobs = 0;
+    if(numthreads == 1)
+        return pool;
+
+    if(pthread_mutex_init(&pool->lock, NULL) != 0)
+        goto nothreads;
+    if(pthread_cond_init(&pool->wake, NULL) != 0)
+    {
+        pthread_mutex_destroy(&pool->lock);
+        goto nothreads;
+    }
+    if(pthread_cond_init(&pool->done, NULL) != 0)
+    {
+        pthread_cond_destroy(&pool->wake);
+        pthread_mutex_destroy(&pool->lock);
+        goto nothreads;
+    }
+    for(i = 1; i < numthreads; ++i)
+    {
+        struct thread_pool_worker* w = pool->workers + i - 1;
+        w->pool = pool;
+        w->index = i;
+        if(pthread_create(&w->thread, NULL, worker_main, w) != 0)
+            break;
+        ++pool->numthreads;
+    }
+    if(pool->numthreads == 1)
+    {
+        pthread_cond_destroy(&pool->done);
+        pthread_cond_destroy(&pool->wake);
+        pthread_mutex_destroy(&pool->lock);
+        goto nothreads;
+    }
+    return pool;
+
+nothreads:
+    /* Carry on with just the calling thread, as jobs still run correctly. */
+    pool->maxthreads = 1;
+    return pool;
+}
+
+unsigned int thread_pool_default_size(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if(n > 1)
+        return (unsigned int)n;
+#endif
+    return 1;
+}
+
+unsigned int thread_pool_size(thread_pool_t* pool)
+{
+    return pool->numthreads;
+}
+
+void thread_pool_run(thread_pool_t* pool, size_t numjobs, thread_pool_fn fn,
+                     void* ctx)
+{
+    size_t i;
+    if(pool->numthreads == 1 || numjobs <= 1)
+    {
+        /* Not worth waking the helper threads. */
+        pool->next = 0;
+        pool->numjobs = numjobs;
+        for(i = 0; i < numjobs; i = ++pool->next)
+            fn(ctx, i, 0);
+        pool->numjobs = 0;
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->ctx = ctx;
+    pool->next = 0;
+    pool->numjobs = numjobs;
+    pool->active = pool->numthreads - 1;
+    ++pool->generation;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    run_jobs(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while(pool->active != 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pool->numjobs = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_cancel(thread_pool_t* pool)
+{
+    if(pool->numthreads == 1)
+    {
+        pool->next = pool->numjobs;
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->next = pool->numjobs;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_destroy(thread_pool_t* pool)
+{
+    unsigned int i;
+    if(pool == NULL)
+        return;
+    if(pool->numthreads > 1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->shutdown = true;
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+        for(i = 1; i < pool->numthreads; ++i)
+            pthread_join(pool->workers[i - 1].thread, NULL);
+        pthread_cond_destroy(&pool->done);
+        pthread_cond_destroy(&pool->wake);
+        pthread_mutex_destroy(&pool->lock);
+    }
+    pool->alloc(pool->allocud, pool, SIZEOF_thread_pool_t(pool->maxthreads - 1), 0);
+}
+
+#else /* !LBCV_USE_PTHREADS */
+
+struct thread_pool
+{
+    lua_Alloc alloc;
+    void* allocud;
+    size_t next;
+    size_t numjobs;
+};
+
+thread_pool_t* thread_pool_create(unsigned int numthreads, lua_Alloc alloc,
+                                  void* allocud)
+{
+    thread_pool_t* pool = (thread_pool_t*)alloc(allocud, NULL, 0,
+        sizeof(thread_pool_t));
+    (void)numthreads;
+    if(pool != NULL)
+    {
+        pool->alloc = alloc;
+        pool->allocud = allocud;
+        pool->next = 0;
+        pool->numjobs = 0;
+    }
+    return pool;
+}
+
+unsigned int thread_pool_default_size(void)
+{
+    return 1;
+}
+
+unsigned int thread_pool_size(thread_pool_t* pool)
+{
+    (void)pool;
+    return 1;
+}
+
+void thread_pool_run(thread_pool_t* pool, size_t numjobs, thread_pool_fn fn,
+                     void* ctx)
+{
+    size_t i;
+    pool->next = 0;
+    pool->numjobs = numjobs;
+    for(i = 0; i < numjobs; i = ++pool->next)
+        fn(ctx, i, 0);
+    pool->numjobs = 0;
+}
+
+void thread_pool_cancel(thread_pool_t* pool)
+{
+    pool->next = pool->numjobs;
+}
+
+void thread_pool_destroy(thread_pool_t* pool)
+{
+    if(pool != NULL)
+        pool->alloc(pool->allocud, pool, sizeof(thread_pool_t), 0);
+}
+
+#endif
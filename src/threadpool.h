@@ -0,0 +1,114 @@
+/* Copyright (c) 2010 Peter Cawley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#ifndef _LBCV_THREADPOOL_H_
+#define _LBCV_THREADPOOL_H_
+#include "defs.h"
+#include <lua.h>
+
+/**
+ * @file
+ * A minimal fixed-size pool of worker threads, for running a batch of
+ * independent jobs in parallel. The thread which calls thread_pool_run()
+ * takes part in running the jobs, and thread_pool_run() only returns once
+ * every job has finished.
+ *
+ * The allocator given to thread_pool_create() is only ever called from the
+ * thread calling thread_pool_create() or thread_pool_destroy(), so it need not
+ * be thread-safe. Likewise, jobs must not call a Lua allocator.
+ *
+ * On platforms without POSIX threads, a pool always has a single thread, and
+ * jobs are run one after another by the caller.
+ */
+
+/**
+ * Function which runs a single job.
+ *
+ * @param ctx The opaque pointer which was passed to thread_pool_run().
+ * @param job The index of the job, in the range [0, number of jobs).
+ * @param worker The index of the thread running the job, in the range
+ *               [0, thread_pool_size()). The thread calling thread_pool_run()
+ *               is always worker 0. No two jobs with the same worker index
+ *               run at the same time, so this can be used to select
+ *               per-thread scratch space.
+ */
+typedef void (*thread_pool_fn)(void* ctx, size_t job, unsigned int worker);
+
+typedef struct thread_pool thread_pool_t;
+
+/**
+ * Create a pool of threads.
+ *
+ * @param numthreads The total number of threads which should run jobs,
+ *                   including the thread which calls thread_pool_run(). Values
+ *                   less than 1 are treated as 1. If not all of the requested
+ *                   threads can be started, the pool has fewer threads.
+ * @param alloc An allocator function for the pool structure.
+ * @param allocud An opaque pointer which will be passed to @p alloc.
+ *
+ * @return @c NULL on memory allocation failure, otherwise a pool which must
+ *         be freed with thread_pool_destroy().
+ */
+thread_pool_t* thread_pool_create(unsigned int numthreads, lua_Alloc alloc,
+                                  void* allocud);
+
+/**
+ * Get a suitable number of threads for a pool on this machine, which is the
+ * number of online processors, or 1 if that cannot be determined.
+ */
+unsigned int thread_pool_default_size(void);
+
+/**
+ * Get the number of threads which run jobs for a pool, including the thread
+ * which calls thread_pool_run().
+ */
+unsigned int thread_pool_size(thread_pool_t* pool);
+
+/**
+ * Run a batch of jobs across the threads of a pool, and wait for all of them
+ * to finish.
+ *
+ * @param pool The pool to run the jobs on. Only one batch can run on a pool at
+ *             a time.
+ * @param numjobs The number of jobs to run.
+ * @param fn The function to call for each job.
+ * @param ctx An opaque pointer which will be passed to @p fn.
+ */
+void thread_pool_run(thread_pool_t* pool, size_t numjobs, thread_pool_fn fn,
+                     void* ctx);
+
+/**
+ * Prevent any job of the current batch which has not yet started from being
+ * started. Jobs which have already started will still run to completion.
+ *
+ * This may be called from within a job, typically when a job discovers that
+ * the outcome of the batch is already known.
+ */
+void thread_pool_cancel(thread_pool_t* pool);
+
+/**
+ * Stop the threads of a pool, and free it.
+ *
+ * @param pool The pool to free, which must not be running a batch. May be
+ *             @c NULL.
+ */
+void thread_pool_destroy(thread_pool_t* pool);
+
+#endif /* _LBCV_THREADPOOL_H_ */
@@ -0,0 +1,330 @@
+/* Copyright (c) 2010 Peter Cawley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include "vcache.h"
+#include <stdlib.h>
+
+#ifdef LBCV_USE_PTHREADS
+#include <pthread.h>
+#define cache_lock(cache) pthread_mutex_lock(&(cache)->lock)
+#define cache_unlock(cache) pthread_mutex_unlock(&(cache)->lock)
+#else
+#define cache_lock(cache) ((void)0)
+#define cache_unlock(cache) ((void)0)
+#endif
+
+/**
+ * Index value meaning "no entry" in the links between entries.
+ */
+#define NIL ((size_t)-1)
+
+struct cache_entry
+{
+    chunk_digest_t digest;
+    size_t len;
+    int status;
+    /**
+     * Neighbours in the recency list, with cache::head being the most
+     * recently used entry. Unused entries are linked through next.
+     */
+    size_t prev;
+    size_t next;
+    /**
+     * The next entry in the same hash bucket.
+     */
+    size_t chain;
+};
+
+struct verify_cache
+{
+#ifdef LBCV_USE_PTHREADS
+    pthread_mutex_t lock;
+#endif
+    struct cache_entry* entries;
+    /**
+     * The first entry of each hash bucket. There is a power of two number
+     * of buckets, at least as many as there are entries.
+     */
+    size_t* buckets;
+    size_t numbuckets;
+    size_t head;
+    size_t tail;
+    size_t freelist;
+    bool cachefailures;
+    verify_cache_stats_t stats;
+};
+
+#ifdef LBCV_USE_PTHREADS
+#define DISABLED_CACHE {PTHREAD_MUTEX_INITIALIZER, \
+    NULL, NULL, 0, NIL, NIL, NIL, false, {0, 0, 0, 0, 0}}
+#else
+#define DISABLED_CACHE { \
+    NULL, NULL, 0, NIL, NIL, NIL, false, {0, 0, 0, 0, 0}}
+#endif
+
+static verify_cache_t shared_cache = DISABLED_CACHE;
+static verify_cache_t shared_prototype_cache = DISABLED_CACHE;
+
+verify_cache_t* verify_cache_shared(void)
+{
+    return &shared_cache;
+}
+
+verify_cache_t* verify_cache_shared_prototypes(void)
+{
+    return &shared_prototype_cache;
+}
+
+/**
+ * Release the storage of a cache and reset it to being disabled. The lock
+ * must be held (or the cache otherwise inaccessible to other threads).
+ */
+static void cache_clear(verify_cache_t* cache)
+{
+    free(cache->entries);
+    free(cache->buckets);
+    cache->entries = NULL;
+    cache->buckets = NULL;
+    cache->numbuckets = 0;
+    cache->head = NIL;
+    cache->tail = NIL;
+    cache->freelist = NIL;
+    cache->stats.hits = 0;
+    cache->stats.misses = 0;
+    cache->stats.evictions = 0;
+    cache->stats.entries = 0;
+    cache->stats.capacity = 0;
+}
+
+static bool cache_setup(verify_cache_t* cache, size_t capacity,
+                        bool cachefailures)
+{
+    size_t i, numbuckets = 1;
+
+    cache_clear(cache);
+    cache->cachefailures = cachefailures;
+    if(capacity == 0)
+        return true;
+    while(numbuckets < capacity)
+    {
+        if(numbuckets > ((size_t)-1 / sizeof(size_t)) / 2)
+            return false;
+        numbuckets *= 2;
+    }
+    if(capacity > (size_t)-1 / sizeof(struct cache_entry))
+        return false;
+    cache->entries = (struct cache_entry*)malloc(
+        capacity * sizeof(struct cache_entry));
+    cache->buckets = (size_t*)malloc(numbuckets * sizeof(size_t));
+    if(cache->entries == NULL || cache->buckets == NULL)
+    {
+        cache_clear(cache);
+        return false;
+    }
+    cache->numbuckets = numbuckets;
+    for(i = 0; i < numbuckets; ++i)
+        cache->buckets[i] = NIL;
+    for(i = 0; i < capacity; ++i)
+        cache->entries[i].next = i + 1 < capacity ? i + 1 : NIL;
+    cache->freelist = 0;
+    cache->stats.capacity = capacity;
+    return true;
+}
+
+verify_cache_t* verify_cache_create(size_t capacity, bool cachefailures)
+{
+    verify_cache_t* cache = (verify_cache_t*)malloc(sizeof(verify_cache_t));
+    if(cache == NULL)
+        return NULL;
+#ifdef LBCV_USE_PTHREADS
+    if(pthread_mutex_init(&cache->lock, NULL) != 0)
+    {
+        free(cache);
+        return NULL;
+    }
+#endif
+    cache->entries = NULL;
+    cache->buckets = NULL;
+    if(!cache_setup(cache, capacity, cachefailures))
+    {
+        verify_cache_destroy(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void verify_cache_destroy(verify_cache_t* cache)
+{
+    if(cache == NULL || cache == &shared_cache
+    || cache == &shared_prototype_cache)
+        return;
+    cache_clear(cache);
+#ifdef LBCV_USE_PTHREADS
+    pthread_mutex_destroy(&cache->lock);
+#endif
+    free(cache);
+}
+
+bool verify_cache_configure(verify_cache_t* cache, size_t capacity,
+                            bool cachefailures)
+{
+    bool result;
+    cache_lock(cache);
+    result = cache_setup(cache, capacity, cachefailures);
+    cache_unlock(cache);
+    return result;
+}
+
+bool verify_cache_enabled(verify_cache_t* cache)
+{
+    bool result;
+    cache_lock(cache);
+    result = cache->stats.capacity != 0;
+    cache_unlock(cache);
+    return result;
+}
+
+static size_t bucket_of(verify_cache_t* cache, const chunk_digest_t* digest)
+{
+    return (size_t)digest->h1 & (cache->numbuckets - 1);
+}
+
+/**
+ * Find an entry, returning its index or NIL. The lock must be held.
+ */
+static size_t cache_find(verify_cache_t* cache, const chunk_digest_t* digest,
+                         size_t len)
+{
+    size_t i = cache->buckets[bucket_of(cache, digest)];
+    while(i != NIL)
+    {
+        struct cache_entry* e = cache->entries + i;
+        if(e->digest.h1 == digest->h1 && e->digest.h2 == digest->h2
+        && e->len == len)
+            return i;
+        i = e->chain;
+    }
+    return NIL;
+}
+
+static void list_unlink(verify_cache_t* cache, size_t i)
+{
+    struct cache_entry* e = cache->entries + i;
+    if(e->prev != NIL)
+        cache->entries[e->prev].next = e->next;
+    else
+        cache->head = e->next;
+    if(e->next != NIL)
+        cache->entries[e->next].prev = e->prev;
+    else
+        cache->tail = e->prev;
+}
+
+static void list_push_front(verify_cache_t* cache, size_t i)
+{
+    struct cache_entry* e = cache->entries + i;
+    e->prev = NIL;
+    e->next = cache->head;
+    if(cache->head != NIL)
+        cache->entries[cache->head].prev = i;
+    else
+        cache->tail = i;
+    cache->head = i;
+}
+
+static void chain_unlink(verify_cache_t* cache, size_t i)
+{
+    size_t* link = cache->buckets + bucket_of(cache,
+        &cache->entries[i].digest);
+    while(*link != i)
+        link = &cache->entries[*link].chain;
+    *link = cache->entries[i].chain;
+}
+
+bool verify_cache_lookup(verify_cache_t* cache, const chunk_digest_t* digest,
+                         size_t len, int* status)
+{
+    size_t i;
+    bool found = false;
+    cache_lock(cache);
+    if(cache->stats.capacity != 0)
+    {
+        i = cache_find(cache, digest, len);
+        if(i != NIL)
+        {
+            *status = cache->entries[i].status;
+            if(cache->head != i)
+            {
+                list_unlink(cache, i);
+                list_push_front(cache, i);
+            }
+            ++cache->stats.hits;
+            found = true;
+        }
+        else
+            ++cache->stats.misses;
+    }
+    cache_unlock(cache);
+    return found;
+}
+
+void verify_cache_insert(verify_cache_t* cache, const chunk_digest_t* digest,
+                         size_t len, bool safe, int status)
+{
+    size_t i;
+    struct cache_entry* e;
+    cache_lock(cache);
+    if(cache->stats.capacity == 0 || (!safe && !cache->cachefailures))
+        goto done;
+    if(cache_find(cache, digest, len) != NIL)
+        goto done; /* Another thread got there first. */
+
+    i = cache->freelist;
+    if(i != NIL)
+    {
+        cache->freelist = cache->entries[i].next;
+        ++cache->stats.entries;
+    }
+    else
+    {
+        /* Full, so recycle the least recently used entry. */
+        i = cache->tail;
+        list_unlink(cache, i);
+        chain_unlink(cache, i);
+        ++cache->stats.evictions;
+    }
+    e = cache->entries + i;
+    e->digest = *digest;
+    e->len = len;
+    e->status = status;
+    e->chain = cache->buckets[bucket_of(cache, digest)];
+    cache->buckets[bucket_of(cache, digest)] = i;
+    list_push_front(cache, i);
+
+done:
+    cache_unlock(cache);
+}
+
+void verify_cache_getstats(verify_cache_t* cache, verify_cache_stats_t* stats)
+{
+    cache_lock(cache);
+    *stats = cache->stats;
+    cache_unlock(cache);
+}
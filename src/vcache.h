@@ -0,0 +1,154 @@
+/* Copyright (c) 2010 Peter Cawley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#ifndef _LBCV_VCACHE_H_
+#define _LBCV_VCACHE_H_
+#include "defs.h"
+#include "hash.h"
+
+/**
+ * @file
+ * A bounded cache of the outcome of verifying entire chunks of bytecode,
+ * keyed by the chunk_digest_t of the bytecode and its length, and evicting the
+ * least recently used entry when full.
+ *
+ * A cache is safe to use from several threads at once, and so can be shared
+ * between Lua states running on different threads of one process. For this
+ * reason, memory for caches comes from malloc() rather than from a lua_Alloc.
+ */
+
+/**
+ * Counters describing the use of a cache since it was last configured.
+ */
+struct verify_cache_stats
+{
+    /**
+     * The number of lookups which found an entry.
+     */
+    size_t hits;
+    /**
+     * The number of lookups which did not find an entry.
+     */
+    size_t misses;
+    /**
+     * The number of entries which were discarded to make room for new ones.
+     */
+    size_t evictions;
+    /**
+     * The number of entries currently in the cache.
+     */
+    size_t entries;
+    /**
+     * The maximum number of entries in the cache. Zero means that the cache is
+     * disabled.
+     */
+    size_t capacity;
+};
+typedef struct verify_cache_stats verify_cache_stats_t;
+
+typedef struct verify_cache verify_cache_t;
+
+/**
+ * Get the cache shared by everything in the process. It starts out disabled
+ * (with a capacity of zero), and can be enabled with verify_cache_configure().
+ */
+verify_cache_t* verify_cache_shared(void);
+
+/**
+ * Get the cache of prototypes known to be safe which is shared by everything
+ * in the process, keyed by decoded_prototype::fingerprint and
+ * decoded_prototype::numinstructions. Like verify_cache_shared(), it starts
+ * out disabled.
+ */
+verify_cache_t* verify_cache_shared_prototypes(void);
+
+/**
+ * Create a new cache, separate from the shared one.
+ *
+ * @param capacity The maximum number of entries.
+ * @param cachefailures Whether bytecode which fails to verify is cached, as
+ *                      well as bytecode which verifies successfully.
+ *
+ * @return @c NULL on memory allocation failure, otherwise a cache which must
+ *         be freed with verify_cache_destroy().
+ */
+verify_cache_t* verify_cache_create(size_t capacity, bool cachefailures);
+
+/**
+ * Free a cache created by verify_cache_create(). May be @c NULL.
+ */
+void verify_cache_destroy(verify_cache_t* cache);
+
+/**
+ * Change the capacity of a cache, discarding all of its entries and resetting
+ * its counters.
+ *
+ * @param cache The cache to configure.
+ * @param capacity The maximum number of entries, or zero to disable the cache.
+ * @param cachefailures Whether bytecode which fails to verify is cached.
+ *
+ * @return @c false on memory allocation failure, in which case the cache is
+ *         left disabled.
+ */
+bool verify_cache_configure(verify_cache_t* cache, size_t capacity,
+                            bool cachefailures);
+
+/**
+ * Query whether a cache is enabled, which is a cheap test to make before
+ * computing the digest of some bytecode.
+ */
+bool verify_cache_enabled(verify_cache_t* cache);
+
+/**
+ * Look up the outcome of verifying some bytecode.
+ *
+ * @param cache The cache to search.
+ * @param digest The digest of the bytecode.
+ * @param len The length of the bytecode.
+ * @param status A pointer to a variable into which the status previously
+ *               passed to verify_cache_insert() will be stored if the
+ *               bytecode is found.
+ *
+ * @return @c true if the bytecode was found, otherwise @c false.
+ */
+bool verify_cache_lookup(verify_cache_t* cache, const chunk_digest_t* digest,
+                         size_t len, int* status);
+
+/**
+ * Record the outcome of verifying some bytecode, evicting the least recently
+ * used entry if the cache is full.
+ *
+ * @param cache The cache to update.
+ * @param digest The digest of the bytecode.
+ * @param len The length of the bytecode.
+ * @param safe Whether the bytecode was found to be safe. If not, and the
+ *             cache was not configured to cache failures, nothing is recorded.
+ * @param status An opaque status code to return from later lookups, typically
+ *               the result of decode_bytecode_pump().
+ */
+void verify_cache_insert(verify_cache_t* cache, const chunk_digest_t* digest,
+                         size_t len, bool safe, int status);
+
+/**
+ * Get the counters of a cache.
+ */
+void verify_cache_getstats(verify_cache_t* cache, verify_cache_stats_t* stats);
+
+#endif /* _LBCV_VCACHE_H_ */
@@ -20,148 +20,322 @@ SOFTWARE. */
 
 #include "verifier.h"
 #include "opcodes.h"
+#include <limits.h>
 #include <string.h>
-
-bool reg_state_isknown(reg_state_t* state, reg_index_t reg)
+#include <time.h>
+
+#ifdef LBCV_USE_PTHREADS
+#include <sys/time.h>
+#endif
+
+/* The word of plane `plane' which holds the bit for register `reg', which
+   must be below the prototype's numregs, as nothing beyond that is
+   allocated. */
+#define REG_WORD(state, plane, reg) \
+    ((state)->planes[((reg) / REG_WORD_BITS) * REG_NUMPLANES + (plane)])
+#define REG_BIT(reg) ((reg_word_t)1 << ((reg) % REG_WORD_BITS))
+
+#define REG_TEST(state, plane, reg) \
+    ((REG_WORD(state, plane, reg) & REG_BIT(reg)) != 0)
+#define REG_SET(state, plane, reg) (REG_WORD(state, plane, reg) |= REG_BIT(reg))
+#define REG_CLEAR(state, plane, reg) \
+    (REG_WORD(state, plane, reg) &= ~REG_BIT(reg))
+
+/* The bits of word `w' of a plane which are for registers in the range
+   [first, last). */
+static reg_word_t reg_range_mask(size_t w, reg_index_t first,
+                                 reg_index_t last)
 {
-    return (state->state_flags[reg] & REG_VALUEKNOWN) != 0;
+    reg_word_t mask = ~(reg_word_t)0;
+    size_t lo = w * REG_WORD_BITS;
+    if(first > lo)
+        mask &= ~(reg_word_t)0 << (first - lo);
+    if(last < lo + REG_WORD_BITS)
+        mask &= ~(~(reg_word_t)0 << (last - lo));
+    return mask;
 }
 
-bool reg_state_areknown(reg_state_t* state, reg_index_t reg, int num)
+/* Whether every register in [first, last) has its bit set in `plane'. */
+static bool reg_range_all(reg_state_t* state, int plane, reg_index_t first,
+                          reg_index_t last)
 {
-    for(--num; num >= 0; --num)
+    size_t w;
+    if(first >= last)
+        return true;
+    for(w = first / REG_WORD_BITS; w <= (last - 1) / REG_WORD_BITS; ++w)
     {
-        if(!reg_state_isknown(state, (reg_index_t)(reg + num)))
+        reg_word_t mask = reg_range_mask(w, first, last);
+        if((state->planes[w * REG_NUMPLANES + plane] & mask) != mask)
             return false;
     }
     return true;
 }
 
+/* Whether any register in [first, last) has its bit set in `plane'. */
+static bool reg_range_any(reg_state_t* state, int plane, reg_index_t first,
+                          reg_index_t last)
+{
+    size_t w;
+    if(first >= last)
+        return false;
+    for(w = first / REG_WORD_BITS; w <= (last - 1) / REG_WORD_BITS; ++w)
+    {
+        if((state->planes[w * REG_NUMPLANES + plane]
+            & reg_range_mask(w, first, last)) != 0)
+            return true;
+    }
+    return false;
+}
+
+bool reg_state_isknown(reg_state_t* state, reg_index_t reg)
+{
+    return REG_TEST(state, REG_VALUEKNOWN, reg);
+}
+
+bool reg_state_areknown(reg_state_t* state, reg_index_t reg, int num)
+{
+    if(num <= 0)
+        return true;
+    return reg_range_all(state, REG_VALUEKNOWN, reg, reg + (reg_index_t)num);
+}
+
 bool reg_state_isopen(reg_state_t* state, reg_index_t reg)
 {
-    return (state->state_flags[reg] & REG_OPENUPVALUE) != 0;
+    return REG_TEST(state, REG_OPENUPVALUE, reg);
 }
 
 bool reg_state_areopen(reg_state_t* state, reg_index_t reg, int num)
 {
-    for(--num; num >= 0; --num)
-    {
-        if(reg_state_isopen(state, (reg_index_t)(reg + num)))
-            return true;
-    }
-    return false;
+    if(num <= 0)
+        return false;
+    return reg_range_any(state, REG_OPENUPVALUE, reg, reg + (reg_index_t)num);
 }
 
 bool reg_state_istable(reg_state_t* state, reg_index_t reg)
 {
-    return (state->state_flags[reg] & REG_ISTABLE) != 0;
+    return REG_TEST(state, REG_ISTABLE, reg);
 }
 
 bool reg_state_isnumber(reg_state_t* state, reg_index_t reg)
 {
-    return (state->state_flags[reg] & REG_ISNUMBER) != 0;
+    return REG_TEST(state, REG_ISNUMBER, reg);
 }
 
 void reg_state_setknown(reg_state_t* state, reg_index_t reg)
 {
-    state->state_flags[reg] |= REG_VALUEKNOWN;
+    REG_SET(state, REG_VALUEKNOWN, reg);
 }
 
 void reg_state_setopen(reg_state_t* state, reg_index_t reg)
 {
-    state->state_flags[reg] |= REG_OPENUPVALUE;
-    state->state_flags[reg] &=~ REG_TYPE_MASK;
+    REG_SET(state, REG_OPENUPVALUE, reg);
+    REG_CLEAR(state, REG_ISTABLE, reg);
+    REG_CLEAR(state, REG_ISNUMBER, reg);
 }
 
 void reg_state_settable(reg_state_t* state, reg_index_t reg)
 {
     if(reg_state_isopen(state, reg))
         return;
-    state->state_flags[reg] &=~ REG_TYPE_MASK;
-    state->state_flags[reg] |= REG_ISTABLE | REG_VALUEKNOWN;
+    REG_CLEAR(state, REG_ISNUMBER, reg);
+    REG_SET(state, REG_ISTABLE, reg);
+    REG_SET(state, REG_VALUEKNOWN, reg);
 }
 
 void reg_state_setnumber(reg_state_t* state, reg_index_t reg)
 {
     if(reg_state_isopen(state, reg))
         return;
-    state->state_flags[reg] &=~ REG_TYPE_MASK;
-    state->state_flags[reg] |= REG_ISNUMBER | REG_VALUEKNOWN;
+    REG_CLEAR(state, REG_ISTABLE, reg);
+    REG_SET(state, REG_ISNUMBER, reg);
+    REG_SET(state, REG_VALUEKNOWN, reg);
 }
 
 void reg_state_unsetknown(reg_state_t* state, reg_index_t reg)
 {
-    state->state_flags[reg] &=~ (REG_VALUEKNOWN | REG_TYPE_MASK);
+    REG_CLEAR(state, REG_VALUEKNOWN, reg);
+    REG_CLEAR(state, REG_ISTABLE, reg);
+    REG_CLEAR(state, REG_ISNUMBER, reg);
 }
 
 void reg_state_unsetknowntop(verify_state_t* vs, reg_state_t* state, reg_index_t reg)
 {
-    for(; reg < vs->prototype->numregs; ++reg)
-        reg_state_unsetknown(state, reg);
+    size_t w, numwords = REG_STATE_WORDS(vs->prototype->numregs);
+    for(w = reg / REG_WORD_BITS; w < numwords; ++w)
+    {
+        reg_word_t keep = ~reg_range_mask(w, reg, (reg_index_t)-1);
+        reg_word_t* word = state->planes + w * REG_NUMPLANES;
+        word[REG_VALUEKNOWN] &= keep;
+        word[REG_ISTABLE] &= keep;
+        word[REG_ISNUMBER] &= keep;
+    }
 }
 
 void reg_state_unsetopen(reg_state_t* state, reg_index_t reg)
 {
-    state->state_flags[reg] &=~ REG_OPENUPVALUE;
+    REG_CLEAR(state, REG_OPENUPVALUE, reg);
 }
 
 void reg_state_unsettable(reg_state_t* state, reg_index_t reg)
 {
-    state->state_flags[reg] &=~ REG_ISTABLE;
+    REG_CLEAR(state, REG_ISTABLE, reg);
 }
 
 void reg_state_unsetnumber(reg_state_t* state, reg_index_t reg)
 {
-    state->state_flags[reg] &=~ REG_ISNUMBER;
+    REG_CLEAR(state, REG_ISNUMBER, reg);
 }
 
-int reg_state_merge(verify_state_t* vs, reg_state_t* to, reg_state_t* from)
+/* Merge `to' and `from' into `out', which may be the same as `to'. Returns 0
+   if they cannot be merged (for example if the result would have a register
+   which could be an open upvalue without a known value), 1 if the result
+   differs from `to', or -1 if it does not. */
+static int reg_state_merge_into(verify_state_t* vs, reg_state_t* out,
+                                const reg_state_t* to, const reg_state_t* from)
 {
-    reg_index_t reg;
-    bool anychanges = false;
+    size_t w, numwords = REG_STATE_WORDS(vs->prototype->numregs);
+    reg_word_t changes = 0, unmergeable = 0;
+    const reg_word_t* t = to->planes;
+    const reg_word_t* f = from->planes;
+    reg_word_t* o = out->planes;
 
+    out->top_base = to->top_base;
     if(to->top_base > from->top_base)
     {
-        to->top_base = from->top_base;
-        anychanges = true;
+        out->top_base = from->top_base;
+        changes = 1;
     }
 
-    for(reg = 0; reg < vs->prototype->numregs; ++reg)
+    /* A register keeps a property only if it has it on both sides, except
+       that a register which is an open upvalue on just one side becomes an
+       open upvalue of unknown type, which is only possible if its value is
+       known on both sides. */
+    for(w = 0; w < numwords; ++w, t += REG_NUMPLANES, f += REG_NUMPLANES,
+        o += REG_NUMPLANES)
     {
-        unsigned char toflags = to->state_flags[reg];
-        unsigned char fromflags = from->state_flags[reg];
-        unsigned char newflags = toflags & fromflags;
-        if(((toflags ^ fromflags) & REG_OPENUPVALUE) != 0)
-        {
-            newflags |= REG_OPENUPVALUE;
-            if((newflags & REG_VALUEKNOWN) == 0)
-                return 0; /* unable to merge */
-            newflags &=~ REG_TYPE_MASK;
-        }
-        if(newflags != toflags)
-        {
-            anychanges = true;
-            to->state_flags[reg] = newflags;
-        }
+        reg_word_t known = t[REG_VALUEKNOWN] & f[REG_VALUEKNOWN];
+        reg_word_t opendiff = t[REG_OPENUPVALUE] ^ f[REG_OPENUPVALUE];
+        reg_word_t open = t[REG_OPENUPVALUE] | f[REG_OPENUPVALUE];
+        reg_word_t table = t[REG_ISTABLE] & f[REG_ISTABLE] & ~opendiff;
+        reg_word_t number = t[REG_ISNUMBER] & f[REG_ISNUMBER] & ~opendiff;
+        unmergeable |= opendiff & ~known;
+        changes |= (known ^ t[REG_VALUEKNOWN]) | (open ^ t[REG_OPENUPVALUE])
+                 | (table ^ t[REG_ISTABLE]) | (number ^ t[REG_ISNUMBER]);
+        o[REG_VALUEKNOWN] = known;
+        o[REG_OPENUPVALUE] = open;
+        o[REG_ISTABLE] = table;
+        o[REG_ISNUMBER] = number;
     }
-    return anychanges ? 1 : -1;
+    if(unmergeable != 0)
+        return 0; /* unable to merge */
+    return changes != 0 ? 1 : -1;
 }
 
-#define ALIGN(x) (((x) + sizeof(int)) & ~(sizeof(int) - 1))
-#define SIZEOF_reg_state_t(vs) ALIGN(sizeof(reg_state_t) + (vs)->prototype->numregs - 1)
+#define SIZEOF_reg_state_t_numregs(numregs) (sizeof(reg_state_t) \
+    + (REG_STATE_WORDS(numregs) * REG_NUMPLANES - 1) * sizeof(reg_word_t))
+#define SIZEOF_reg_state_t(vs) \
+    SIZEOF_reg_state_t_numregs((vs)->prototype->numregs)
 
 void reg_state_copy(verify_state_t* vs, reg_state_t* to, reg_state_t* from)
 {
     memcpy(to, from, SIZEOF_reg_state_t(vs));
 }
 
+#define REG_SLOT(vs, index) \
+    ((reg_state_t*)((vs)->reg_slots + (size_t)(index) * SIZEOF_reg_state_t(vs)))
+
+static unsigned int reg_state_hash(verify_state_t* vs, const reg_state_t* state)
+{
+    size_t i, n = REG_STATE_WORDS(vs->prototype->numregs) * REG_NUMPLANES;
+    reg_word_t h = state->top_base;
+    for(i = 0; i < n; ++i)
+    {
+        h ^= state->planes[i];
+        h *= 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    return (unsigned int)(h ^ (h >> 32));
+}
+
+static bool reg_state_equal(verify_state_t* vs, const reg_state_t* x,
+                            const reg_state_t* y)
+{
+    size_t n = REG_STATE_WORDS(vs->prototype->numregs) * REG_NUMPLANES;
+    return x->top_base == y->top_base
+        && memcmp(x->planes, y->planes, n * sizeof(reg_word_t)) == 0;
+}
+
+/* Find or add the interned state equal to `state', and take a reference to
+   it. There is always a free slot, as no more states are live than leaders. */
+static reg_state_t* reg_state_intern(verify_state_t* vs, reg_state_t* state)
+{
+    unsigned int hash = reg_state_hash(vs, state), index;
+    unsigned int* bucket = vs->reg_buckets + (hash & vs->reg_bucket_mask);
+    reg_state_t* interned;
+
+    for(index = *bucket; index != 0; index = interned->next)
+    {
+        interned = REG_SLOT(vs, index - 1);
+        if(interned->hash == hash && reg_state_equal(vs, interned, state))
+        {
+            ++interned->refs;
+            return interned;
+        }
+    }
+
+    if(vs->reg_free != 0)
+    {
+        index = vs->reg_free;
+        vs->reg_free = REG_SLOT(vs, index - 1)->next;
+    }
+    else
+    {
+        index = (unsigned int)++vs->numreg_states;
+        if(vs->numreg_states > vs->peak_reg_states)
+            vs->peak_reg_states = vs->numreg_states;
+    }
+    interned = REG_SLOT(vs, index - 1);
+    reg_state_copy(vs, interned, state);
+    interned->refs = 1;
+    interned->hash = hash;
+    interned->next = *bucket;
+    *bucket = index;
+    return interned;
+}
+
+/* Drop a reference to an interned state, freeing its slot if it was the
+   last. */
+static void reg_state_release(verify_state_t* vs, reg_state_t* state)
+{
+    unsigned int index;
+    unsigned int* link;
+    if(--state->refs != 0)
+        return;
+    index = (unsigned int)(((unsigned char*)state - vs->reg_slots)
+        / SIZEOF_reg_state_t(vs)) + 1;
+    link = vs->reg_buckets + (state->hash & vs->reg_bucket_mask);
+    while(*link != index)
+        link = &REG_SLOT(vs, *link - 1)->next;
+    *link = state->next;
+    state->next = vs->reg_free;
+    vs->reg_free = index;
+}
+
 bool reg_state_move(reg_state_t* state, reg_index_t to, reg_index_t from)
 {
+    int plane;
     if(to == from)
         return true;
-    state->state_flags[to] &= REG_OPENUPVALUE; 
-    state->state_flags[to] |= (state->state_flags[from] &~ REG_OPENUPVALUE);
-    if((state->state_flags[to] & (REG_OPENUPVALUE | REG_VALUEKNOWN)) == REG_OPENUPVALUE)
+    for(plane = 0; plane < REG_NUMPLANES; ++plane)
+    {
+        if(plane == REG_OPENUPVALUE)
+            continue;
+        if(REG_TEST(state, plane, from))
+            REG_SET(state, plane, to);
+        else
+            REG_CLEAR(state, plane, to);
+    }
+    if(reg_state_isopen(state, to) && !reg_state_isknown(state, to))
         return false;
     return true;
 }
@@ -169,7 +343,8 @@ bool reg_state_move(reg_state_t* state, reg_index_t to, reg_index_t from)
 void reg_state_assignment(reg_state_t* state, reg_index_t reg, int type)
 {
     reg_state_setknown(state, reg);
-    state->state_flags[reg] &=~ REG_TYPE_MASK;
+    REG_CLEAR(state, REG_ISTABLE, reg);
+    REG_CLEAR(state, REG_ISNUMBER, reg);
     switch(type)
     {
     case LUA_TTABLE:
@@ -183,22 +358,21 @@ void reg_state_assignment(reg_state_t* state, reg_index_t reg, int type)
 
 void reg_state_settop(verify_state_t* vs, reg_state_t* state, reg_index_t base)
 {
-    reg_index_t i;
+    size_t w, numwords = REG_STATE_WORDS(vs->prototype->numregs);
     state->top_base = base;
-    for(i = base; i < vs->prototype->numregs; ++i)
-        state->state_flags[i] &=~ REG_TYPE_MASK;
+    for(w = base / REG_WORD_BITS; w < numwords; ++w)
+    {
+        reg_word_t keep = ~reg_range_mask(w, base, (reg_index_t)-1);
+        state->planes[w * REG_NUMPLANES + REG_ISTABLE] &= keep;
+        state->planes[w * REG_NUMPLANES + REG_ISNUMBER] &= keep;
+    }
 }
 
 bool reg_state_usetop(reg_state_t* state, reg_index_t base)
 {
     if(state->top_base < base)
         return false;
-    for(; base < state->top_base; ++base)
-    {
-        if(!reg_state_isknown(state, base))
-            return false;
-    }
-    return true;
+    return reg_range_all(state, REG_VALUEKNOWN, base, state->top_base);
 }
 
 /**
@@ -231,14 +405,11 @@ static int rk_type(verify_state_t* vs, reg_state_t* regs, int rk)
 
 static bool check_next_op(verify_state_t* vs, instruction_state_t* ins, int opcode, int* a)
 {
-    int op;
-    int b;
-    int c;
-    if(ins + 1 == vs->instruction_states + vs->prototype->numinstructions)
-        return false;
-    if(!decode_instruction(vs->prototype, ins - vs->instruction_states + 1, &op, a, &b, &c))
+    size_t next = (size_t)(ins - vs->instruction_states) + 1;
+    if(next == vs->prototype->numinstructions)
         return false;
-    return op == opcode;
+    *a = vs->ins_a[next];
+    return vs->ins_op[next] == opcode;
 }
 
 #define alloc_size(vs, n) ((vs)->alloc((vs)->allocud, NULL, 0, (n)))
@@ -247,59 +418,339 @@ static bool check_next_op(verify_state_t* vs, instruction_state_t* ins, int opco
 #define free_size(mem, vs, n) ((vs)->alloc((vs)->allocud, (mem), (n), 0))
 #define free_vector(mem, vs, typ, n) free_size(mem, vs, (n) * sizeof(typ))
 #define free_one(mem, vs, typ) free_vector(mem, vs, typ, 1)
+#define ROUND_UP(n, m) (((n) + (m) - 1) / (m) * (m))
 
-static bool verify_next(verify_state_t* vs, instruction_state_t* ins, int offset)
+#define TRACE_WORD_BITS (sizeof(unsigned long) * CHAR_BIT)
+#define TRACE_WORDS(n) (((n) + TRACE_WORD_BITS - 1) / TRACE_WORD_BITS)
+
+#if defined(__GNUC__)
+#define lowest_bit(w) ((size_t)__builtin_ctzl(w))
+#else
+static size_t lowest_bit(unsigned long w)
 {
-    ++offset; /* make relative to ins, rather than next-pc */
+    size_t n = 0;
+    while((w & 1) == 0)
+    {
+        w >>= 1;
+        ++n;
+    }
+    return n;
+}
+#endif
 
-    if(!ins->seen)
+/* Mark the instruction at `pc' as needing tracing. */
+static void trace_add(verify_state_t* vs, size_t pc)
+{
+    size_t word = pc / TRACE_WORD_BITS;
+    vs->trace_bits[word] |= 1UL << (pc % TRACE_WORD_BITS);
+    if(word < vs->trace_first)
+        vs->trace_first = word;
+    /* A jump back to the head of the loop being traced can land in an
+       earlier word. trace_find never searches before the head, so lowering
+       this for instructions outside the loop is harmless. */
+    if(word < vs->trace_loop_first)
+        vs->trace_loop_first = word;
+}
+
+/* Find the lowest instruction in the range [first, last] which needs
+   tracing, starting the search at word `word'. */
+static bool trace_find(verify_state_t* vs, size_t word, size_t first,
+                       size_t last, size_t* pc)
+{
+    size_t lastword = last / TRACE_WORD_BITS;
+    if(word < first / TRACE_WORD_BITS)
+        word = first / TRACE_WORD_BITS;
+    for(; word <= lastword; ++word)
     {
-        int ins_off = (int)(ins - vs->instruction_states);
-        if(offset < 0)
+        unsigned long bits = vs->trace_bits[word];
+        if(word == first / TRACE_WORD_BITS)
+            bits &= ~0UL << (first % TRACE_WORD_BITS);
+        if(word == lastword && last % TRACE_WORD_BITS != TRACE_WORD_BITS - 1)
+            bits &= (1UL << (last % TRACE_WORD_BITS + 1)) - 1;
+        if(bits != 0)
         {
-            offset = -offset;
-            if(offset <= 0)
-                return false;
-            if(offset > ins_off)
-                return false;
-            offset = -offset;
+            *pc = word * TRACE_WORD_BITS + lowest_bit(bits);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Take the next instruction which needs tracing, returning false if there
+   are none. This is the lowest such instruction, unless the innermost loop
+   being traced has not yet reached a fixed point. */
+static bool trace_take(verify_state_t* vs, size_t* pc)
+{
+    size_t word, lowest;
+    unsigned int loop = vs->trace_loop;
+
+    for(word = vs->trace_first; word < vs->trace_words; ++word)
+    {
+        if(vs->trace_bits[word] != 0)
+            break;
+    }
+    vs->trace_first = word;
+    if(word == vs->trace_words)
+        return false;
+    lowest = word * TRACE_WORD_BITS + lowest_bit(vs->trace_bits[word]);
+    *pc = lowest;
+
+    while(loop != 0 && lowest < vs->loops[loop - 1].head)
+    {
+        const verify_loop_t* l = vs->loops + loop - 1;
+        if(loop == vs->trace_loop)
+        {
+            if(trace_find(vs, vs->trace_loop_first, l->head, l->end, pc))
+                break;
+        }
+        else if(trace_find(vs, 0, l->head, l->end, pc))
+            break;
+        loop = l->parent;
+    }
+
+    word = *pc / TRACE_WORD_BITS;
+    vs->trace_bits[word] &= ~(1UL << (*pc % TRACE_WORD_BITS));
+    if(vs->loop_of[*pc] != vs->trace_loop)
+    {
+        vs->trace_loop = vs->loop_of[*pc];
+        vs->trace_loop_first = 0;
+    }
+    else
+        vs->trace_loop_first = word;
+    return true;
+}
+
+/*
+** Fill in verify_state::loops and verify_state::loop_of for the prototype
+** being verified, from the jumps to earlier instructions. Loops which overlap
+** without nesting are trimmed to fit inside the enclosing loop, which only
+** affects the order of tracing, not its outcome.
+*/
+static void find_loops(verify_state_t* vs)
+{
+    size_t n = vs->prototype->numinstructions, pc;
+    unsigned int numloops = 0, loop = 0, end;
+
+    /* First, record the last instruction which jumps back to each head. */
+    memset(vs->loop_of, 0, n * sizeof(unsigned int));
+    for(pc = 0; pc < n; ++pc)
+    {
+        int op = vs->ins_op[pc];
+        if(op == OP_JMP || op == OP_FORLOOP || op == OP_TFORLOOP)
+        {
+            long target = (long)pc + 1 + vs->ins_b[pc];
+            if(target >= 0 && (size_t)target <= pc)
+                vs->loop_of[target] = (unsigned int)pc + 1;
+        }
+    }
+
+    /* Then sweep forwards, opening and closing loops. */
+    for(pc = 0; pc < n; ++pc)
+    {
+        while(loop != 0 && vs->loops[loop - 1].end < pc)
+            loop = vs->loops[loop - 1].parent;
+        end = vs->loop_of[pc];
+        if(end != 0 && (loop == 0
+        || vs->loops[loop - 1].depth < VERIFY_MAX_LOOP_DEPTH))
+        {
+            verify_loop_t* l = vs->loops + numloops;
+            l->head = (unsigned int)pc;
+            l->end = end - 1;
+            l->parent = loop;
+            l->depth = 1;
+            if(loop != 0)
+            {
+                if(l->end > vs->loops[loop - 1].end)
+                    l->end = vs->loops[loop - 1].end;
+                l->depth += vs->loops[loop - 1].depth;
+            }
+            loop = ++numloops;
+        }
+        vs->loop_of[pc] = loop;
+    }
+}
+
+#if defined(__GNUC__)
+#define FORCE_INLINE __inline__ __attribute__((always_inline))
+#else
+#define FORCE_INLINE
+#endif
+
+/* The values of the successors column of LBCV_OPCODES. */
+enum successors
+{
+    SUCC_NONE,
+    SUCC_NEXT,
+    SUCC_JUMP,
+    SUCC_SKIP,
+    SUCC_LOOP,
+    SUCC_COND
+};
+
+#define OPCODE_SUCCESSORS(name, t, a, b, c, m, successors) SUCC_##successors,
+
+static const unsigned char opcode_successors[NUM_OPCODES] = {
+    LBCV_OPCODES(OPCODE_SUCCESSORS)
+};
+
+/* The successors of `op', where an unknown opcode has none. */
+#define OP_SUCCESSORS(op) \
+    ((op) < NUM_OPCODES ? (int)opcode_successors[op] : SUCC_NONE)
+
+/*
+** Find the instructions which an instruction with the given successors can
+** continue to, as offsets from the instruction after it, in the order in
+** which schedule_next() visits them. Returns the number of offsets stored
+** into `offsets', which must have room for two.
+*/
+static FORCE_INLINE int successor_offsets(int successors, int b, int c,
+                                          int* offsets)
+{
+    switch(successors)
+    {
+    case SUCC_NEXT:
+        offsets[0] = 0;
+        return 1;
+
+    case SUCC_JUMP:
+        offsets[0] = b;
+        return 1;
+
+    case SUCC_SKIP:
+        offsets[0] = 1;
+        offsets[1] = 0;
+        return 2;
+
+    case SUCC_LOOP:
+        offsets[0] = 0;
+        offsets[1] = b;
+        return 2;
+
+    case SUCC_COND:
+        offsets[0] = c;
+        return 1;
+
+    default:
+        return 0;
+    }
+}
+
+/* Whether an instruction with the given successors ends a basic block. */
+#define ENDS_BLOCK(n, offsets) ((n) != 1 || (offsets)[0] != 0)
+
+/*
+** Set instruction_state::leader for every instruction of the prototype being
+** verified, returning the number of leaders. Successors which lie outside the
+** instruction list are left for verify_next() to reject.
+*/
+static size_t find_leaders(verify_state_t* vs)
+{
+    size_t n = vs->prototype->numinstructions, pc, numleaders = 1;
+    instruction_state_t* states = vs->instruction_states;
+
+    states[0].leader = true;
+    for(pc = 0; pc < n; ++pc)
+    {
+        int offsets[2], num, i;
+        num = successor_offsets(OP_SUCCESSORS(vs->ins_op[pc]), vs->ins_b[pc],
+            vs->ins_c[pc], offsets);
+        if(!ENDS_BLOCK(num, offsets))
+            continue;
+        if(pc + 1 < n && !states[pc + 1].leader)
+        {
+            states[pc + 1].leader = true;
+            ++numleaders;
+        }
+        for(i = 0; i < num; ++i)
+        {
+            long target = (long)pc + 1 + offsets[i];
+            if(target >= 0 && (size_t)target < n && !states[target].leader)
+            {
+                states[target].leader = true;
+                ++numleaders;
+            }
+        }
+    }
+    return numleaders;
+}
+
+size_t verify_reg_states_size(decoded_prototype_t* prototype)
+{
+    /* Each instruction which ends a block makes at most two leaders: the
+       instruction after it, and a branch target. The instruction after a
+       test is the jump which is the other target. */
+    size_t numleaders = 1, i;
+    size_t size = SIZEOF_reg_state_t_numregs(prototype->numregs);
+    for(i = 0; i < prototype->numinstructions; ++i)
+    {
+        int op, a, b, c, offsets[2], num;
+        if(prototype->instructionsize == 4 && sizeof(unsigned int) == 4)
+        {
+            /* Common instruction size; only the fields which decide the
+               successors are needed, so skip the general decoder. */
+            unsigned int ins;
+            memcpy(&ins, prototype->code + i * 4, 4);
+            op = (int)((ins >> POS_OP) & ((1 << SIZE_OP) - 1));
+            b = (int)((ins >> POS_Bx) & MAXARG_Bx) - MAXARG_sBx;
+            c = (int)((ins >> POS_C) & MAXARG_C);
         }
         else
         {
-            if((size_t)(ins_off + offset) >= vs->prototype->numinstructions)
-                return false;
+            /* An unknown opcode ends a block, as it has no successors. */
+            decode_instruction(prototype, i, &op, &a, &b, &c);
         }
+        num = successor_offsets(OP_SUCCESSORS(op), b, c, offsets);
+        if(ENDS_BLOCK(num, offsets))
+            numleaders += 2;
     }
+    if(numleaders > prototype->numinstructions)
+        numleaders = prototype->numinstructions;
+    /* Each leader may need a state, and up to two hash buckets, as the number
+       of buckets is rounded up to a power of two. */
+    size += 2 * sizeof(unsigned int);
+    if(numleaders > ((size_t)-1 - sizeof(reg_word_t)) / size
+    || numleaders > UINT_MAX / 2)
+        return (size_t)-1;
+    return numleaders * size + sizeof(reg_word_t);
+}
 
-    ins += offset;
-    if(ins->regs == NULL)
+static bool verify_next(verify_state_t* vs, instruction_state_t* ins, int offset)
+{
+    /* Make relative to ins, rather than next-pc. The offset was checked to
+       stay within the instruction list by verify_static(). */
+    ins += offset + 1;
+    if(!ins->leader)
     {
-        ins->regs = (reg_state_t*)(vs->reg_states + (ins - vs->instruction_states) * SIZEOF_reg_state_t(vs));
-        reg_state_copy(vs, ins->regs, &vs->next_regs);
+        /* Only reachable from the instruction before it, so carry on tracing
+           the block rather than recording the state. */
+        vs->fallthrough = true;
+        return true;
     }
+    if(ins->regs == NULL)
+        ins->regs = reg_state_intern(vs, vs->next_state);
+    else if(ins->regs == vs->next_state)
+        return true; /* the same interned state, so nothing to merge */
     else
     {
-        switch(reg_state_merge(vs, ins->regs, &vs->next_regs))
+        ++vs->nummerges;
+        switch(reg_state_merge_into(vs, vs->merge_regs, ins->regs,
+            vs->next_state))
         {
         case 0:
             return false;
         case -1:
             return true; /* nothing to do */
         default:
+            /* The old state is released first, so that its slot can be
+               reused; it differs from the merged state, so cannot be the
+               state which is found or added. */
+            reg_state_release(vs, ins->regs);
+            ins->regs = reg_state_intern(vs, vs->merge_regs);
             break;
         }
     }
 
-    if(!ins->needstracing)
-    {
-        instruction_state_t** insert_at = &vs->next_to_trace;
-        ins->needstracing = true;
-        while(*insert_at && *insert_at < ins)
-            insert_at = &(**insert_at).next_to_trace;
-        ins->next_to_trace = *insert_at;
-        *insert_at = ins;
-    }
-
+    trace_add(vs, (size_t)(ins - vs->instruction_states));
     return true;
 }
 
@@ -318,26 +769,31 @@ static bool is_upvalue_valid(verify_state_t* vs, int upvalue)
     return upvalue >= 0 && (size_t)upvalue < vs->prototype->numupvalues;
 }
 
-static bool verify_static(verify_state_t* vs, instruction_state_t* ins, int op,
-                          int a, int b, int c)
+/*
+** The checks on an instruction which do not depend on the register state, or
+** on whether the instruction can ever be executed. `mode' and `successors' are
+** the opmode() and successors column of `op'.
+*/
+static FORCE_INLINE bool verify_static(verify_state_t* vs,
+                                       instruction_state_t* ins, int op,
+                                       int mode, int successors, int a,
+                                       int b, int c)
 {
-    if(op < 0 || op >= NUM_OPCODES)
-        return false;
-    if(testTMode(op) != 0)
+    if(modeT(mode) != 0)
     {
         int dummy;
         if(!check_next_op(vs, ins, OP_JMP, &dummy))
             return false;
     }
-    if(testAMode(op) != 0)
+    if(modeA(mode) != 0)
     {
         if(!is_reg_valid(vs, a))
             return false;
     }
-    switch(getBMode(op))
+    switch(modeB(mode))
     {
     case OpArgK:
-        if(getOpMode(op) == iABx)
+        if(modeOp(mode) == iABx)
             break;
         if(ISK(b))
         {
@@ -348,14 +804,14 @@ static bool verify_static(verify_state_t* vs, instruction_state_t* ins, int op,
         /* fallthrough */
 
     case OpArgR:
-        if(getOpMode(op) != iAsBx && !is_reg_valid(vs, b))
+        if(modeOp(mode) != iAsBx && !is_reg_valid(vs, b))
             return false;
         break;
         
     default:
         break;
     }
-    switch(getCMode(op))
+    switch(modeC(mode))
     {
     case OpArgK:
         if(ISK(c))
@@ -397,13 +853,17 @@ static bool verify_static(verify_state_t* vs, instruction_state_t* ins, int op,
         break;
 
     case OP_LOADNIL:
-        if(is_reg_valid(vs, a + b))
+        if(!is_reg_valid(vs, a + b))
             return false;
         break;
 
+    case OP_SETUPVAL:
+        if(!is_reg_valid(vs, a))
+            return false;
+        /* fallthrough */
+
     case OP_GETUPVAL:
     case OP_GETTABUP:
-    case OP_SETUPVAL:
         if(!is_upvalue_valid(vs, b))
             return false;
         break;
@@ -413,6 +873,11 @@ static bool verify_static(verify_state_t* vs, instruction_state_t* ins, int op,
             return false;
         break;
 
+    case OP_SETTABLE:
+        if(!is_reg_valid(vs, a))
+            return false;
+        break;
+
     case OP_SELF:
         if(!is_reg_valid(vs, a + 1))
             return false;
@@ -483,7 +948,7 @@ OP_VARARG_fallthrough:
         break;
 
     case OP_SETLIST:
-        if(!is_reg_valid(vs, a))
+        if(!is_reg_valid(vs, a + b))
             return false;
         if(c == 0)
         {
@@ -522,30 +987,77 @@ OP_VARARG_fallthrough:
         }
         break;
     }
+    {
+        /* Every instruction which can follow must exist. */
+        long pc = (long)(ins - vs->instruction_states);
+        int offsets[2], num, i;
+        num = successor_offsets(successors, b, c, offsets);
+        for(i = 0; i < num; ++i)
+        {
+            long target = pc + 1 + offsets[i];
+            if(target < 0 || target >= (long)vs->prototype->numinstructions)
+                return false;
+        }
+    }
     return true;
 }
 
-static bool simulate_instruction(verify_state_t* vs, instruction_state_t* ins,
-                                 int op, int a, int b, int c)
+/* Whether an instruction leaves every register as it was. */
+static FORCE_INLINE bool preserves_regs(int op, int a)
+{
+    switch(op)
+    {
+    case OP_SETTABUP:
+    case OP_SETUPVAL:
+    case OP_SETTABLE:
+    case OP_EQ:
+    case OP_LT:
+    case OP_LE:
+    case OP_TEST:
+        return true;
+
+    case OP_JMP:
+        return a == 0;
+
+    default:
+        return false;
+    }
+}
+
+/*
+** Simulate an instruction on `regs', leaving the register state which it
+** continues with in verify_state::next_state. `mode' is the opmode() of `op'.
+*/
+static FORCE_INLINE bool simulate_instruction(verify_state_t* vs,
+                                              instruction_state_t* ins,
+                                              reg_state_t* regs, int op,
+                                              int mode, int a, int b, int c)
 {
-    reg_state_copy(vs, &vs->next_regs, ins->regs);
     /* A debug hook could have fired after the prior instruction, causing
      everything above "top" to be invalidated. Alternatively, a metamethod may
      have fired as part of the prior instruction, which would have the same
-     effect. */
-    reg_state_unsetknowntop(vs, &vs->next_regs, ins->regs->top_base);
+     effect. With no open top, there is nothing to invalidate, so an
+     instruction which changes no register carries on with `regs' itself. */
+    if(preserves_regs(op, a) && regs->top_base >= vs->prototype->numregs)
+        vs->next_state = regs;
+    else
+    {
+        reg_state_copy(vs, vs->next_regs, regs);
+        reg_state_unsetknowntop(vs, vs->next_regs, regs->top_base);
+        vs->next_state = vs->next_regs;
+    }
 
     /* Common behaviour: reading from R(B) or R(C) */
-    if(getOpMode(op) == iABC)
+    if(modeOp(mode) == iABC)
     {
-        if((getBMode(op) == OpArgR) || (getBMode(op) == OpArgK && !ISK(b)))
+        if((modeB(mode) == OpArgR) || (modeB(mode) == OpArgK && !ISK(b)))
         {
-            if(!reg_state_isknown(ins->regs, (reg_index_t)b))
+            if(!reg_state_isknown(regs, (reg_index_t)b))
                 return false;
         }
-        if((getCMode(op) == OpArgR) || (getCMode(op) == OpArgK && !ISK(c)))
+        if((modeC(mode) == OpArgR) || (modeC(mode) == OpArgK && !ISK(c)))
         {
-            if(!reg_state_isknown(ins->regs, (reg_index_t)c))
+            if(!reg_state_isknown(regs, (reg_index_t)c))
                 return false;
         }
     }
@@ -553,32 +1065,35 @@ static bool simulate_instruction(verify_state_t* vs, instruction_state_t* ins,
     switch(op)
     {
     case OP_MOVE:
-        if(!reg_state_move(&vs->next_regs, (reg_index_t)a, (reg_index_t)b))
+        if(!reg_state_move(vs->next_regs, (reg_index_t)a, (reg_index_t)b))
             return false;
         break;
 
     case OP_LOADKX:
-        decode_instruction(vs->prototype, 1 + (size_t)(ins -
-            vs->instruction_states), &c, &b, &c, &c);
+        b = vs->ins_a[1 + (size_t)(ins - vs->instruction_states)];
+        /* fallthrough */
 
     case OP_LOADK:
-        reg_state_assignment(&vs->next_regs, (reg_index_t)a,
+        reg_state_assignment(vs->next_regs, (reg_index_t)a,
             vs->prototype->constant_types[b]);
         break;
 
     case OP_LOADNIL:
         do {
-            reg_state_assignment(&vs->next_regs, (reg_index_t)(a + b), LUA_TNIL);
+            reg_state_assignment(vs->next_regs, (reg_index_t)(a + b), LUA_TNIL);
         } while(b--);
         break;
 
+    case OP_SETUPVAL:
     case OP_SETTABLE:
-        if(!reg_state_isknown(ins->regs, (reg_index_t)a))
+        /* verify_prototype_static() has already checked that `a' lies within
+           the register window, so it is safe to read. */
+        if(!reg_state_isknown(regs, (reg_index_t)a))
             return false;
         break;
 
     case OP_NEWTABLE:
-        reg_state_settable(&vs->next_regs, (reg_index_t)a);
+        reg_state_settable(vs->next_regs, (reg_index_t)a);
         break;
 
     case OP_ADD:
@@ -587,134 +1102,134 @@ static bool simulate_instruction(verify_state_t* vs, instruction_state_t* ins,
     case OP_DIV:
     case OP_MOD:
     case OP_POW:
-        reg_state_setknown(&vs->next_regs, (reg_index_t)a);
-        reg_state_unsettable(&vs->next_regs, (reg_index_t)a);
-        if(rk_type(vs, ins->regs, b) == LUA_TNUMBER
-        && rk_type(vs, ins->regs, c) == LUA_TNUMBER)
-            reg_state_setnumber(&vs->next_regs, (reg_index_t)a);
+        reg_state_setknown(vs->next_regs, (reg_index_t)a);
+        reg_state_unsettable(vs->next_regs, (reg_index_t)a);
+        if(rk_type(vs, regs, b) == LUA_TNUMBER
+        && rk_type(vs, regs, c) == LUA_TNUMBER)
+            reg_state_setnumber(vs->next_regs, (reg_index_t)a);
         else
-            reg_state_unsetnumber(&vs->next_regs, (reg_index_t)a);
+            reg_state_unsetnumber(vs->next_regs, (reg_index_t)a);
         break;
     
     case OP_UNM:
-        reg_state_setknown(&vs->next_regs, (reg_index_t)a);
-        reg_state_unsettable(&vs->next_regs, (reg_index_t)a);
-        if(reg_state_isnumber(ins->regs, (reg_index_t)b))
-            reg_state_setnumber(&vs->next_regs, (reg_index_t)a);
+        reg_state_setknown(vs->next_regs, (reg_index_t)a);
+        reg_state_unsettable(vs->next_regs, (reg_index_t)a);
+        if(reg_state_isnumber(regs, (reg_index_t)b))
+            reg_state_setnumber(vs->next_regs, (reg_index_t)a);
         else
-            reg_state_unsetnumber(&vs->next_regs, (reg_index_t)a);
+            reg_state_unsetnumber(vs->next_regs, (reg_index_t)a);
         break;
 
     case OP_CONCAT:
-        if(!reg_state_areknown(ins->regs, b, c - b + 1))
+        if(!reg_state_areknown(regs, b, c - b + 1))
             return false;
-        reg_state_assignment(&vs->next_regs, (reg_index_t)a, LUA_TNONE);
+        reg_state_assignment(vs->next_regs, (reg_index_t)a, LUA_TNONE);
         break;
 
     case OP_TEST:
-        if(!reg_state_isknown(ins->regs, (reg_index_t)a))
+        if(!reg_state_isknown(regs, (reg_index_t)a))
             return false;
         break;
 
     case OP_CALL:
-        reg_state_unsetknowntop(vs, &vs->next_regs, (reg_index_t)(a+1));
+        reg_state_unsetknowntop(vs, vs->next_regs, (reg_index_t)(a+1));
         if(c == 0)
-            reg_state_settop(vs, &vs->next_regs, (reg_index_t)a);
+            reg_state_settop(vs, vs->next_regs, (reg_index_t)a);
         else
         {
             for(c -= 2; c >= 0; --c)
-                reg_state_assignment(&vs->next_regs, (reg_index_t)(a+c),
+                reg_state_assignment(vs->next_regs, (reg_index_t)(a+c),
                     LUA_TNONE);
         }
         goto OP_TAILCALL_fallthrough;
 
     case OP_TAILCALL:
-        reg_state_unsetknowntop(vs, &vs->next_regs, (reg_index_t)(a+1));
-        reg_state_settop(vs, &vs->next_regs, (reg_index_t)a);
+        reg_state_unsetknowntop(vs, vs->next_regs, (reg_index_t)(a+1));
+        reg_state_settop(vs, vs->next_regs, (reg_index_t)a);
 OP_TAILCALL_fallthrough:
         if(b == 0)
         {
-            if(!reg_state_usetop(ins->regs, (reg_index_t)(a+1)))
+            if(!reg_state_usetop(regs, (reg_index_t)(a+1)))
                 return false;
-            if(!reg_state_isknown(ins->regs, (reg_index_t)a))
+            if(!reg_state_isknown(regs, (reg_index_t)a))
                 return false;
         }
         else
         {
-            if(!reg_state_areknown(ins->regs, (reg_index_t)a, b))
+            if(!reg_state_areknown(regs, (reg_index_t)a, b))
                 return false;
         }
-        if(reg_state_areopen(ins->regs, (reg_index_t)a, vs->prototype->numregs - a))
+        if(reg_state_areopen(regs, (reg_index_t)a, vs->prototype->numregs - a))
             return false;
         if(op == OP_CALL && c != 0)
-            reg_state_settop(vs, &vs->next_regs, vs->prototype->numregs);
+            reg_state_settop(vs, vs->next_regs, vs->prototype->numregs);
         break;
 
     case OP_RETURN:
         if(b == 0)
         {
-            if(!reg_state_usetop(ins->regs, (reg_index_t)a))
+            if(!reg_state_usetop(regs, (reg_index_t)a))
                 return false;
         }
         else
         {
-            if(!reg_state_areknown(ins->regs, (reg_index_t)a, b - 1))
+            if(!reg_state_areknown(regs, (reg_index_t)a, b - 1))
                 return false;
         }
         break;
 
     case OP_FORLOOP:
-        if(!reg_state_isnumber(ins->regs, (reg_index_t)a))
+        if(!reg_state_isnumber(regs, (reg_index_t)a))
             return false;
-        if(!reg_state_isnumber(ins->regs, (reg_index_t)(a+1)))
+        if(!reg_state_isnumber(regs, (reg_index_t)(a+1)))
             return false;
-        if(!reg_state_isnumber(ins->regs, (reg_index_t)(a+2)))
+        if(!reg_state_isnumber(regs, (reg_index_t)(a+2)))
             return false;
         break;
 
     case OP_FORPREP:
         for(c = 0; c < 3; ++c)
         {
-            if(!reg_state_isknown(ins->regs, (reg_index_t)(a+c)))
+            if(!reg_state_isknown(regs, (reg_index_t)(a+c)))
                 return false;
             /* There is a runtime check that the value is a number. */
-            reg_state_setnumber(&vs->next_regs, (reg_index_t)(a+c));
+            reg_state_setnumber(vs->next_regs, (reg_index_t)(a+c));
         }
         break;
 
     case OP_TFORCALL:
-        reg_state_unsetknowntop(vs, &vs->next_regs, (reg_index_t)(a+4));
-        if(reg_state_areopen(ins->regs, (reg_index_t)(a+3), vs->prototype->numregs - a - 3))
+        reg_state_unsetknowntop(vs, vs->next_regs, (reg_index_t)(a+4));
+        if(reg_state_areopen(regs, (reg_index_t)(a+3), vs->prototype->numregs - a - 3))
             return false;
-        if(!reg_state_areknown(ins->regs, (reg_index_t)a, 3))
+        if(!reg_state_areknown(regs, (reg_index_t)a, 3))
             return false;
         for(c += 2; c >= 3; --c)
-            reg_state_assignment(&vs->next_regs, (reg_index_t)(a+c), LUA_TNONE);
+            reg_state_assignment(vs->next_regs, (reg_index_t)(a+c), LUA_TNONE);
         /* fallthrough */
 
     case OP_TFORLOOP:
-        if(!reg_state_isknown(ins->regs, (reg_index_t)(a+1)))
+        if(!reg_state_isknown(regs, (reg_index_t)(a+1)))
             return false;
         break;
 
     case OP_SETLIST:
-        if(!reg_state_istable(ins->regs, (reg_index_t)a))
+        if(!reg_state_istable(regs, (reg_index_t)a))
             return false;
         if(b == 0)
         {
-            if(!reg_state_usetop(ins->regs, (reg_index_t)a))
+            if(!reg_state_usetop(regs, (reg_index_t)a))
                 return false;
         }
-        if(!reg_state_areknown(ins->regs, (reg_index_t)(a+1), b))
+        if(!reg_state_areknown(regs, (reg_index_t)(a+1), b))
             return false;
-        reg_state_settop(vs, &vs->next_regs, vs->prototype->numregs);
+        reg_state_settop(vs, vs->next_regs, vs->prototype->numregs);
         break;
 
     case OP_JMP:
         if(a)
         {
             for(--a; (size_t)a < vs->prototype->numregs; ++a)
-                reg_state_unsetopen(&vs->next_regs, (reg_index_t)a);
+                reg_state_unsetopen(vs->next_regs, (reg_index_t)a);
         }
         break;
 
@@ -722,205 +1237,743 @@ OP_TAILCALL_fallthrough:
         {
             decoded_prototype_t* proto = vs->prototype->prototypes[b];
             size_t i;
-            reg_state_assignment(&vs->next_regs, (reg_index_t)a, LUA_TFUNCTION);
+            reg_state_assignment(vs->next_regs, (reg_index_t)a, LUA_TFUNCTION);
             for(i = 0; i < proto->numupvalues; ++i)
             {
                 if(!proto->upvalue_instack[i])
                     continue;
-                /* Uses vs->next_regs, rather than ins->regs, as the newly
+                /* Uses vs->next_regs, rather than regs, as the newly
                  created closure might be used as an upvalue. */
-                if(!reg_state_isknown(&vs->next_regs, proto->upvalue_index[i]))
+                if(!reg_state_isknown(vs->next_regs, proto->upvalue_index[i]))
                     return false;
-                reg_state_setopen(&vs->next_regs, proto->upvalue_index[i]);
+                reg_state_setopen(vs->next_regs, proto->upvalue_index[i]);
             }
         }
         break;
 
     case OP_VARARG:
         if(b == 0)
-            reg_state_settop(vs, &vs->next_regs, (reg_index_t)a);
+            reg_state_settop(vs, vs->next_regs, (reg_index_t)a);
         for(b -= 2; b >= 0; --b)
-            reg_state_assignment(&vs->next_regs, (reg_index_t)(a+b), LUA_TNONE);
+            reg_state_assignment(vs->next_regs, (reg_index_t)(a+b), LUA_TNONE);
         break;
 
     case OP_SELF:
-        if(!reg_state_move(&vs->next_regs, (reg_index_t)(a+1), (reg_index_t)b))
+        if(!reg_state_move(vs->next_regs, (reg_index_t)(a+1), (reg_index_t)b))
             return false;
         if(!ISK(c))
         {
-            if(!reg_state_isknown(&vs->next_regs, (reg_index_t)c))
+            if(!reg_state_isknown(vs->next_regs, (reg_index_t)c))
                 return false;
         }
         /* fallthrough */
 
     default:
-        if(testAMode(op) != 0)
-            reg_state_assignment(&vs->next_regs, (reg_index_t)a, LUA_TNONE);
+        if(modeA(mode) != 0)
+            reg_state_assignment(vs->next_regs, (reg_index_t)a, LUA_TNONE);
         break;
     }
     
     return true;
 }
 
-static bool schedule_next(verify_state_t* vs, instruction_state_t* ins, int op,
-                          int a, int b, int c)
+/*
+** Pass the register state on to every instruction which can follow an
+** instruction with the given successors. For a test or loop, the second
+** successor is the branch on which a register is assigned to.
+*/
+static FORCE_INLINE bool schedule_next(verify_state_t* vs,
+                                       instruction_state_t* ins, int op,
+                                       int successors, int a, int b, int c)
 {
+    int offsets[2];
+    int num = successor_offsets(successors, b, c, offsets);
+    if(num == 0)
+        return true;
+    if(!verify_next(vs, ins, offsets[0]))
+        return false;
+    if(num == 1)
+        return true;
     switch(op)
     {
-    case OP_LOADBOOL:
-        if(!verify_next(vs, ins, c))
-            return false;
-        break;
-
-    case OP_RETURN:
-        break;
-
     case OP_TESTSET:
-        if(!verify_next(vs, ins, 1))
-            return false;
-        if(!reg_state_move(&vs->next_regs, (reg_index_t)a, (reg_index_t)b))
-            return false;
-        if(!verify_next(vs, ins, 0))
+        if(!reg_state_move(vs->next_regs, (reg_index_t)a, (reg_index_t)b))
             return false;
         break;
 
     case OP_FORLOOP:
-        if(!verify_next(vs, ins, 0))
+        if(!reg_state_move(vs->next_regs, (reg_index_t)(a+3), (reg_index_t)a))
             return false;
-        if(!reg_state_move(&vs->next_regs, (reg_index_t)(a+3), (reg_index_t)a))
-            return false;
-        goto next_default_fallthrough;
+        break;
 
     case OP_TFORLOOP:
-        if(!verify_next(vs, ins, 0))
-            return false;
-        if(!reg_state_move(&vs->next_regs, (reg_index_t)a, (reg_index_t)(a+1)))
+        if(!reg_state_move(vs->next_regs, (reg_index_t)a, (reg_index_t)(a+1)))
             return false;
-        goto next_default_fallthrough;
+        break;
+    }
+    return verify_next(vs, ins, offsets[1]);
+}
 
-    default:
-next_default_fallthrough:
-        if(testTMode(op) != 0)
+/*
+** Simulate one instruction and pass the result on, with everything which
+** depends only on the opcode passed as constants, so that each handler below
+** gets its own copy with the tests on the opcode and its modes folded away.
+*/
+static FORCE_INLINE bool verify_instruction(verify_state_t* vs,
+                                            instruction_state_t* ins,
+                                            reg_state_t* regs, int op,
+                                            int mode, int successors, int a,
+                                            int b, int c)
+{
+    if(!simulate_instruction(vs, ins, regs, op, mode, a, b, c))
+        return false;
+    return schedule_next(vs, ins, op, successors, a, b, c);
+}
+
+typedef bool (*opcode_handler_t)(verify_state_t* vs, instruction_state_t* ins,
+                                 reg_state_t* regs, int a, int b, int c);
+
+typedef bool (*opcode_check_t)(verify_state_t* vs, instruction_state_t* ins,
+                               int a, int b, int c);
+
+#define OPCODE_HANDLER(name, t, amode, bmode, cmode, m, successors) \
+    static bool verify_##name(verify_state_t* vs, instruction_state_t* ins, \
+                              reg_state_t* regs, int a, int b, int c) \
+    { \
+        return verify_instruction(vs, ins, regs, OP_##name, \
+            opmode(t, amode, bmode, cmode, m), SUCC_##successors, a, b, c); \
+    } \
+    static bool check_##name(verify_state_t* vs, instruction_state_t* ins, \
+                             int a, int b, int c) \
+    { \
+        return verify_static(vs, ins, OP_##name, \
+            opmode(t, amode, bmode, cmode, m), SUCC_##successors, a, b, c); \
+    }
+
+LBCV_OPCODES(OPCODE_HANDLER)
+
+#define OPCODE_HANDLER_ENTRY(name, t, a, b, c, m, successors) verify_##name,
+#define OPCODE_CHECK_ENTRY(name, t, a, b, c, m, successors) check_##name,
+
+static const opcode_handler_t opcode_handlers[NUM_OPCODES] = {
+    LBCV_OPCODES(OPCODE_HANDLER_ENTRY)
+};
+
+static const opcode_check_t opcode_checks[NUM_OPCODES] = {
+    LBCV_OPCODES(OPCODE_CHECK_ENTRY)
+};
+
+static bool verify_step(verify_state_t* vs, size_t pc, reg_state_t* regs)
+{
+    int op;
+    instruction_state_t* ins = vs->instruction_states + pc;
+    ++vs->numtraced;
+    if(ins->seen)
+        ++vs->numretraced;
+    if(!ins->valid)
+        return false;
+    op = vs->ins_op[pc];
+
+    if(!opcode_handlers[op](vs, ins, regs, vs->ins_a[pc], vs->ins_b[pc],
+        vs->ins_c[pc]))
+        return false;
+
+    ins->seen = true;
+    return true;
+}
+
+bool verify_prototype_static(verify_state_t* vs,
+                             decoded_prototype_t* prototype)
+{
+    size_t pc, n = prototype->numinstructions;
+    instruction_state_t* states = vs->instruction_states;
+    bool entry = true;
+
+    if(n == 0)
+        return false;
+    if(prototype->numparams > prototype->numregs)
+        return false;
+    if(n > vs->max_numinstructions || n > INT_MAX)
+        return false;
+    vs->prototype = prototype;
+    decode_instructions(prototype, vs->ins_op, vs->ins_a, vs->ins_b,
+        vs->ins_c);
+
+    memset(states, 0, n * sizeof(instruction_state_t));
+    for(pc = 0; pc < n; ++pc)
+    {
+        int op = vs->ins_op[pc];
+        bool valid = op < NUM_OPCODES && opcode_checks[op](vs, states + pc,
+            vs->ins_a[pc], vs->ins_b[pc], vs->ins_c[pc]);
+        states[pc].valid = valid;
+        if(entry)
         {
-            if(!verify_next(vs, ins, 1))
+            /* Everything up to the first branch is always executed, so an
+               invalid instruction there dooms the whole prototype. */
+            if(!valid)
                 return false;
+            entry = OP_SUCCESSORS(op) == SUCC_NEXT;
         }
-
-        if(!verify_next(vs, ins, (getOpMode(op) == iAsBx) ? b : 0))
-            return false;
-        break;
     }
     return true;
 }
 
-static bool verify_step(verify_state_t* vs)
+/* How many instructions are traced between readings of the clock, as reading
+   it costs far more than tracing an instruction. */
+#define BUDGET_CLOCK_INTERVAL 256
+
+/* The value of a counter beyond which a budget has run out, given the value
+   of the counter now, the limit, and the amount already used. */
+static size_t budget_limit(size_t count, size_t limit, size_t used)
+{
+    size_t remaining;
+    if(limit == 0)
+        return (size_t)-1;
+    remaining = used < limit ? limit - used : 0;
+    return remaining > (size_t)-1 - count ? (size_t)-1 : count + remaining;
+}
+
+/* Whether the budget has run out while tracing, which is polled after every
+   traced instruction. */
+static bool budget_exhausted(verify_state_t* vs)
 {
-    int op, a, b, c;
-    instruction_state_t* ins = vs->next_to_trace;
-    vs->next_to_trace = ins->next_to_trace;
-    if(!decode_instruction(vs->prototype, (size_t)(ins - vs->instruction_states), &op, &a, &b, &c))
+    if(vs->numtraced > vs->trace_limit || vs->nummerges > vs->merge_limit
+    || (vs->budget->max_nanoseconds != 0
+        && vs->numtraced % BUDGET_CLOCK_INTERVAL == 0
+        && verify_clock() > vs->deadline))
+    {
+        vs->over_budget = true;
+        return true;
+    }
+    return false;
+}
+
+/* Trace basic blocks until there are none left to trace, or until
+   verify_state::slice instructions have been traced, in which case the
+   position is saved and DECODE_PAUSE is returned. */
+static int trace_blocks(verify_state_t* vs)
+{
+    size_t pc = vs->trace_pc;
+    reg_state_t* regs = vs->trace_regs;
+    size_t stop = budget_limit(vs->slice_start, vs->slice, 0);
+    for(;;)
+    {
+        if(regs == NULL)
+        {
+            /* Start the next basic block, from the register state recorded
+               at its leader. */
+            if(!trace_take(vs, &pc))
+                return DECODE_YIELD;
+            regs = vs->instruction_states[pc].regs;
+        }
+        vs->fallthrough = false;
+        if(!verify_step(vs, pc, regs))
+            return DECODE_UNSAFE;
+        if(vs->cancel != NULL && cancel_flag_raised(vs->cancel))
+            return DECODE_UNSAFE;
+        if(vs->budget != NULL && budget_exhausted(vs))
+            return DECODE_BUDGET;
+        if(vs->fallthrough)
+        {
+            /* Carry on with the rest of the block, from the scratch state
+               which the instruction was simulated into, if any. */
+            if(vs->next_state == vs->next_regs)
+            {
+                regs = vs->next_regs;
+                vs->next_regs = regs == vs->scratch_regs[0]
+                    ? vs->scratch_regs[1] : vs->scratch_regs[0];
+            }
+            ++pc;
+        }
+        else
+            regs = NULL;
+        if(vs->numtraced >= stop)
+        {
+            vs->slice_start = vs->numtraced;
+            vs->trace_pc = pc;
+            vs->trace_regs = regs;
+            return DECODE_PAUSE;
+        }
+    }
+}
+
+/* As trace_blocks(), but charging the work done to the budget. */
+static int trace_blocks_budgeted(verify_state_t* vs)
+{
+    verify_budget_t* budget = vs->budget;
+    size_t traced = vs->numtraced;
+    size_t merges = vs->nummerges;
+    uint64_t start = verify_clock();
+    uint64_t remaining;
+    int status;
+
+    vs->trace_limit = budget_limit(traced, budget->max_traced,
+        budget->traced);
+    vs->merge_limit = budget_limit(merges, budget->max_merges,
+        budget->merges);
+    remaining = budget->nanoseconds < budget->max_nanoseconds
+        ? budget->max_nanoseconds - budget->nanoseconds : 0;
+    if(budget->max_nanoseconds != 0 && remaining == 0)
+    {
+        /* The clock is not read again until many instructions have been
+           traced, so without this, a chunk of many small prototypes would
+           never notice its time running out. */
+        vs->over_budget = true;
+        return DECODE_BUDGET;
+    }
+    vs->deadline = remaining > UINT64_MAX - start ? UINT64_MAX
+        : start + remaining;
+    status = trace_blocks(vs);
+    budget->traced += vs->numtraced - traced;
+    budget->merges += vs->nummerges - merges;
+    budget->nanoseconds += verify_clock() - start;
+    return status;
+}
+
+/* Prepare to trace the instructions which verify_prototype_static() has
+   just checked. */
+static bool trace_begin(verify_state_t* vs)
+{
+    decoded_prototype_t* prototype = vs->prototype;
+    size_t i, numleaders, numbuckets, bucketsize;
+
+    vs->over_budget = false;
+    numleaders = find_leaders(vs);
+    numbuckets = 1;
+    while(numbuckets < numleaders)
+        numbuckets *= 2;
+    bucketsize = ROUND_UP(numbuckets * sizeof(unsigned int),
+        sizeof(reg_word_t));
+    if(bucketsize > vs->max_regs_size || numleaders
+        > (vs->max_regs_size - bucketsize) / SIZEOF_reg_state_t(vs))
         return false;
+    vs->reg_buckets = (unsigned int*)vs->reg_states;
+    vs->reg_bucket_mask = (unsigned int)(numbuckets - 1);
+    vs->reg_slots = vs->reg_states + bucketsize;
+    vs->reg_free = 0;
+    vs->numreg_states = 0;
+    memset(vs->reg_buckets, 0, numbuckets * sizeof(unsigned int));
+
+    memset(vs->merge_regs, 0, SIZEOF_reg_state_t(vs));
+    vs->merge_regs->top_base = prototype->numregs;
+    for(i = 0; i < prototype->numparams; ++i)
+        reg_state_setknown(vs->merge_regs, i);
+    vs->instruction_states[0].regs = reg_state_intern(vs, vs->merge_regs);
+    vs->trace_words = TRACE_WORDS(prototype->numinstructions);
+    memset(vs->trace_bits, 0, vs->trace_words * sizeof(unsigned long));
+    vs->trace_first = 0;
+    find_loops(vs);
+    vs->trace_loop = vs->loop_of[0];
+    vs->trace_loop_first = 0;
+    trace_add(vs, 0);
+    vs->trace_regs = NULL;
+    vs->paused = false;
+    return true;
+}
 
-    if(!ins->seen && !verify_static(vs, ins, op, a, b, c))
+/* Carry on tracing from where trace_begin() or the last pause left off. */
+static int trace_continue(verify_state_t* vs)
+{
+    int status = vs->budget == NULL ? trace_blocks(vs)
+        : trace_blocks_budgeted(vs);
+    vs->paused = status == DECODE_PAUSE;
+    return status;
+}
+
+/* Trace the instructions which verify_prototype_static() has just checked,
+   through any pauses. */
+static bool trace_prototype(verify_state_t* vs)
+{
+    int status;
+    if(!trace_begin(vs))
         return false;
+    do
+        status = trace_continue(vs);
+    while(status == DECODE_PAUSE);
+    return status == DECODE_YIELD;
+}
 
-    if(!simulate_instruction(vs, ins, op, a, b, c))
-        return false;    
+bool verify_prototype_code(verify_state_t* vs, decoded_prototype_t* prototype)
+{
+    return verify_prototype_static(vs, prototype) && trace_prototype(vs);
+}
 
-    if(!schedule_next(vs, ins, op, a, b, c))
+static bool verify_prototype(verify_state_t* vs,
+                             decoded_prototype_t* prototype)
+{
+    size_t i;
+
+    if(is_prototype_cached(vs->cache, prototype))
+        return true;
+
+    if(!verify_prototype_code(vs, prototype))
         return false;
 
-    ins->seen = true;
-    ins->needstracing = false;
+    /* Recursively verify children */
+    for(i = 0; i < prototype->numprototypes; ++i)
+    {
+        if(!verify_prototype(vs, prototype->prototypes[i]))
+            return false;
+    }
+
+    cache_prototype(vs->cache, prototype);
     return true;
 }
 
-static void find_max_size(decoded_prototype_t* prototype,
-                          unsigned int* numregs, size_t* numinstructions)
+#define FINGERPRINT_LABEL "lbcv prototype"
+
+/* Append a size to a fingerprint, in a form independent of sizeof(size_t). */
+static void fingerprint_size(chunk_hash_t* hash, size_t n)
+{
+    unsigned char buf[8];
+    int i;
+    for(i = 0; i < 8; ++i, n >>= 8)
+        buf[i] = (unsigned char)(n & 0xFF);
+    chunk_hash_update(hash, buf, sizeof(buf));
+}
+
+static void fingerprint_digest(chunk_hash_t* hash, const chunk_digest_t* d)
 {
+    unsigned char buf[16];
+    int i;
+    for(i = 0; i < 8; ++i)
+    {
+        buf[i] = (unsigned char)(d->h1 >> (i * 8));
+        buf[i + 8] = (unsigned char)(d->h2 >> (i * 8));
+    }
+    chunk_hash_update(hash, buf, sizeof(buf));
+}
+
+void fingerprint_prototype(decoded_prototype_t* prototype)
+{
+    chunk_hash_t hash;
+    unsigned char upvalue[2];
     size_t i;
-    if(*numregs < prototype->numregs)
-        *numregs = prototype->numregs;
-    if(*numinstructions < prototype->numinstructions)
-        *numinstructions = prototype->numinstructions;
+
+    /* The key is what stops bytecode from being crafted to share the
+      fingerprint of a prototype which is already cached. The label keeps a
+      fingerprint from ever being the digest of a chunk, which starts with
+      LUA_SIGNATURE instead. */
+    chunk_hash_init(&hash, chunk_key_process());
+    chunk_hash_update(&hash, (const unsigned char*)FINGERPRINT_LABEL,
+        sizeof(FINGERPRINT_LABEL) - 1);
+    fingerprint_size(&hash, prototype->numinstructions);
+    fingerprint_size(&hash, prototype->instructionsize);
+    fingerprint_size(&hash, prototype->numconstants);
+    fingerprint_size(&hash, prototype->numupvalues);
+    fingerprint_size(&hash, prototype->numprototypes);
+    fingerprint_size(&hash, prototype->numregs);
+    fingerprint_size(&hash, prototype->numparams);
+    fingerprint_size(&hash, prototype->is_vararg ? 1 : 0);
+    chunk_hash_update(&hash, prototype->code,
+        prototype->numinstructions * prototype->instructionsize);
+    chunk_hash_update(&hash, prototype->constant_types,
+        prototype->numconstants);
+    for(i = 0; i < prototype->numupvalues; ++i)
+    {
+        upvalue[0] = prototype->upvalue_instack[i] ? 1 : 0;
+        upvalue[1] = prototype->upvalue_index[i];
+        chunk_hash_update(&hash, upvalue, sizeof(upvalue));
+    }
     for(i = 0; i < prototype->numprototypes; ++i)
-        find_max_size(prototype->prototypes[i], numregs, numinstructions);
+        fingerprint_digest(&hash, &prototype->prototypes[i]->fingerprint);
+    chunk_hash_final(&hash, &prototype->fingerprint);
 }
 
-static bool verify_prototype(verify_state_t* vs,
-                             decoded_prototype_t* prototype)
+void fingerprint_tree(decoded_prototype_t* prototype)
 {
     size_t i;
+    for(i = 0; i < prototype->numprototypes; ++i)
+        fingerprint_tree(prototype->prototypes[i]);
+    fingerprint_prototype(prototype);
+}
 
-    if(prototype->numinstructions == 0)
-        return false;
-    if(prototype->numparams > prototype->numregs)
+bool is_prototype_cached(verify_cache_t* cache,
+                         decoded_prototype_t* prototype)
+{
+    int status;
+    if(cache == NULL)
         return false;
-    vs->prototype = prototype;
-
-    memset(vs->instruction_states, 0, prototype->numinstructions * sizeof(instruction_state_t));
-    vs->instruction_states[0].regs = (reg_state_t*)vs->reg_states;
+    return verify_cache_lookup(cache, &prototype->fingerprint,
+        prototype->numinstructions, &status);
+}
 
-    vs->instruction_states[0].regs->top_base = prototype->numregs;
-    for(i = 0; i < prototype->numregs; ++i)
+void cache_prototype(verify_cache_t* cache, decoded_prototype_t* prototype)
+{
+    if(cache != NULL)
     {
-        vs->instruction_states[0].regs->state_flags[i] = 0;
-        if(i < prototype->numparams)
-            reg_state_setknown(vs->instruction_states[0].regs, i);
+        verify_cache_insert(cache, &prototype->fingerprint,
+            prototype->numinstructions, true, DECODE_YIELD);
     }
-    vs->instruction_states[0].needstracing = true;
-    vs->next_to_trace = vs->instruction_states;
+}
+
+/* The register window of any prototype fits within each of
+   verify_state::scratch_regs and verify_state::merge_regs, as decoded_prototype::numregs comes from a
+   single byte. */
+#define SIZEOF_scratch_reg_state_t SIZEOF_reg_state_t_numregs(MAXARG_A)
+#define SIZEOF_verify_state_t (offsetof(verify_state_t, scratch_space) \
+    + 3 * SIZEOF_scratch_reg_state_t)
 
-    while(vs->next_to_trace)
+static void free_instruction_scratch(verify_state_t* vs)
+{
+    size_t max_numinstructions = vs->max_numinstructions;
+    if(max_numinstructions != 0)
     {
-        if(!verify_step(vs))
-            return false;
+        free_vector(vs->instruction_states, vs, instruction_state_t, max_numinstructions);
+        free_vector(vs->ins_op, vs, unsigned char, max_numinstructions);
+        free_vector(vs->ins_a, vs, int, max_numinstructions);
+        free_vector(vs->ins_b, vs, int, max_numinstructions);
+        free_vector(vs->ins_c, vs, int, max_numinstructions);
+        free_vector(vs->trace_bits, vs, unsigned long,
+            TRACE_WORDS(max_numinstructions));
+        free_vector(vs->loops, vs, verify_loop_t, max_numinstructions);
+        free_vector(vs->loop_of, vs, unsigned int, max_numinstructions);
     }
+    vs->instruction_states = NULL;
+    vs->ins_op = NULL;
+    vs->ins_a = NULL;
+    vs->ins_b = NULL;
+    vs->ins_c = NULL;
+    vs->trace_bits = NULL;
+    vs->loops = NULL;
+    vs->loop_of = NULL;
+    vs->max_numinstructions = 0;
+}
 
-    /* Recursively verify children */
-    for(i = 0; i < prototype->numprototypes; ++i)
+static void free_scratch(verify_state_t* vs)
+{
+    free_instruction_scratch(vs);
+    if(vs->max_regs_size != 0)
+        free_size(vs->reg_states, vs, vs->max_regs_size);
+    vs->reg_states = NULL;
+    vs->max_regs_size = 0;
+}
+
+/* Grow a scratch size geometrically, so that a stream of ever larger
+   prototypes does not reallocate every time. */
+static size_t grow_size(size_t current, size_t wanted)
+{
+    if(wanted / 2 < current)
+        return current * 2;
+    return wanted;
+}
+
+/*
+** Make sure that there is scratch space for decoding and tracing `n'
+** instructions. The register states are reserved separately, so that the
+** instructions can be decoded and checked before they are sized.
+*/
+static bool reserve_instructions(verify_state_t* vs, size_t n)
+{
+    if(n <= vs->max_numinstructions)
+        return true;
+    n = grow_size(vs->max_numinstructions, n);
+    if(n > (size_t)-1 / sizeof(instruction_state_t)
+    || n > (size_t)-1 / sizeof(verify_loop_t))
+        return false;
+
+    free_instruction_scratch(vs);
+    vs->max_numinstructions = n;
+    vs->instruction_states = alloc_vector(vs, instruction_state_t, n);
+    vs->ins_op = alloc_vector(vs, unsigned char, n);
+    vs->ins_a = alloc_vector(vs, int, n);
+    vs->ins_b = alloc_vector(vs, int, n);
+    vs->ins_c = alloc_vector(vs, int, n);
+    vs->trace_bits = alloc_vector(vs, unsigned long, TRACE_WORDS(n));
+    vs->loops = alloc_vector(vs, verify_loop_t, n);
+    vs->loop_of = alloc_vector(vs, unsigned int, n);
+    if(vs->instruction_states == NULL || vs->ins_op == NULL
+    || vs->ins_a == NULL || vs->ins_b == NULL || vs->ins_c == NULL
+    || vs->trace_bits == NULL || vs->loops == NULL || vs->loop_of == NULL)
     {
-        if(!verify_prototype(vs, prototype->prototypes[i]))
-            return false;
+        free_instruction_scratch(vs);
+        return false;
     }
+    return true;
+}
+
+static bool reserve_reg_states(verify_state_t* vs, size_t size)
+{
+    if(size == 0)
+        size = SIZEOF_scratch_reg_state_t;
+    if(size <= vs->max_regs_size)
+        return true;
+    size = grow_size(vs->max_regs_size, size);
+    if(size == (size_t)-1)
+        return false;
+
+    if(vs->max_regs_size != 0)
+        free_size(vs->reg_states, vs, vs->max_regs_size);
+    vs->max_regs_size = 0;
+    vs->reg_states = alloc_size(vs, size);
+    if(vs->reg_states == NULL)
+        return false;
+    vs->max_regs_size = size;
+    return true;
+}
 
+bool verify_state_reserve(verify_state_t* vs, size_t max_regs_size,
+                          size_t max_numinstructions)
+{
+    if(max_regs_size == (size_t)-1)
+        return false;
+    if(max_numinstructions == 0 && vs->max_numinstructions == 0)
+        return true;
+    if(!reserve_instructions(vs, max_numinstructions)
+    || !reserve_reg_states(vs, max_regs_size))
+    {
+        free_scratch(vs);
+        return false;
+    }
     return true;
 }
 
-bool verify(decoded_prototype_t* prototype, lua_Alloc alloc, void* ud)
+verify_state_t* verify_state_create(lua_Alloc alloc, void* ud,
+                                    size_t max_regs_size,
+                                    size_t max_numinstructions)
 {
-    bool allgood = true;
-    unsigned int max_numregs = 0;
-    size_t max_numinstructions = 0;
-    size_t max_reg_state_size;
     verify_state_t* vs;
-    find_max_size(prototype, &max_numregs, &max_numinstructions);
-    max_reg_state_size = ALIGN(sizeof(reg_state_t) + max_numregs - 1);
 
-    vs = (verify_state_t*)alloc(ud, NULL, 0, sizeof(verify_state_t) + max_numregs + ALIGN(1));
+    vs = (verify_state_t*)alloc(ud, NULL, 0, SIZEOF_verify_state_t);
     if(vs == NULL)
-        return false;
-    
+        return NULL;
+
     vs->alloc = alloc;
     vs->allocud = ud;
-    vs->instruction_states = alloc_vector(vs, instruction_state_t, max_numinstructions);
-    if(vs->instruction_states == NULL)
-        allgood = false;
+    vs->cache = NULL;
+    vs->cancel = NULL;
+    vs->numtraced = 0;
+    vs->numretraced = 0;
+    vs->nummerges = 0;
+    vs->budget = NULL;
+    vs->over_budget = false;
+    vs->slice = 0;
+    vs->slice_start = 0;
+    vs->paused = false;
+    vs->trace_regs = NULL;
+    vs->scratch_regs[0] = &vs->scratch_space;
+    vs->scratch_regs[1] = (reg_state_t*)((unsigned char*)&vs->scratch_space
+        + SIZEOF_scratch_reg_state_t);
+    vs->merge_regs = (reg_state_t*)((unsigned char*)&vs->scratch_space
+        + 2 * SIZEOF_scratch_reg_state_t);
+    vs->next_regs = vs->scratch_regs[0];
+    vs->next_state = vs->next_regs;
+    vs->peak_reg_states = 0;
+    vs->max_regs_size = 0;
+    vs->max_numinstructions = 0;
+    free_scratch(vs);
+    if(!verify_state_reserve(vs, max_regs_size, max_numinstructions))
+    {
+        verify_state_free(vs);
+        return NULL;
+    }
+    return vs;
+}
 
-    if(allgood)
+void verify_state_free(verify_state_t* vs)
+{
+    if(vs == NULL)
+        return;
+    free_scratch(vs);
+    vs->alloc(vs->allocud, (void*)vs, SIZEOF_verify_state_t, 0);
+}
+
+int verify_decoded_prototype(void* ud, decoded_prototype_t* prototype)
+{
+    verify_state_t* vs = (verify_state_t*)ud;
+    int status;
+    if(!vs->paused || vs->prototype != prototype)
     {
-        vs->reg_states = alloc_size(vs, max_numinstructions * max_reg_state_size);
-        if(vs->reg_states == NULL)
-            allgood = false;
-        else
-            allgood = verify_prototype(vs, prototype);
+        if(vs->cache != NULL)
+        {
+            /* The children have already been verified, and so have already
+              had their fingerprints computed. */
+            fingerprint_prototype(prototype);
+            if(is_prototype_cached(vs->cache, prototype))
+                return DECODE_YIELD;
+        }
+        /* Check the instructions before reserving space for the register
+           states, so that garbage is turned away without that allocation. */
+        if(!verify_state_reserve(vs, 0, prototype->numinstructions))
+            return DECODE_ERROR_MEM;
+        if(!verify_prototype_static(vs, prototype))
+            return DECODE_UNSAFE;
+        if(!verify_state_reserve(vs, verify_reg_states_size(prototype),
+            prototype->numinstructions))
+            return DECODE_ERROR_MEM;
+        if(!trace_begin(vs))
+            return DECODE_UNSAFE;
     }
+    status = trace_continue(vs);
+    if(status == DECODE_YIELD)
+        cache_prototype(vs->cache, prototype);
+    return status;
+}
 
-    /* Cleanup */
-    free_size(vs->reg_states, vs, max_numinstructions * max_reg_state_size);
-    free_vector(vs->instruction_states, vs, instruction_state_t, max_numinstructions);
+void find_max_size(decoded_prototype_t* prototype, size_t* regs_size,
+                   size_t* numinstructions)
+{
+    size_t i, size = verify_reg_states_size(prototype);
+    if(*regs_size < size)
+        *regs_size = size;
+    if(*numinstructions < prototype->numinstructions)
+        *numinstructions = prototype->numinstructions;
+    for(i = 0; i < prototype->numprototypes; ++i)
+        find_max_size(prototype->prototypes[i], regs_size, numinstructions);
+}
 
-    alloc(ud, (void*)vs, sizeof(verify_state_t) + max_numregs - ALIGN(1), 0);
+bool verify(decoded_prototype_t* prototype, lua_Alloc alloc, void* ud)
+{
+    return verify_cached(prototype, alloc, ud, NULL);
+}
+
+bool verify_cached(decoded_prototype_t* prototype, lua_Alloc alloc, void* ud,
+                   verify_cache_t* cache)
+{
+    return verify_budgeted(prototype, alloc, ud, cache, NULL) == DECODE_YIELD;
+}
 
-    return allgood;
+int verify_budgeted(decoded_prototype_t* prototype, lua_Alloc alloc, void* ud,
+                    verify_cache_t* cache, verify_budget_t* budget)
+{
+    int status;
+    size_t max_regs_size = 0;
+    size_t max_numinstructions = 0;
+    verify_state_t* vs;
+    find_max_size(prototype, &max_regs_size, &max_numinstructions);
+
+    if(cache != NULL)
+        fingerprint_tree(prototype);
+
+    vs = verify_state_create(alloc, ud, max_regs_size, max_numinstructions);
+    if(vs == NULL)
+        return DECODE_ERROR_MEM;
+    vs->cache = cache;
+    vs->budget = budget;
+    if(verify_prototype(vs, prototype))
+        status = DECODE_YIELD;
+    else
+        status = vs->over_budget ? DECODE_BUDGET : DECODE_UNSAFE;
+    verify_state_free(vs);
+
+    return status;
+}
+
+uint64_t verify_clock(void)
+{
+#if defined(LBCV_USE_PTHREADS) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+#ifdef LBCV_USE_PTHREADS
+    {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return (uint64_t)tv.tv_sec * 1000000000u + (uint64_t)tv.tv_usec * 1000u;
+    }
+#else
+    /* Without threads, processor time is as good as wall-clock time. */
+    return (uint64_t)((double)clock() * (1e9 / CLOCKS_PER_SEC));
+#endif
 }
@@ -21,30 +21,86 @@ SOFTWARE. */
 #ifndef _LBCV_VERIFIER_H_
 #define _LBCV_VERIFIER_H_
 #include <lua.h>
+#include <stdint.h>
 #include "defs.h"
 #include "decoder.h"
+#include "vcache.h"
+
+/**
+ * The version of the rules which the verifier applies. This must be increased
+ * whenever a change to the verifier could change whether or not some bytecode
+ * is accepted, so that records of bytecode accepted by an older verifier
+ * (see fcache.h) are no longer trusted.
+ */
+#define VERIFIER_RULES_VERSION 2
+
+/**
+ * The deepest nesting of loops which influences the order in which
+ * instructions are traced; any loops nested more deeply are treated as part of
+ * the loop which encloses them.
+ */
+#define VERIFY_MAX_LOOP_DEPTH 32
+
+/**
+ * A flag which one thread raises while other threads poll it, as used by
+ * verify_state::cancel. Nothing else is published through the flag, so
+ * relaxed ordering suffices, but it must still be atomic, as otherwise the
+ * concurrent access is a data race. Compilers without C11 atomics fall back
+ * to a volatile flag.
+ */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L \
+    && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+typedef atomic_bool cancel_flag_t;
+#define cancel_flag_init(flag) atomic_init(flag, false)
+#define cancel_flag_raise(flag) \
+    atomic_store_explicit(flag, true, memory_order_relaxed)
+#define cancel_flag_raised(flag) \
+    atomic_load_explicit(flag, memory_order_relaxed)
+#else
+typedef volatile bool cancel_flag_t;
+#define cancel_flag_init(flag) (*(flag) = false)
+#define cancel_flag_raise(flag) (*(flag) = true)
+#define cancel_flag_raised(flag) (*(flag))
+#endif
 
 /** Tracking of register state.
  * Every register in the register window of a prototype, at every point in the
- * instruction list, has zero or more of these flags set.
+ * instruction list, has zero or more of the following properties. Each
+ * property is stored as a plane of bits, with one bit per register, so that
+ * whole register states can be merged and tested a word at a time.
  */
 
 /* The register can be read from and turned into an upvalue. */
-#define REG_VALUEKNOWN  0x1
+#define REG_VALUEKNOWN  0
 
 /* The register is an open upvalue. */
-#define REG_OPENUPVALUE 0x2
+#define REG_OPENUPVALUE 1
 
 /* The register definitely contains a table value. */
-#define REG_ISTABLE     0x4
+#define REG_ISTABLE     2
 
 /* The register definitely contains a number value. */
-#define REG_ISNUMBER    0x8
+#define REG_ISNUMBER    3
 
-#define REG_TYPE_MASK (REG_ISTABLE | REG_ISNUMBER)
+#define REG_NUMPLANES   4
 
 typedef unsigned int reg_index_t;
 
+/**
+ * The unit in which register state bit-planes are stored.
+ */
+typedef uint64_t reg_word_t;
+
+#define REG_WORD_BITS 64
+
+/**
+ * The number of reg_word_t needed for each bit-plane of a prototype with
+ * @p numregs registers. As decoded_prototype::numregs comes from a single
+ * byte, this is never more than four.
+ */
+#define REG_STATE_WORDS(numregs) ((size_t)(numregs) / REG_WORD_BITS + 1)
+
 /**
  * Container for the state of every virtual machine register at a specific
  * point of execution.
@@ -65,17 +121,40 @@ struct reg_state
      */
     reg_index_t top_base;
 
+    /**
+     * For a state interned in verify_state::reg_states, the number of leaders
+     * whose state it is. Interned states are shared, and never modified.
+     */
+    unsigned int refs;
+
+    /**
+     * For an interned state, a hash of reg_state::top_base and
+     * reg_state::planes.
+     */
+    unsigned int hash;
+
+    /**
+     * For an interned state, one more than the index of the next state with
+     * the same hash bucket, or 0. For a free slot, one more than the index of
+     * the next free slot, or 0.
+     */
+    unsigned int next;
+
     /**
      * The state of every virtual machine register.
      *
-     * The state of each register is represented by a single byte, which will
-     * be a combination of zero or more of the following flags: REG_VALUEKNOWN,
-     * REG_OPENUPVALUE, REG_ISTABLE, REG_ISNUMBER.
+     * The bit for register r in the plane for property p (one of
+     * REG_VALUEKNOWN, REG_OPENUPVALUE, REG_ISTABLE, REG_ISNUMBER) is bit
+     * (r % REG_WORD_BITS) of planes[(r / REG_WORD_BITS) * REG_NUMPLANES + p].
+     * Interleaving the planes like this means that a single register can be
+     * found without knowing how many registers there are.
      *
-     * The length of this array will be decoded_prototype::numregs of the
-     * verify_state::prototype of the enclosing verify_state_t.
+     * The length of this array will be REG_STATE_WORDS() of
+     * decoded_prototype::numregs of the verify_state::prototype of the
+     * enclosing verify_state_t, multiplied by REG_NUMPLANES. Bits for
+     * registers beyond the register window are always clear.
      */
-    unsigned char state_flags[1];
+    reg_word_t planes[1];
 };
 typedef struct reg_state reg_state_t;
 
@@ -130,47 +209,108 @@ void reg_state_assignment(reg_state_t* state, reg_index_t reg, int type);
 struct instruction_state
 {
     /**
-     * Indication of whether or not the instruction is in the list of
-     * instructions which need tracing.
-     *
-     * This will be @c true if (and only if) the instruction is part of the
-     * linked list starting at verify_state::next_to_trace.
+     * Indication of whether or not the instruction starts a basic block,
+     * being the first instruction, the target of a branch, or following an
+     * instruction which can continue somewhere other than the next
+     * instruction. Every other instruction can only be reached from the
+     * instruction before it.
      */
-    bool needstracing;
+    bool leader;
 
     /**
-     * Indication of whether or not static verification of the instruction
-     * has been performed yet.
-     *
-     * Each instruction that might be executed will get statically verified
-     * once, and will subsequently have this field set to @c true. If this
-     * field is @c false, that means that the instruction either never gets
-     * executed, or has not yet been visited at all by the tracing process.
+     * Indication of whether or not the instruction passed the checks made by
+     * verify_prototype_static(), which do not depend on the register state.
+     * An instruction which did not is only a problem if it can be executed,
+     * so is rejected once it is traced.
+     */
+    bool valid;
+
+    /**
+     * Indication of whether or not the instruction has been traced yet. If
+     * this field is @c false, that means that the instruction either never
+     * gets executed, or has not yet been visited at all by the tracing
+     * process.
      */
     bool seen;
 
     /**
      * State of the virtual machine registers prior to the execution of the
-     * instruction.
+     * instruction, if it is a leader.
      *
      * If there are multiple code paths to the instruction, then this will be
      * the state which is common across all code paths (it will start as the
      * state from one path, and then as subsequent paths are discovered, it
      * will be updated). If the instruction has not yet been visited by the
-     * tracer, then this field will be @c NULL.
+     * tracer, or is not a leader, then this field will be @c NULL. The state
+     * prior to any other instruction only exists while its basic block is
+     * being traced.
      */
     reg_state_t* regs;
+};
+typedef struct instruction_state instruction_state_t;
 
+/**
+ * A loop in the code of a prototype, found from a jump to an earlier (or the
+ * same) instruction. As every cycle in the control flow contains such a jump,
+ * instruction order is a reverse postorder of the rest of the control flow,
+ * and so each loop is taken to be the range of instructions from the target
+ * of the jump to the jump itself.
+ */
+struct verify_loop
+{
     /**
-     * Link to next instruction in the linked list of instructions which need
-     * to be traced.
-     *
-     * If instruction_state::needstracing is @c false, then the value of this
-     * field is undefined.
+     * The index of the first instruction of the loop.
+     */
+    unsigned int head;
+    /**
+     * The index of the last instruction of the loop.
+     */
+    unsigned int end;
+    /**
+     * One more than the index (into verify_state::loops) of the innermost
+     * loop which contains this one, or 0 if this is an outermost loop.
+     */
+    unsigned int parent;
+    /**
+     * The number of loops which contain this one, including itself.
      */
-    struct instruction_state* next_to_trace;
+    unsigned int depth;
 };
-typedef struct instruction_state instruction_state_t;
+typedef struct verify_loop verify_loop_t;
+
+/**
+ * Limits on the work which the verifier may do, along with a record of the
+ * work which it has done. A limit of zero means that there is no limit. Once
+ * any limit is exceeded, verification stops, and the prototype being traced
+ * is neither accepted nor rejected (see verify_state::over_budget).
+ */
+struct verify_budget
+{
+    /**
+     * The most times that instructions may be traced, counting an instruction
+     * again each time that it is traced again.
+     */
+    size_t max_traced;
+    /**
+     * The most times that the register state reaching the start of a basic
+     * block may be merged into the state already recorded there.
+     */
+    size_t max_merges;
+    /**
+     * The most wall-clock time, in nanoseconds, which may be spent tracing.
+     * Only time spent inside the verifier counts, so the time between a
+     * pause with @c DECODE_PAUSE and resuming is not charged.
+     */
+    uint64_t max_nanoseconds;
+    /**
+     * The work done so far, in the same units as the limits, which the
+     * verifier adds to as it goes.
+     */
+    size_t traced;
+    size_t merges;
+    uint64_t nanoseconds;
+};
+typedef struct verify_budget verify_budget_t;
 
 /**
  * Container for all the information needed during the bytecode verification
@@ -193,19 +333,122 @@ struct verify_state
     instruction_state_t* instruction_states;
 
     /**
-     * A block of memory large enough for all the reg_state_t structures
-     * required for the verification of the prototype and all (possibly
-     * indirect) sub-prototypes.
+     * A block of memory of at least verify_reg_states_size() bytes for any
+     * prototype which is verified. This holds a hash table of the distinct
+     * register states at leaders, followed by slots for the states. Leaders
+     * with the same state share a single interned reg_state_t, which is
+     * counted by reg_state::refs and released once no leader has it, so
+     * there are never more states than leaders.
      */
     unsigned char* reg_states;
 
     /**
-     * Head of a linked list of instructions which need to be traced before
-     * verification can be finished.
-     *
-     * Subsequent links are stored in instruction_state::next_to_trace.
+     * The buckets of the hash table in verify_state::reg_states, each holding
+     * one more than the index of the first state in the bucket, or 0.
+     */
+    unsigned int* reg_buckets;
+
+    /**
+     * The number of buckets in verify_state::reg_buckets, minus one.
+     */
+    unsigned int reg_bucket_mask;
+
+    /**
+     * The slots for interned states, following the hash table.
+     */
+    unsigned char* reg_slots;
+
+    /**
+     * One more than the index of the first free slot in
+     * verify_state::reg_slots which has been used before, or 0.
+     */
+    unsigned int reg_free;
+
+    /**
+     * The number of slots of verify_state::reg_slots which have ever been used
+     * for the prototype being verified. Slots beyond this are never touched.
+     */
+    size_t numreg_states;
+
+    /**
+     * The largest verify_state::numreg_states reached by any prototype
+     * verified with this state.
+     */
+    size_t peak_reg_states;
+
+    /**
+     * The opcode field of every instruction in the prototype's instruction
+     * list, as decoded by decode_instructions() before tracing begins.
+     */
+    unsigned char* ins_op;
+
+    /**
+     * The "A" (or "Ax") field of every instruction in the prototype's
+     * instruction list.
+     */
+    int* ins_a;
+
+    /**
+     * The "B" (or "Bx" or "sBx") field of every instruction in the
+     * prototype's instruction list.
+     */
+    int* ins_b;
+
+    /**
+     * The "C" field of every instruction in the prototype's instruction list.
      */
-    instruction_state_t* next_to_trace;
+    int* ins_c;
+
+    /**
+     * The set of basic blocks which need to be traced before verification
+     * can be finished, as a bitset with one bit per instruction, which is
+     * set if (and only if) the instruction is a leader whose block needs
+     * tracing. Blocks are traced lowest index first, and a bitset allows
+     * both adding and taking blocks in (amortised) constant time, whereas a
+     * sorted list makes heavily branching code quadratic.
+     */
+    unsigned long* trace_bits;
+
+    /**
+     * The index into verify_state::trace_bits of the first word which might
+     * have a bit set. Every earlier word is zero.
+     */
+    size_t trace_first;
+
+    /**
+     * The number of words of verify_state::trace_bits which cover the
+     * prototype being verified.
+     */
+    size_t trace_words;
+
+    /**
+     * The loops of the prototype being verified, ordered by their first
+     * instruction, with loops which are nested more deeply than
+     * VERIFY_MAX_LOOP_DEPTH treated as part of the enclosing loop.
+     */
+    verify_loop_t* loops;
+
+    /**
+     * One more than the index of the innermost loop containing each
+     * instruction of the prototype, or 0 for instructions outside of any loop.
+     */
+    unsigned int* loop_of;
+
+    /**
+     * One more than the index of the innermost loop containing the
+     * instruction most recently taken for tracing, or 0. While an instruction
+     * in this loop needs tracing, it is traced in preference to any earlier
+     * instruction (which can only be pending due to a jump back to the head of
+     * an enclosing loop), so that inner loops reach a fixed point before the
+     * code around them is traced again.
+     */
+    unsigned int trace_loop;
+
+    /**
+     * The index into verify_state::trace_bits of the first word at or after
+     * the head of verify_state::trace_loop which might have a bit set.
+     */
+    size_t trace_loop_first;
 
     /**
      * The allocator function to be used to allocate and free memory used
@@ -218,11 +461,140 @@ struct verify_state
      */
     void* allocud;
 
+    /**
+     * A cache of the fingerprints of prototypes which are known to be safe
+     * (along with all of their child prototypes), which is consulted and
+     * updated when verifying, or @c NULL. This is @c NULL after
+     * verify_state_create(), and may be set by the caller.
+     */
+    verify_cache_t* cache;
+
+    /**
+     * A flag which is polled while verifying, or @c NULL. Once the flag
+     * becomes @c true, verify_prototype_code() stops and reports the
+     * prototype as unsafe, which lets threads abandon their work as soon as
+     * another thread has rejected the bytecode. This is @c NULL after
+     * verify_state_create(), and may be set by the caller.
+     */
+    cancel_flag_t* cancel;
+
+    /**
+     * The number of times that an instruction has been traced, and the number
+     * of those times which were for an instruction which had already been
+     * traced (because a later merge changed its register state), across
+     * every prototype verified with this state.
+     */
+    size_t numtraced;
+    size_t numretraced;
+
+    /**
+     * The number of times that a register state has been merged into the
+     * state of a leader, across every prototype verified with this state.
+     */
+    size_t nummerges;
+
+    /**
+     * The budget which tracing is charged to, or @c NULL for no limits. Once
+     * the budget runs out, verify_prototype_code() stops and reports the
+     * prototype as unsafe, and sets verify_state::over_budget. This is
+     * @c NULL after verify_state_create(), and may be set by the caller.
+     */
+    verify_budget_t* budget;
+
+    /**
+     * Whether the last prototype traced was abandoned because the budget ran
+     * out, rather than because it was found to be unsafe.
+     */
+    bool over_budget;
+
+    /**
+     * The values of verify_state::numtraced and verify_state::nummerges, and
+     * of verify_clock(), beyond which the budget has run out, for the
+     * prototype being traced. These are set afresh each time tracing starts
+     * or resumes after a pause, from what is left of the budget.
+     */
+    size_t trace_limit;
+    size_t merge_limit;
+    uint64_t deadline;
+
+    /**
+     * The number of instructions which verify_decoded_prototype() traces
+     * before pausing with @c DECODE_PAUSE, so that the caller can do other
+     * work before resuming it, or 0 to never pause. Slices carry on from one
+     * prototype to the next, so that a chunk of many small prototypes pauses
+     * as often as one large prototype. This is 0 after verify_state_create(),
+     * and may be set by the caller.
+     */
+    size_t slice;
+
+    /**
+     * The value of verify_state::numtraced when the current slice began.
+     */
+    size_t slice_start;
+
+    /**
+     * Whether tracing has paused part way through the prototype, in which
+     * case the next instruction to trace is verify_state::trace_pc, in the
+     * middle of a basic block if verify_state::trace_regs is not @c NULL.
+     */
+    bool paused;
+    size_t trace_pc;
+    reg_state_t* trace_regs;
+
+    /**
+     * The size, in bytes, of verify_state::reg_states.
+     */
+    size_t max_regs_size;
+
+    /**
+     * The largest decoded_prototype::numinstructions which this state can
+     * verify, and the length of the arrays of per-instruction information.
+     */
+    size_t max_numinstructions;
+
     /**
      * Scratch space to be used to track the state of registers across the
-     * simulation of a single virtual machine instruction.
+     * simulation of a single virtual machine instruction. This is one of
+     * verify_state::scratch_regs.
+     */
+    reg_state_t* next_regs;
+
+    /**
+     * The register state which the instruction just simulated continues
+     * with. This is verify_state::next_regs, unless the instruction changed
+     * no register, in which case it is the state which the instruction was
+     * simulated on. At a leader which already holds that interned state,
+     * merging then costs a single pointer comparison.
+     */
+    reg_state_t* next_state;
+
+    /**
+     * Two reg_state_t structures large enough for any register window, held
+     * in verify_state::scratch_space: one holding the state prior to the
+     * instruction being traced (unless that instruction is a leader), and the
+     * other being verify_state::next_regs. Within a basic block, the two swap
+     * roles after each instruction.
+     */
+    reg_state_t* scratch_regs[2];
+
+    /**
+     * A third reg_state_t in verify_state::scratch_space, into which the
+     * state of a leader is merged before being interned.
+     */
+    reg_state_t* merge_regs;
+
+    /**
+     * Set by the simulation of an instruction which is followed by a
+     * non-leader, so that tracing carries on with that instruction, from the
+     * register state in verify_state::next_state.
      */
-    reg_state_t next_regs;
+    bool fallthrough;
+
+    /**
+     * The start of the space for verify_state::scratch_regs and
+     * verify_state::merge_regs.
+     */
+    reg_state_t scratch_space;
 };
 typedef struct verify_state verify_state_t;
 
@@ -275,22 +647,204 @@ bool reg_state_usetop(reg_state_t* state, reg_index_t base);
 void reg_state_copy(verify_state_t* vs, reg_state_t* to, reg_state_t* from);
 
 /**
- * Merge two reg_state_t structures together to create one that describes
- * the commonalities of both register states.
+ * Compute an upper bound on the register state storage needed to verify a
+ * single prototype, from the number of instructions which end a basic block
+ * and the size of its register window. This allows for every leader having a
+ * distinct state, and for the hash table used to share states.
  *
- * @param vs The verify_state_t to which @p to and @p from belong.
- * @param to The reg_state_t to use as one of the merge sources, and to place
- *           the result into.
- * @param from The other merge source.
+ * @param prototype A prototype whose decoded_prototype::code has not been
+ *                  freed.
+ *
+ * @return A number of bytes, or <tt>(size_t)-1</tt> if the bound does not fit
+ *         in a size_t.
+ */
+size_t verify_reg_states_size(decoded_prototype_t* prototype);
+
+/**
+ * Find the largest register state storage (see verify_reg_states_size()) and
+ * the largest number of instructions needed by any prototype in a tree.
+ *
+ * @param prototype The root of the tree.
+ * @param regs_size A variable which will be raised to the largest
+ *                  verify_reg_states_size(), if it is less than that.
+ * @param numinstructions A variable which will be raised to the largest
+ *                        decoded_prototype::numinstructions, if it is less
+ *                        than that.
+ */
+void find_max_size(decoded_prototype_t* prototype, size_t* regs_size,
+                   size_t* numinstructions);
+
+/**
+ * Compute decoded_prototype::fingerprint for a single prototype, from its
+ * instructions, constant types, upvalue descriptors, sizes, and the
+ * fingerprints of its child prototypes. The fingerprint is a chunk_hash_t
+ * digest under chunk_key_process(), so it cannot be predicted by whoever
+ * wrote the bytecode, and is only meaningful within the process.
+ *
+ * @param prototype A prototype whose decoded_prototype::code has not been
+ *                  freed, and whose child prototypes have already had their
+ *                  fingerprints computed.
+ */
+void fingerprint_prototype(decoded_prototype_t* prototype);
+
+/**
+ * Compute decoded_prototype::fingerprint for every prototype in a tree,
+ * children before parents.
+ */
+void fingerprint_tree(decoded_prototype_t* prototype);
+
+/**
+ * Query whether a prototype, along with all of its child prototypes, is
+ * recorded in a cache as being safe.
+ *
+ * @param cache The cache to consult. May be @c NULL.
+ * @param prototype A prototype whose fingerprint has been computed.
+ */
+bool is_prototype_cached(verify_cache_t* cache,
+                         decoded_prototype_t* prototype);
+
+/**
+ * Record in a cache that a prototype, along with all of its child
+ * prototypes, is safe.
+ *
+ * @param cache The cache to update. May be @c NULL.
+ * @param prototype A prototype whose fingerprint has been computed.
+ */
+void cache_prototype(verify_cache_t* cache, decoded_prototype_t* prototype);
+
+/**
+ * Allocate a verify_state_t along with all the scratch space needed for
+ * verifying prototypes up to a given size.
  *
- * @return 0 if the two merge sources are incompatible and could not be merged
- *         (for example if merging would produce a register which could be an
- *         open upvalue without a known value). 1 if merging was successful and
- *         resulted in a change to @p to. -1 if merging was successful but did
- *         not result in any changes to @p to.
+ * @param alloc The allocator function to use.
+ * @param ud An opaque pointer which will be passed to @p alloc.
+ * @param max_regs_size The largest verify_reg_states_size() of any prototype
+ *                      which will be verified.
+ * @param max_numinstructions The largest number of instructions of any
+ *                            prototype which will be verified. If zero, then
+ *                            verify_state_reserve() must be called before
+ *                            anything can be verified.
+ *
+ * @return @c NULL on memory allocation failure, otherwise a state which must
+ *         be freed with verify_state_free().
+ */
+verify_state_t* verify_state_create(lua_Alloc alloc, void* ud,
+                                    size_t max_regs_size,
+                                    size_t max_numinstructions);
+
+/**
+ * Ensure that a verify_state_t has enough scratch space for verifying
+ * prototypes up to a given size, reallocating it if it does not.
+ *
+ * @param vs A state created by verify_state_create().
+ * @param max_regs_size The largest verify_reg_states_size() of any prototype
+ *                      which will be verified.
+ * @param max_numinstructions The largest number of instructions of any
+ *                            prototype which will be verified.
+ *
+ * @return @c false on memory allocation failure, in which case the state has
+ *         no scratch space left, but can still be freed or reserved again.
+ */
+bool verify_state_reserve(verify_state_t* vs, size_t max_regs_size,
+                          size_t max_numinstructions);
+
+/**
+ * Free a verify_state_t created by verify_state_create().
+ *
+ * @param vs The state to free. May be @c NULL.
  */
-int reg_state_merge(verify_state_t* vs, reg_state_t* to, reg_state_t* from);
+void verify_state_free(verify_state_t* vs);
+
+/**
+ * Check every instruction of a single prototype on its own, in a single pass
+ * over the instruction list: that its opcode is known, that its operands
+ * refer to registers, constants, upvalues and prototypes which exist, that
+ * an @c OP_EXTRAARG follows it if need be, and that every instruction which
+ * can follow it exists. The results are recorded in the scratch space of
+ * @p vs for verify_prototype_code() to use, but an invalid instruction in the
+ * part of the prototype which is always executed rejects it straight away.
+ *
+ * This is the first step of verify_prototype_code(), and only needs the
+ * scratch space for the instructions, so that verify_decoded_prototype() can
+ * reject garbage before reserving space for the register states.
+ *
+ * @param vs A state created by verify_state_create() with room for the
+ *           instructions of @p prototype.
+ * @param prototype The prototype to check.
+ *
+ * @return @c false if the prototype is certainly unsafe.
+ */
+bool verify_prototype_static(verify_state_t* vs,
+                             decoded_prototype_t* prototype);
+
+/**
+ * Verify the instructions of a single prototype, without verifying any of its
+ * child prototypes.
+ *
+ * As this only reads from the prototype and its immediate children, and only
+ * writes to @p vs, distinct prototypes of the same tree can be verified
+ * concurrently using distinct verify_state_t's.
+ *
+ * @param vs A state created by verify_state_create() with sizes large enough
+ *           for @p prototype.
+ * @param prototype The prototype to verify.
+ *
+ * @return @c true if the prototype's instructions are safe.
+ */
+bool verify_prototype_code(verify_state_t* vs, decoded_prototype_t* prototype);
+
+/**
+ * Verify a single prototype as it is decoded, growing the scratch space of
+ * the verify_state_t as required. This is a decode_verify_fn, and is intended
+ * to be used as decode_state::verify.
+ *
+ * If verify_state::slice is not 0, then this may pause by returning
+ * @c DECODE_PAUSE, after which it must be called again with the same
+ * prototype to carry on from where it paused.
+ *
+ * @param ud A verify_state_t created by verify_state_create().
+ * @param prototype A prototype whose child prototypes have already been
+ *                  verified.
+ *
+ * @return @c DECODE_YIELD if the prototype's instructions are safe,
+ *         @c DECODE_UNSAFE if they are not, @c DECODE_BUDGET if
+ *         verify_state::budget ran out first, @c DECODE_PAUSE, or
+ *         @c DECODE_ERROR_MEM.
+ */
+int verify_decoded_prototype(void* ud, decoded_prototype_t* prototype);
 
 bool verify(decoded_prototype_t* prototype, lua_Alloc alloc, void* ud);
 
+/**
+ * Verify a tree of prototypes in the same way as verify_cached(), charging
+ * the work to a budget.
+ *
+ * @param cache The cache to use, or @c NULL.
+ * @param budget The budget to charge, or @c NULL for no limits.
+ *
+ * @return @c DECODE_YIELD if the tree is safe, @c DECODE_UNSAFE if it is not,
+ *         @c DECODE_BUDGET if the budget ran out first, or
+ *         @c DECODE_ERROR_MEM.
+ */
+int verify_budgeted(decoded_prototype_t* prototype, lua_Alloc alloc, void* ud,
+                    verify_cache_t* cache, verify_budget_t* budget);
+
+/**
+ * Verify a tree of prototypes in the same way as verify(), but skip any
+ * subtree whose fingerprint is recorded in a cache, and record the
+ * fingerprint of every subtree which is found to be safe.
+ *
+ * @param cache The cache to use. If @c NULL, this is the same as verify().
+ */
+bool verify_cached(decoded_prototype_t* prototype, lua_Alloc alloc, void* ud,
+                   verify_cache_t* cache);
+
+/**
+ * Read a monotonic clock, as used for verify_budget::max_nanoseconds.
+ *
+ * @return The time in nanoseconds, from an arbitrary origin. Where no
+ *         monotonic clock is available, the processor time is used instead.
+ */
+uint64_t verify_clock(void);
+
 #endif /* _LBCV_VERIFIER_H_ */
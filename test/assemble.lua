@@ -138,8 +138,11 @@ Labels are of the form "Name:", and assign a name to the next instruction. This
 name can then be used anywhere in the current prototype to mean the offset
 between the instruction it is used in, and the instruction it labels.
 
+The bytecode has the byte order of the running interpreter, unless the optional
+second argument is "big" or "little".
+
 ]==]
-local function assemble(code)
+local function assemble(code, byteorder)
   ----- Parse text into structures -----
   local constants = {} -- Map of constant name to constant value
   local proto = { -- The current prototype
@@ -268,7 +271,7 @@ local function assemble(code)
   
   ----- Compile (spit out bytecode) -----
   local header = string.dump(function()end)
-  local endian = header:byte(7) == 0 and "big" or "little"
+  local endian = byteorder or (header:byte(7) == 0 and "big" or "little")
   local sizeof_int = header:byte(8)
   local sizeof_sizet = header:byte(9)
   local sizeof_instruction = header:byte(10)
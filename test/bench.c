@@ -0,0 +1,569 @@
+/* Copyright (c) 2010 Peter Cawley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+/*
+** Benchmarks of lbcv.
+**
+** lbcv-bench [-n copies] [-t maxthreads] [-r repeats] file...
+**   Verifies many copies of some files of bytecode with verify_many_threaded()
+**   using 1, 2, 4, ... threads, and reports how throughput scales.
+**
+** lbcv-bench -w [instructions [registers]]
+**   Verifies a generated prototype shaped like a long if/elseif chain, in
+**   which every branch jumps forward to a distinct target, at a range of
+**   sizes up to the given number of instructions, and reports the time per
+**   instruction. This should stay flat as the prototype grows. Every one of
+**   the given number of registers is live throughout, so a large register
+**   window shows the cost of copying and merging register state.
+**
+** lbcv-bench -l [depth [filler]]
+**   Verifies generated prototypes of nested numeric for loops, up to the
+**   given depth, whose innermost bodies also jump back to the outermost loop,
+**   and reports how many instructions had to be traced more than once. Each
+**   loop body starts with the given number of filler instructions; over 64
+**   spreads a loop across several words of the tracing bitset.
+**
+** lbcv-bench -m [instructions]
+**   Verifies generated chunks made of one long prototype using two registers,
+**   with a branch every eight instructions, and one tiny child prototype using
+**   250 registers, at a range of sizes up to the given number of
+**   instructions, and reports the peak scratch memory reserved for verifying
+**   them, and the largest number of distinct register states held at once.
+*/
+
+#include "batch.h"
+#include "opcodes.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef LBCV_USE_PTHREADS
+#include <sys/time.h>
+#endif
+
+static void* bench_alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    (void)ud;
+    (void)osize;
+    if(nsize == 0)
+    {
+        free(ptr);
+        return NULL;
+    }
+    return realloc(ptr, nsize);
+}
+
+/* Tracks the number of bytes allocated through it, and the peak of that. */
+struct bench_usage
+{
+    size_t current;
+    size_t peak;
+};
+
+static void* counting_alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    struct bench_usage* usage = (struct bench_usage*)ud;
+    void* result = bench_alloc(NULL, ptr, osize, nsize);
+    if(nsize != 0 && result == NULL)
+        return NULL;
+    if(ptr != NULL)
+        usage->current -= osize;
+    usage->current += nsize;
+    if(usage->current > usage->peak)
+        usage->peak = usage->current;
+    return result;
+}
+
+static double now(void)
+{
+#ifdef LBCV_USE_PTHREADS
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + (double)tv.tv_usec * 1e-6;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static unsigned char* read_file(const char* path, size_t* len)
+{
+    unsigned char* data = NULL;
+    size_t cap = 0;
+    FILE* f = fopen(path, "rb");
+    if(f == NULL)
+        return NULL;
+    *len = 0;
+    for(;;)
+    {
+        if(*len == cap)
+        {
+            unsigned char* bigger;
+            cap = cap ? cap * 2 : 65536;
+            bigger = (unsigned char*)realloc(data, cap);
+            if(bigger == NULL)
+                break;
+            data = bigger;
+        }
+        *len += fread(data + *len, 1, cap - *len, f);
+        if(*len != cap)
+            break;
+    }
+    fclose(f);
+    return data;
+}
+
+/*
+** Build a prototype of about `numinstructions' instructions, made of `n'
+** tests each followed by a jump to a distinct instruction in a run of `n'
+** loads, so that up to `n' forward targets are pending at once.
+*/
+static decoded_prototype_t* make_branchy(size_t numinstructions,
+                                         unsigned int numregs)
+{
+    static unsigned char constant_types[1] = {LUA_TNUMBER};
+    decoded_prototype_t* proto;
+    unsigned int* code;
+    size_t n = numinstructions / 3, i;
+
+    proto = (decoded_prototype_t*)calloc(1, sizeof(decoded_prototype_t));
+    code = (unsigned int*)malloc((3 * n + 1) * sizeof(unsigned int)
+        + sizeof(int));
+    if(proto == NULL || code == NULL)
+        return NULL;
+    for(i = 0; i < n; ++i)
+    {
+        /* if r0 == k0 then goto load_i end */
+        code[2 * i] = OP_EQ | (0u << POS_A) | (0u << POS_B)
+            | ((unsigned int)BITRK << POS_C);
+        code[2 * i + 1] = OP_JMP | ((unsigned int)(2 * n - i - 2
+            + MAXARG_sBx) << POS_Bx);
+    }
+    for(i = 0; i < n; ++i)
+        code[2 * n + i] = OP_LOADK | (1u << POS_A) | (0u << POS_Bx);
+    code[3 * n] = OP_RETURN | (0u << POS_A) | (1u << POS_B);
+
+    proto->code = (unsigned char*)code;
+    proto->instructionsize = sizeof(unsigned int);
+    proto->numinstructions = 3 * n + 1;
+    proto->constant_types = constant_types;
+    proto->numconstants = 1;
+    proto->numregs = numregs;
+    proto->numparams = numregs;
+    return proto;
+}
+
+static int bench_worklist(unsigned long maxinstructions, unsigned long numregs)
+{
+    unsigned long numinstructions = maxinstructions / 8;
+    if(numregs < 2)
+        numregs = 2;
+    else if(numregs > MAXARG_A)
+        numregs = MAXARG_A;
+    printf("instructions   seconds  ns/instruction\n");
+    if(numinstructions < 16)
+        numinstructions = 16;
+    for(;; numinstructions *= 2)
+    {
+        double start, elapsed;
+        decoded_prototype_t* proto;
+        bool ok;
+        if(numinstructions > maxinstructions)
+            numinstructions = maxinstructions;
+        proto = make_branchy(numinstructions, (unsigned int)numregs);
+        if(proto == NULL)
+        {
+            fprintf(stderr, "insufficient memory\n");
+            return 1;
+        }
+        start = now();
+        ok = verify(proto, bench_alloc, NULL);
+        elapsed = now() - start;
+        if(!ok)
+        {
+            fprintf(stderr, "generated prototype was rejected\n");
+            return 1;
+        }
+        printf("%12lu %9.4f %15.1f\n", (unsigned long)proto->numinstructions,
+            elapsed, elapsed * 1e9 / (double)proto->numinstructions);
+        free(proto->code);
+        free(proto);
+        if(numinstructions == maxinstructions)
+            return 0;
+    }
+}
+
+#define ABC(op, a, b, c) ((unsigned int)(op) | ((unsigned int)(a) << POS_A) \
+    | ((unsigned int)(b) << POS_B) | ((unsigned int)(c) << POS_C))
+#define AsBx(op, a, sbx) ((unsigned int)(op) | ((unsigned int)(a) << POS_A) \
+    | ((unsigned int)((sbx) + MAXARG_sBx) << POS_Bx))
+
+/* Default number of filler instructions in the body of each loop. */
+#define LOOP_FILLER 16
+
+/* Number of registers which the innermost body shifts along by one, so that
+   the innermost loop needs this many passes to reach a fixed point. */
+#define LOOP_SHIFT 8
+
+/*
+** Emit loop `level' of `depth' nested numeric for loops, and everything
+** inside it, at `code + *n', with `filler' instructions at the start of each
+** loop body. The registers from `depth * 4' hold numbers
+** before the loops, and the innermost body moves a table along them one
+** register per iteration, so the loops need many passes to reach a fixed
+** point.
+*/
+static void emit_loops(unsigned int* code, size_t* n, unsigned int level,
+                       unsigned int depth, unsigned long filler,
+                       size_t outer_body)
+{
+    unsigned int base = level * 4, x = depth * 4, y = x + LOOP_SHIFT, i;
+    size_t prep, body, f;
+    if(level == depth)
+    {
+        for(i = 0; i + 1 < LOOP_SHIFT; ++i)
+            code[(*n)++] = ABC(OP_MOVE, x + i, x + i + 1, 0);
+        code[(*n)++] = ABC(OP_NEWTABLE, x + LOOP_SHIFT - 1, 0, 0);
+        /* if y then goto <start of the outermost loop body> end */
+        code[(*n)++] = ABC(OP_TEST, y, 0, 0);
+        code[*n] = AsBx(OP_JMP, 0, (int)outer_body - (int)*n - 1);
+        ++*n;
+        return;
+    }
+    code[(*n)++] = ABC(OP_LOADK, base, 0, 0);
+    code[(*n)++] = ABC(OP_LOADK, base + 1, 0, 0);
+    code[(*n)++] = ABC(OP_LOADK, base + 2, 0, 0);
+    prep = (*n)++;
+    body = *n;
+    for(f = 0; f < filler; ++f)
+        code[(*n)++] = ABC(OP_MOVE, y, y, 0);
+    emit_loops(code, n, level + 1, depth, filler,
+        level == 0 ? body : outer_body);
+    code[prep] = AsBx(OP_FORPREP, base, (int)*n - (int)prep - 1);
+    code[*n] = AsBx(OP_FORLOOP, base, (int)body - (int)*n - 1);
+    ++*n;
+}
+
+static decoded_prototype_t* make_loops(unsigned int depth,
+                                       unsigned long filler)
+{
+    static unsigned char constant_types[1] = {LUA_TNUMBER};
+    decoded_prototype_t* proto;
+    unsigned int* code;
+    size_t n = 0, i;
+
+    proto = (decoded_prototype_t*)calloc(1, sizeof(decoded_prototype_t));
+    code = (unsigned int*)malloc((depth * (filler + 5) + 2 * LOOP_SHIFT
+        + 4) * sizeof(unsigned int) + sizeof(int));
+    if(proto == NULL || code == NULL)
+        return NULL;
+    for(i = 0; i <= LOOP_SHIFT; ++i)
+        code[n++] = ABC(OP_LOADK, depth * 4 + i, 0, 0);
+    emit_loops(code, &n, 0, depth, filler, 0);
+    code[n++] = ABC(OP_RETURN, 0, 1, 0);
+
+    proto->code = (unsigned char*)code;
+    proto->instructionsize = sizeof(unsigned int);
+    proto->numinstructions = n;
+    proto->constant_types = constant_types;
+    proto->numconstants = 1;
+    proto->numregs = depth * 4 + LOOP_SHIFT + 1;
+    return proto;
+}
+
+static int bench_loops(unsigned long maxdepth, unsigned long filler)
+{
+    unsigned long depth;
+    printf("depth  instructions    traced  retraced   seconds\n");
+    for(depth = 1; depth <= maxdepth; depth *= 2)
+    {
+        double start, elapsed;
+        decoded_prototype_t* proto = make_loops((unsigned int)depth, filler);
+        verify_state_t* vs;
+        bool ok;
+        if(proto == NULL || depth * 4 + LOOP_SHIFT + 1 > MAXARG_A)
+        {
+            fprintf(stderr, "depth too large\n");
+            return 1;
+        }
+        vs = verify_state_create(bench_alloc, NULL,
+            verify_reg_states_size(proto), proto->numinstructions);
+        if(vs == NULL)
+        {
+            fprintf(stderr, "insufficient memory\n");
+            return 1;
+        }
+        start = now();
+        ok = verify_prototype_code(vs, proto);
+        elapsed = now() - start;
+        if(!ok)
+        {
+            fprintf(stderr, "generated prototype was rejected\n");
+            return 1;
+        }
+        printf("%5lu %13lu %9lu %9lu %9.4f\n", depth,
+            (unsigned long)proto->numinstructions,
+            (unsigned long)vs->numtraced, (unsigned long)vs->numretraced,
+            elapsed);
+        verify_state_free(vs);
+        free(proto->code);
+        free(proto);
+    }
+    return 0;
+}
+
+static decoded_prototype_t* make_wide_child(void)
+{
+    static unsigned char constant_types[1] = {LUA_TNUMBER};
+    decoded_prototype_t* proto;
+    unsigned int* code;
+
+    proto = (decoded_prototype_t*)calloc(1, sizeof(decoded_prototype_t));
+    code = (unsigned int*)malloc(2 * sizeof(unsigned int) + sizeof(int));
+    if(proto == NULL || code == NULL)
+        return NULL;
+    code[0] = ABC(OP_LOADK, 249, 0, 0);
+    code[1] = ABC(OP_RETURN, 0, 1, 0);
+    proto->code = (unsigned char*)code;
+    proto->instructionsize = sizeof(unsigned int);
+    proto->numinstructions = 2;
+    proto->constant_types = constant_types;
+    proto->numconstants = 1;
+    proto->numregs = 250;
+    return proto;
+}
+
+static decoded_prototype_t* make_long_parent(size_t numinstructions,
+                                             decoded_prototype_t** child)
+{
+    static unsigned char constant_types[1] = {LUA_TNUMBER};
+    decoded_prototype_t* proto;
+    unsigned int* code;
+    size_t n = 0;
+
+    proto = (decoded_prototype_t*)calloc(1, sizeof(decoded_prototype_t));
+    code = (unsigned int*)malloc((numinstructions + 8) * sizeof(unsigned int)
+        + sizeof(int));
+    if(proto == NULL || code == NULL)
+        return NULL;
+    while(n < numinstructions)
+    {
+        /* if r0 == k0 then r1 = k0 end, and then more of the same */
+        code[n++] = ABC(OP_EQ, 0, 0, BITRK);
+        code[n++] = AsBx(OP_JMP, 0, 1);
+        while(n % 8 != 0)
+            code[n++] = ABC(OP_LOADK, 1, 0, 0);
+    }
+    code[n++] = ABC(OP_RETURN, 0, 1, 0);
+
+    proto->code = (unsigned char*)code;
+    proto->instructionsize = sizeof(unsigned int);
+    proto->numinstructions = n;
+    proto->constant_types = constant_types;
+    proto->numconstants = 1;
+    proto->numregs = 2;
+    proto->numparams = 1;
+    proto->numprototypes = 1;
+    proto->prototypes = child;
+    return proto;
+}
+
+static int bench_memory(unsigned long maxinstructions)
+{
+    unsigned long numinstructions;
+    decoded_prototype_t* child = make_wide_child();
+    if(child == NULL)
+    {
+        fprintf(stderr, "insufficient memory\n");
+        return 1;
+    }
+    printf("instructions   peak bytes  bytes/instruction  states held\n");
+    for(numinstructions = 1000; numinstructions <= maxinstructions;
+        numinstructions *= 10)
+    {
+        struct bench_usage usage = {0, 0};
+        size_t regs_size = 0, max_numinstructions = 0;
+        decoded_prototype_t* proto = make_long_parent(numinstructions, &child);
+        verify_state_t* vs;
+        if(proto == NULL)
+        {
+            fprintf(stderr, "insufficient memory\n");
+            return 1;
+        }
+        find_max_size(proto, &regs_size, &max_numinstructions);
+        vs = verify_state_create(counting_alloc, &usage, regs_size,
+            max_numinstructions);
+        if(vs == NULL)
+        {
+            fprintf(stderr, "insufficient memory\n");
+            return 1;
+        }
+        if(!verify_prototype_code(vs, proto)
+        || !verify_prototype_code(vs, child))
+        {
+            fprintf(stderr, "generated prototype was rejected\n");
+            return 1;
+        }
+        printf("%12lu %12lu %18.1f %12lu\n",
+            (unsigned long)proto->numinstructions, (unsigned long)usage.peak,
+            (double)usage.peak / (double)proto->numinstructions,
+            (unsigned long)vs->peak_reg_states);
+        verify_state_free(vs);
+        free(proto->code);
+        free(proto);
+    }
+    free(child->code);
+    free(child);
+    return 0;
+}
+
+static int compare_seconds(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned long copies = 1000, maxthreads = 32, repeats = 3;
+    const unsigned char** chunks;
+    size_t* lens;
+    verify_result_t* results;
+    int* expected;
+    double* seconds;
+    double base = 0, totalbytes = 0;
+    size_t numfiles, numchunks, i;
+    unsigned long threads, r;
+    int argi = 1;
+
+    if(argc >= 2 && strcmp(argv[1], "-w") == 0)
+    {
+        return bench_worklist(argc >= 3 ? strtoul(argv[2], NULL, 10) : 100000,
+            argc >= 4 ? strtoul(argv[3], NULL, 10) : 2);
+    }
+    if(argc >= 2 && strcmp(argv[1], "-m") == 0)
+        return bench_memory(argc >= 3 ? strtoul(argv[2], NULL, 10) : 1000000);
+    if(argc >= 2 && strcmp(argv[1], "-l") == 0)
+    {
+        return bench_loops(argc >= 3 ? strtoul(argv[2], NULL, 10) : 32,
+            argc >= 4 ? strtoul(argv[3], NULL, 10) : LOOP_FILLER);
+    }
+    for(; argi + 1 < argc && argv[argi][0] == '-'; argi += 2)
+    {
+        unsigned long v = strtoul(argv[argi + 1], NULL, 10);
+        if(strcmp(argv[argi], "-n") == 0)
+            copies = v;
+        else if(strcmp(argv[argi], "-t") == 0)
+            maxthreads = v;
+        else if(strcmp(argv[argi], "-r") == 0)
+            repeats = v;
+        else
+            break;
+    }
+    if(argi >= argc || copies == 0 || maxthreads == 0 || repeats == 0)
+    {
+        fprintf(stderr, "usage: %s [-n copies] [-t maxthreads] [-r repeats] "
+            "file...\n", argv[0]);
+        return 1;
+    }
+
+    numfiles = (size_t)(argc - argi);
+    numchunks = numfiles * copies;
+    chunks = (const unsigned char**)malloc(numchunks * sizeof(*chunks));
+    lens = (size_t*)malloc(numchunks * sizeof(size_t));
+    results = (verify_result_t*)malloc(numchunks * sizeof(verify_result_t));
+    expected = (int*)malloc(numchunks * sizeof(int));
+    seconds = (double*)malloc(numchunks * sizeof(double));
+    if(!chunks || !lens || !results || !expected || !seconds)
+    {
+        fprintf(stderr, "insufficient memory\n");
+        return 1;
+    }
+    for(i = 0; i < numfiles; ++i)
+    {
+        size_t len, c;
+        unsigned char* data = read_file(argv[argi + i], &len);
+        if(data == NULL)
+        {
+            fprintf(stderr, "cannot read %s\n", argv[argi + i]);
+            return 1;
+        }
+        /* Separate copies, so that threads do not share cache lines. */
+        for(c = 0; c < copies; ++c)
+        {
+            unsigned char* copy = (unsigned char*)malloc(len ? len : 1);
+            if(copy == NULL)
+            {
+                fprintf(stderr, "insufficient memory\n");
+                return 1;
+            }
+            memcpy(copy, data, len);
+            chunks[c * numfiles + i] = copy;
+            lens[c * numfiles + i] = len;
+            totalbytes += (double)len;
+        }
+        free(data);
+    }
+
+    printf("%lu chunks, %.1f MB\n", (unsigned long)numchunks, totalbytes / 1e6);
+    printf("threads   seconds   chunks/s      MB/s  speedup  p50 ms  p99 ms\n");
+    for(threads = 1;; threads = threads * 2 > maxthreads ? maxthreads
+        : threads * 2)
+    {
+        double best = -1, p50, p99;
+        for(r = 0; r < repeats; ++r)
+        {
+            double start = now(), elapsed;
+            if(!verify_many_threaded(chunks, lens, numchunks,
+                (unsigned int)threads, results, bench_alloc, NULL))
+            {
+                fprintf(stderr, "insufficient memory\n");
+                return 1;
+            }
+            elapsed = now() - start;
+            if(best < 0 || elapsed < best)
+                best = elapsed;
+        }
+        for(i = 0; i < numchunks; ++i)
+        {
+            if(threads == 1)
+                expected[i] = results[i].status;
+            else if(results[i].status != expected[i])
+            {
+                fprintf(stderr, "chunk %lu: status %d with %lu threads, %d "
+                    "with 1\n", (unsigned long)i, results[i].status, threads,
+                    expected[i]);
+                return 1;
+            }
+            seconds[i] = results[i].seconds;
+        }
+        qsort(seconds, numchunks, sizeof(double), compare_seconds);
+        p50 = seconds[numchunks / 2];
+        p99 = seconds[numchunks - 1 - numchunks / 100];
+        if(threads == 1)
+            base = best;
+        printf("%7lu %9.4f %10.0f %9.1f %8.2f %7.3f %7.3f\n", threads, best,
+            (double)numchunks / best, totalbytes / best / 1e6, base / best,
+            p50 * 1e3, p99 * 1e3);
+        if(threads == maxthreads)
+            break;
+    }
+    return 0;
+}
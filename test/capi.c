@@ -0,0 +1,242 @@
+/* Copyright (c) 2010 Peter Cawley
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+of the Software, and to permit persons to whom the Software is furnished to do
+so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+/*
+** Tests of the C API in lbcv.h, and of the exit status of lbcv-check, for
+** builds which have no Lua interpreter to run test.lua with.
+**
+** lbcv-test [lbcv-check]
+**   Verifies a safe chunk, an unsafe chunk and a truncated chunk through
+**   lbcv.h, both whole and fed a byte at a time. Given the path of
+**   lbcv-check, also writes the chunks to files and checks its exit status
+**   for each of them and for a missing file. Prints one line per failure,
+**   and exits with a non-zero status if there were any.
+*/
+
+#include "lbcv.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__unix) || \
+    (defined(__APPLE__) && defined(__MACH__))
+#define LBCV_USE_WAIT
+#include <sys/wait.h>
+#endif
+
+static int failures = 0;
+
+#define EXPECT(cond) ((cond) ? (void)0 : expect_failed(#cond, __LINE__))
+
+static void expect_failed(const char* cond, int line)
+{
+    fprintf(stderr, "capi.c:%d: expected %s\n", line, cond);
+    ++failures;
+}
+
+/* The opcodes used by the chunks below, and their encodings, as in
+   lopcodes.h. */
+#define OP_MOVE 0
+#define OP_LOADK 1
+#define OP_RETURN 31
+#define OP_SETLIST 36
+#define ABC(op, a, b, c) ((unsigned long)(op) | ((unsigned long)(a) << 6) \
+    | ((unsigned long)(c) << 14) | ((unsigned long)(b) << 23))
+#define ABx(op, a, bx) ((unsigned long)(op) | ((unsigned long)(a) << 6) \
+    | ((unsigned long)(bx) << 14))
+
+static int is_little_endian(void)
+{
+    unsigned int one = 1;
+    return *(unsigned char*)&one;
+}
+
+/* Write `n' bytes of `value' at `out + pos' in the byte order of the host,
+   and return the position after them. */
+static size_t put(unsigned char* out, size_t pos, unsigned long value,
+                  size_t n)
+{
+    size_t i;
+    for(i = 0; i < n; ++i)
+    {
+        size_t byte = is_little_endian() ? i : n - 1 - i;
+        out[pos + i] = byte < sizeof(unsigned long)
+            ? (unsigned char)(value >> (byte * 8)) : 0;
+    }
+    return pos + n;
+}
+
+/*
+** Write a chunk for the host at `out', and return its length. The safe chunk
+** loads a string constant into two registers and shuffles them. The unsafe
+** chunk uses setlist on a parameter, which need not be a table.
+*/
+static size_t make_chunk(unsigned char* out, int unsafe)
+{
+    static const unsigned char signature[] = {0x1B, 'L', 'u', 'a', 0x52, 0};
+    static const unsigned char tail[] = {0x19, 0x93, '\r', '\n', 0x1A, '\n'};
+    static const unsigned long safe_code[] = {
+        ABx(OP_LOADK, 0, 0), ABx(OP_LOADK, 1, 0), ABC(OP_MOVE, 0, 1, 0),
+        ABC(OP_MOVE, 1, 0, 0), ABC(OP_RETURN, 0, 2, 0)
+    };
+    static const unsigned long unsafe_code[] = {
+        ABC(OP_SETLIST, 0, 1, 1), ABC(OP_RETURN, 0, 1, 0)
+    };
+    const unsigned long* code = unsafe ? unsafe_code : safe_code;
+    size_t i, numcode = unsafe ? sizeof(unsafe_code) / sizeof(*code)
+        : sizeof(safe_code) / sizeof(*code);
+    size_t pos = 0;
+
+    memcpy(out, signature, sizeof(signature));
+    pos += sizeof(signature);
+    out[pos++] = (unsigned char)is_little_endian();
+    out[pos++] = (unsigned char)sizeof(int);
+    out[pos++] = (unsigned char)sizeof(size_t);
+    out[pos++] = 4; /* instruction */
+    out[pos++] = 8; /* lua_Number */
+    out[pos++] = 0; /* floating point */
+    memcpy(out + pos, tail, sizeof(tail));
+    pos += sizeof(tail);
+
+    pos = put(out, pos, 0, sizeof(int)); /* linedefined */
+    pos = put(out, pos, 0, sizeof(int)); /* lastlinedefined */
+    out[pos++] = unsafe ? 2 : 0; /* numparams */
+    out[pos++] = 0; /* is_vararg */
+    out[pos++] = 2; /* maxstacksize */
+    pos = put(out, pos, numcode, sizeof(int));
+    for(i = 0; i < numcode; ++i)
+        pos = put(out, pos, code[i], 4);
+    if(unsafe)
+        pos = put(out, pos, 0, sizeof(int));
+    else
+    {
+        pos = put(out, pos, 1, sizeof(int));
+        out[pos++] = 4; /* LUA_TSTRING */
+        pos = put(out, pos, 5, sizeof(size_t));
+        memcpy(out + pos, "Test", 5);
+        pos += 5;
+    }
+    pos = put(out, pos, 0, sizeof(int)); /* prototypes */
+    pos = put(out, pos, 0, sizeof(int)); /* upvalues */
+    pos = put(out, pos, 0, sizeof(size_t)); /* source */
+    pos = put(out, pos, 0, sizeof(int)); /* lineinfo */
+    pos = put(out, pos, 0, sizeof(int)); /* locvars */
+    pos = put(out, pos, 0, sizeof(int)); /* upvalue names */
+    return pos;
+}
+
+/* Feed a chunk to `v' a byte at a time, and return the status of finishing
+   it. */
+static int feed_bytes(lbcv_verifier* v, const unsigned char* data, size_t len)
+{
+    size_t i;
+    for(i = 0; i < len; ++i)
+        lbcv_verifier_feed(v, data + i, 1);
+    return lbcv_verifier_finish(v);
+}
+
+#ifdef LBCV_USE_WAIT
+static int write_file(const char* path, const unsigned char* data, size_t len)
+{
+    FILE* f = fopen(path, "wb");
+    int ok;
+    if(f == NULL)
+        return 0;
+    ok = fwrite(data, 1, len, f) == len;
+    return fclose(f) == 0 && ok;
+}
+
+/* Run lbcv-check quietly on one path, and return its exit status, or -1 if
+   it could not be run. */
+static int run_check(const char* check, const char* path)
+{
+    char command[1024];
+    int status;
+    if(strlen(check) + strlen(path) + 32 > sizeof(command))
+        return -1;
+    sprintf(command, "'%s' -q '%s' >/dev/null 2>&1", check, path);
+    status = system(command);
+    if(status == -1 || !WIFEXITED(status))
+        return -1;
+    return WEXITSTATUS(status);
+}
+
+static void test_check(const char* check, const unsigned char* safe,
+                       size_t safelen, const unsigned char* unsafe,
+                       size_t unsafelen)
+{
+    static const char* good = "lbcv-test-good.luac";
+    static const char* bad = "lbcv-test-bad.luac";
+    static const char* missing = "lbcv-test-missing.luac";
+
+    remove(missing);
+    EXPECT(write_file(good, safe, safelen));
+    EXPECT(write_file(bad, unsafe, unsafelen));
+    EXPECT(run_check(check, good) == 0);
+    EXPECT(run_check(check, bad) == 1);
+    EXPECT(run_check(check, missing) == 1);
+    remove(good);
+    remove(bad);
+}
+#endif
+
+int main(int argc, char** argv)
+{
+    unsigned char safe[256], unsafe[256];
+    size_t safelen = make_chunk(safe, 0);
+    size_t unsafelen = make_chunk(unsafe, 1);
+    lbcv_verifier* v;
+
+    EXPECT(lbcv_verify_buffer(safe, safelen, NULL) == LBCV_OK);
+    EXPECT(lbcv_verify_buffer(unsafe, unsafelen, NULL) == LBCV_UNSAFE);
+    EXPECT(lbcv_verify_buffer(safe, safelen - 3, NULL) == LBCV_INVALID);
+    EXPECT(lbcv_verify_buffer(safe, 0, NULL) == LBCV_INVALID);
+    EXPECT(strcmp(lbcv_status_string(LBCV_UNSAFE), "verification failed")
+        == 0);
+
+    /* One state, reused after each chunk whatever its outcome. */
+    v = lbcv_verifier_new(NULL);
+    EXPECT(v != NULL);
+    if(v != NULL)
+    {
+        EXPECT(feed_bytes(v, safe, safelen) == LBCV_OK);
+        EXPECT(feed_bytes(v, unsafe, unsafelen) == LBCV_UNSAFE);
+        EXPECT(feed_bytes(v, safe, safelen - 3) == LBCV_INVALID);
+        EXPECT(feed_bytes(v, safe, safelen) == LBCV_OK);
+        lbcv_verifier_free(v);
+    }
+
+    if(argc >= 2)
+    {
+#ifdef LBCV_USE_WAIT
+        test_check(argv[1], safe, safelen, unsafe, unsafelen);
+#else
+        fprintf(stderr, "lbcv-check tests need a unix-like system\n");
+#endif
+    }
+
+    if(failures != 0)
+    {
+        fprintf(stderr, "%d failed\n", failures);
+        return 1;
+    }
+    printf("all passed\n");
+    return 0;
+}
@@ -22,6 +22,25 @@ assert(_VERSION == "Lua 5.2", "Lua 5.2 is required")
 local bv = require "lbcv"
 local asm = require "assemble"
 
+-- Assemble a chunk into a string, rather than into a reader function.
+local function assemble_string(source, byteorder)
+  local reader, parts = asm.assemble(source, byteorder), {}
+  repeat
+    parts[#parts + 1] = reader()
+  until parts[#parts] == ""
+  return table.concat(parts)
+end
+
+-- A prototype which must be rejected, as setlist needs register 0 to be a
+-- table, and here it is a parameter.
+local unsafe_body = [[
+  .params 2
+  .stack 2
+  setlist 0 1 1
+  return 0 1
+]]
+local unsafe_chunk = assemble_string(unsafe_body)
+
 local tests
 local settestenv
 do
@@ -38,6 +57,12 @@ do
           a, b = b, a
         end)))
       end},
+      {"Nil locals", function()
+        assertTrue(bv.verify(string.dump(function()
+          local a, b, c
+          return c, b, a
+        end)))
+      end},
       {"Assignments", function()
         assertTrue(bv.verify(string.dump(function()
           a, b = 0, 1
@@ -132,6 +157,13 @@ do
             for k, v in pairs(_G) do print(k, v) end
           end)))
         end},
+        {"Nested, long bodies", function()
+          -- Each body spans several words of the tracing bitset.
+          local body = string.rep("b = a\n", 100)
+          assertTrue(bv.verify(string.dump(assert(loadstring(
+            "local a, b = 0, {}\nwhile b do\n" .. body ..
+            "for i = 1, 2 do\n" .. body .. "a = b\nend\nend")))))
+        end},
       },
       {"Tables",
         {"Minimal", function()
@@ -426,6 +458,228 @@ do
         until part == ""
         assertEqual("dead", coroutine.status(co))
       end},
+      {"Swapped byte order", function()
+        -- The opposite of the running interpreter's byte order, so that
+        -- every instruction is byte swapped. Neither chunk has a multiple of
+        -- four instructions, so the tail after any vector swap runs too.
+        local swapped = string.dump(function()end):byte(7) == 0 and "little"
+          or "big"
+        assertTrue(bv.verify(assemble_string([[
+          .stack 2
+          .k k "Test"
+          loadk 0 k
+          loadk 1 k
+          move 0 1
+          move 1 0
+          move 0 1
+          move 1 0
+          return 0 2
+        ]], swapped)))
+        assertMalicious(bv.verify(assemble_string([[
+          .params 2
+          .stack 2
+          move 0 1
+          move 1 0
+          move 0 1
+          move 1 0
+          setlist 0 1 1
+          return 0 1
+        ]], swapped)))
+      end},
+      {"Early rejection", function()
+        -- The child prototype is rejected as soon as it has been decoded, so
+        -- the remainder of the main prototype should never be requested.
+        local reader = asm.assemble(".proto child\n" .. unsafe_body .. [[
+          .proto _main
+          .stack 1
+          closure 0 child
+          return 0 1
+        ]])
+        local exhausted = false
+        assertMalicious(bv.verify(function()
+          local part = reader()
+          exhausted = exhausted or part == ""
+          return part
+        end))
+        assertEqual(false, exhausted)
+      end},
+      {"Parallel verification", function()
+        -- Large enough to be decoded and verified across the thread pool.
+        local t = {"local t = {}"}
+        for i = 1, 5000 do
+          t[#t + 1] = "t[" .. i .. "] = function(a) return a + " .. i .. " end"
+        end
+        local bytecode = string.dump(assert(loadstring(table.concat(t, "\n"))))
+        bv.setthreads(4)
+        local ok, err = bv.verify(bytecode)
+        local f = bv.load(bytecode)
+        bv.setthreads(1)
+        assertTrue(ok, err)
+        assertTrue(f)
+      end},
+      {"Work budget", function()
+        local bytecode = string.dump(loadstring[[
+          local t = 0
+          for i = 1, 10 do t = t + i end
+          return t
+        ]])
+        -- The first basic block is longer than the budget, so tracing stops
+        -- just after the budget is exceeded.
+        local opts = {maxtraced = 3}
+        local ok, err = bv.verify(bytecode, opts)
+        assertEqual(nil, ok)
+        assertEqual("budget exceeded", err)
+        assertEqual(4, opts.traced)
+        opts = {maxtraced = 1000, maxmerges = 1000, maxnanoseconds = 1e9}
+        assertTrue(bv.verify(bytecode, opts))
+        assertTrue(opts.traced > 4 and opts.traced <= 1000)
+        assertTrue(opts.merges > 0)
+        local f
+        f, err = bv.load(bytecode, nil, "b", _ENV, {maxtraced = 3})
+        assertEqual(nil, f)
+        assertEqual("budget exceeded", err)
+      end},
+      {"Sliced verification", function()
+        local bytecode = string.dump(loadstring[[
+          local t = 0
+          for i = 1, 10 do
+            if i % 2 == 0 then t = t + i else t = t - i end
+          end
+          return t
+        ]])
+        -- Within a coroutine, verification yields between slices when
+        -- asked to.
+        local co = coroutine.wrap(function(chunk)
+          return "done", bv.verify(chunk, {slice = 1, yield = true})
+        end)
+        local yields = 0
+        local tag, ok = co(bytecode)
+        while tag ~= "done" do
+          yields = yields + 1
+          tag, ok = co()
+        end
+        assertTrue(yields > 0)
+        assertTrue(ok)
+        -- A reader function is paused and resumed in the same way.
+        local pos = 1
+        co = coroutine.wrap(function()
+          return "done", bv.verify(function()
+            local piece = bytecode:sub(pos, pos + 6)
+            pos = pos + 7
+            return piece
+          end, {slice = 2, yield = true})
+        end)
+        yields = 0
+        tag, ok = co()
+        while tag ~= "done" do
+          yields = yields + 1
+          tag, ok = co()
+        end
+        assertTrue(yields > 0)
+        assertTrue(ok)
+        -- The main thread cannot yield, so verification carries on in place.
+        assertTrue(bv.verify(bytecode, {slice = 1, yield = true}))
+        -- Without the option, it also carries on in place in a coroutine,
+        -- even where a C function stands in the way of yielding.
+        co = coroutine.wrap(function()
+          local t = {1, 2}
+          table.sort(t, function(a, b)
+            ok = bv.verify(bytecode, {slice = 1})
+            return a < b
+          end)
+          return "done"
+        end)
+        ok = nil
+        assertEqual("done", co())
+        assertTrue(ok)
+      end},
+      {"Result cache", function()
+        local good = string.dump(loadstring[[return "Test"]])
+        local bad = unsafe_chunk
+        bv.setcache(16, true)
+        assertTrue(bv.verify(good))
+        assertTrue(bv.verify(good))
+        assertMalicious(bv.verify(bad))
+        assertMalicious(bv.verify(bad))
+        local stats = bv.cachestats()
+        assertEqual(16, bv.setcache(0))
+        assertEqual(2, stats.hits)
+        assertEqual(2, stats.misses)
+        assertEqual(2, stats.entries)
+      end},
+      {"Prototype cache", function()
+        -- The second chunk contains the same child function as the first,
+        -- so only its main function needs verifying.
+        local first = string.dump(loadstring[[
+          local function f(a) return a + 1 end
+          return 1
+        ]])
+        local second = string.dump(loadstring[[
+          local function f(a) return a + 1 end
+          return 1, 2
+        ]])
+        bv.setprotocache(16)
+        assertTrue(bv.verify(first))
+        assertTrue(bv.verify(second))
+        local stats = bv.cachestats"prototypes"
+        assertEqual(16, bv.setprotocache(0))
+        assertEqual(1, stats.hits)
+        assertEqual(3, stats.entries)
+      end},
+      {"Cache file", function()
+        local path = os.tmpname()
+        local bytecode = string.dump(loadstring[[return "Test"]])
+        assertTrue(bv.setcachefile(path, "secret", 16))
+        assertTrue(bv.verify(bytecode))
+        assertEqual(1, bv.cachestats"file".appends)
+        -- Reopening the file is like restarting the process.
+        assertTrue(bv.setcachefile(path, "secret", 16))
+        assertTrue(bv.verify(bytecode))
+        local stats = bv.cachestats"file"
+        -- Records made with another key are not trusted.
+        assertTrue(bv.setcachefile(path, "other", 16))
+        local entries = bv.cachestats"file".entries
+        assertTrue(bv.setcachefile(nil))
+        os.remove(path)
+        assertEqual(1, stats.hits)
+        assertEqual(0, stats.appends)
+        assertEqual(1, stats.entries)
+        assertEqual(0, entries)
+      end},
+      {"Proof trailer", function()
+        local bytecode = string.dump(loadstring[[return "Test"]])
+        bv.setproofkey"secret"
+        local sealed = bv.seal(bytecode)
+        assertEqual(bytecode, sealed:sub(1, #bytecode))
+        local f = bv.load(sealed)
+        -- Without the right key, the chunk is verified in full instead.
+        bv.setproofkey"other"
+        local ok = bv.verify(sealed)
+        -- A trailer taken from another chunk does not make it trusted.
+        local forged, err = bv.verify(unsafe_chunk
+          .. sealed:sub(#bytecode + 1))
+        bv.setproofkey(nil)
+        assertEqual("Test", assertTrue(f)())
+        assertTrue(ok)
+        assertMalicious(forged, err)
+      end},
+      {"Batch verification", function()
+        local good = string.dump(loadstring[[return "Test"]])
+        local bad = unsafe_chunk
+        local big = {"local t = {}"}
+        for i = 1, 200 do
+          big[#big + 1] = "t[" .. i .. "] = function(a) return a + " .. i .. " end"
+        end
+        big = string.dump(assert(loadstring(table.concat(big, "\n"))))
+        local results = bv.verify_many{good, bad, big, good:sub(1, -2), good}
+        assertEqual(5, #results)
+        assertEqual(true, results[1])
+        assertEqual("verification failed", results[2])
+        assertEqual(true, results[3])
+        assertEqual("unable to load bytecode", results[4])
+        assertEqual(true, results[5])
+        assertEqual(0, #bv.verify_many{})
+      end},
     },
     {"Load",
       {"Text", function()
@@ -446,12 +700,38 @@ do
         assertEqual("Test", f())
       end},
       {"Malicious", function()
-        assertMalicious(bv.load(asm.assemble[[
-          .params 2
-          .stack 2
-          setlist 0 1 1
-          return 0 1
-        ]]))
+        assertMalicious(bv.load(asm.assemble(unsafe_body)))
+      end},
+      {"File", function()
+        local f = assertTrue(bv.loadfile"assemble.lua")
+        assertEqual("function", type(f().assemble))
+      end},
+      {"Binary file", function()
+        local name = os.tmpname()
+        local file = assert(io.open(name, "wb"))
+        file:write("#!/usr/bin/lua\n", string.dump(loadstring[[return "Test"]]))
+        file:close()
+        local f = assertTrue(bv.loadfile(name, "b"))
+        assertEqual("Test", f())
+        assertEqual("Test", bv.dofile(name))
+        os.remove(name)
+      end},
+      {"Malicious file", function()
+        local name = os.tmpname()
+        local file = assert(io.open(name, "wb"))
+        file:write(unsafe_chunk)
+        file:close()
+        assertMalicious(bv.loadfile(name))
+        os.remove(name)
+      end},
+      {"Byte order mark only", function()
+        local name = os.tmpname()
+        local file = assert(io.open(name, "wb"))
+        file:write("\239\187\191")
+        file:close()
+        local f = assertTrue(bv.loadfile(name))
+        os.remove(name)
+        assertEqual(nil, f())
       end},
     },
   }